@@ -0,0 +1,316 @@
+/* admission.c
+ * Per-client admission control: limits the number of concurrent
+ * connections and the rate of connections and commands of each source
+ * address, shared by all server processes.
+ */
+
+#include "admission.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+
+/* Clients are kept in a table in shared memory, created before the
+ * server forks, so that limits apply to a client regardless of the
+ * process serving each of its connections. The table is set
+ * associative: the hash of the address selects a set of ADM_WAYS
+ * entries with its own lock, so an accept or a command only locks one
+ * small set and compares at most ADM_WAYS addresses, and processes
+ * serving different clients rarely contend for the same lock. A new
+ * client replaces the least recently seen entry of its set without
+ * open connections; if all entries of the set have open connections,
+ * the client is admitted without being tracked.
+ *
+ * IPv4 clients are tracked by address, and IPv6 clients by /64
+ * prefix, since a single IPv6 host usually has a whole prefix.
+ */
+
+#define ADM_SETS 1024
+#define ADM_WAYS 8
+#define ADM_TOKEN 1000 // one token, in the units kept in buckets
+
+struct adm_bucket {
+  uint64_t tokens;   // in thousandths of a token
+  uint64_t updated;  // time of the last refill, in milliseconds
+};
+
+struct adm_entry {
+  unsigned char addr[16]; // IPv4-mapped address, or IPv6 /64 prefix
+  uint32_t used;
+  uint32_t active;        // open connections
+  uint64_t last_seen;     // time of the last connection or command
+  struct adm_bucket connections;
+  struct adm_bucket commands;
+};
+
+struct adm_set {
+  pthread_mutex_t lock;
+  struct adm_entry ways[ADM_WAYS];
+};
+
+static struct adm_set *adm_table = NULL;
+static struct adm_limits adm_limits;
+static uint64_t adm_seed; // hash seed, so clients cannot choose their set
+
+/** Internal function that returns the time of a monotonic clock, in
+ *  milliseconds.
+ */
+static uint64_t adm_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Creates the shared table used to track clients. Must be called
+ *  before the server forks. If no limit is set, nothing is created
+ *  and all clients are admitted.
+ *
+ *  Parameters: limits: Limits applied to each client.
+ *
+ *  Returns: 0 if successful, -1 otherwise (errno is set accordingly).
+ */
+int adm_init(const struct adm_limits *limits) {
+  
+  pthread_mutexattr_t mutex_attr;
+  
+  if (!limits->max_active && !limits->connections.rate && !limits->commands.rate)
+    return 0;
+  
+  adm_table = mmap(NULL, ADM_SETS * sizeof(struct adm_set), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (adm_table == MAP_FAILED) {
+    adm_table = NULL;
+    return -1;
+  }
+  
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+  for (int i = 0; i < ADM_SETS; i++)
+    pthread_mutex_init(&adm_table[i].lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+  
+  adm_limits = *limits;
+  adm_seed = adm_now() ^ (uint64_t) getpid() << 32;
+  return 0;
+}
+
+/** Parses a rate limit in the form "rate[:burst]", where rate is the
+ *  number of tokens per second and burst is the size of the bucket
+ *  (by default, the same as the rate).
+ *
+ *  Parameters: arg: String to be parsed.
+ *              rate: Pointer where the parsed limit is returned.
+ *
+ *  Returns: 0 if successful, -1 if the string is invalid.
+ */
+int adm_parse_rate(const char *arg, struct adm_rate *rate) {
+  
+  char *end;
+  unsigned long value = strtoul(arg, &end, 10);
+  unsigned long burst = value;
+  
+  if (end == arg || !value || value > 1000000)
+    return -1;
+  if (*end == ':') {
+    const char *start = end + 1;
+    burst = strtoul(start, &end, 10);
+    if (end == start || !burst || burst > 1000000)
+      return -1;
+  }
+  if (*end)
+    return -1;
+  
+  rate->rate = value;
+  rate->burst = burst;
+  return 0;
+}
+
+/** Internal function that builds the key used to track a client from
+ *  its address.
+ *
+ *  Returns: 0 if successful, -1 if the address family is unknown.
+ */
+static int adm_key(const struct sockaddr *addr, unsigned char key[16]) {
+  
+  memset(key, 0, 16);
+  if (addr->sa_family == AF_INET) {
+    key[10] = key[11] = 0xff;
+    memcpy(key + 12, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+    return 0;
+  }
+  if (addr->sa_family == AF_INET6) {
+    const struct in6_addr *in6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+    memcpy(key, in6, IN6_IS_ADDR_V4MAPPED(in6) ? 16 : 8);
+    return 0;
+  }
+  return -1;
+}
+
+/** Internal function that finds the set holding a key. */
+static int adm_hash(const unsigned char key[16]) {
+  
+  uint64_t high, low, hash = adm_seed;
+  
+  memcpy(&high, key, 8);
+  memcpy(&low, key + 8, 8);
+  hash = (hash ^ high) * 0x9e3779b97f4a7c15ULL;
+  hash = (hash ^ low) * 0x9e3779b97f4a7c15ULL;
+  return (hash >> 32) % ADM_SETS;
+}
+
+/** Internal function that locks a set, recovering it if the previous
+ *  owner died while holding the lock.
+ */
+static void adm_lock(struct adm_set *set) {
+  if (pthread_mutex_lock(&set->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&set->lock);
+}
+
+/** Internal function that refills a bucket, and takes a token from it
+ *  if one is available.
+ *
+ *  Returns: 1 if a token was taken, 0 otherwise.
+ */
+static int adm_take(struct adm_bucket *bucket, const struct adm_rate *rate, uint64_t now) {
+  
+  if (!rate->rate)
+    return 1;
+  
+  // rate tokens per second are rate thousandths of a token per millisecond
+  uint64_t capacity = (uint64_t) rate->burst * ADM_TOKEN;
+  uint64_t tokens = bucket->tokens + (now - bucket->updated) * rate->rate;
+  bucket->tokens = tokens < capacity ? tokens : capacity;
+  bucket->updated = now;
+  
+  if (bucket->tokens < ADM_TOKEN)
+    return 0;
+  bucket->tokens -= ADM_TOKEN;
+  return 1;
+}
+
+/** Internal function that finds the entry of a client in its (locked)
+ *  set, replacing an idle entry if the client is not in the set.
+ *
+ *  Returns: the entry, or NULL if all entries have open connections.
+ */
+static struct adm_entry *adm_find(struct adm_set *set, const unsigned char key[16],
+				  uint64_t now) {
+  
+  struct adm_entry *victim = NULL;
+  
+  for (int i = 0; i < ADM_WAYS; i++) {
+    struct adm_entry *entry = &set->ways[i];
+    if (!entry->used) {
+      if (!victim || victim->used)
+	victim = entry;
+      continue;
+    }
+    if (!memcmp(entry->addr, key, 16))
+      return entry;
+    if (!entry->active && (!victim || (victim->used && entry->last_seen < victim->last_seen)))
+      victim = entry;
+  }
+  
+  if (victim) {
+    memcpy(victim->addr, key, 16);
+    victim->used = 1;
+    victim->active = 0;
+    victim->connections.tokens = (uint64_t) adm_limits.connections.burst * ADM_TOKEN;
+    victim->connections.updated = now;
+    victim->commands.tokens = (uint64_t) adm_limits.commands.burst * ADM_TOKEN;
+    victim->commands.updated = now;
+  }
+  return victim;
+}
+
+/** Decides if a new connection is admitted, based on the number of
+ *  open connections and the connection rate of its source address.
+ *  An admitted connection must be released with adm_release once it
+ *  is closed.
+ *
+ *  Parameters: addr: Address of the client.
+ *              slot: Pointer where the slot of the client is returned,
+ *                    to be used in adm_release and adm_command, or
+ *                    ADM_UNTRACKED if the client is not tracked.
+ *
+ *  Returns: 1 if the connection is admitted, 0 otherwise.
+ */
+int adm_admit(const struct sockaddr *addr, int *slot) {
+  
+  unsigned char key[16];
+  int admitted = 1;
+  
+  *slot = ADM_UNTRACKED;
+  if (!adm_table || adm_key(addr, key) < 0)
+    return 1;
+  
+  uint64_t now = adm_now();
+  int index = adm_hash(key);
+  struct adm_set *set = &adm_table[index];
+  
+  adm_lock(set);
+  struct adm_entry *entry = adm_find(set, key, now);
+  if (entry) {
+    entry->last_seen = now;
+    if (adm_limits.max_active && entry->active >= adm_limits.max_active)
+      admitted = 0;
+    else if (!adm_take(&entry->connections, &adm_limits.connections, now))
+      admitted = 0;
+    else {
+      entry->active++;
+      *slot = index * ADM_WAYS + (entry - set->ways);
+    }
+  }
+  pthread_mutex_unlock(&set->lock);
+  return admitted;
+}
+
+/** Releases a connection admitted by adm_admit. Has no effect if the
+ *  client is not tracked.
+ *
+ *  Parameters: slot: Slot returned by adm_admit.
+ */
+void adm_release(int slot) {
+  
+  if (!adm_table || slot < 0)
+    return;
+  
+  struct adm_set *set = &adm_table[slot / ADM_WAYS];
+  struct adm_entry *entry = &set->ways[slot % ADM_WAYS];
+  
+  adm_lock(set);
+  if (entry->active)
+    entry->active--;
+  entry->last_seen = adm_now();
+  pthread_mutex_unlock(&set->lock);
+}
+
+/** Decides if a client may run another command, based on the command
+ *  rate of its source address (over all of its connections).
+ *
+ *  Parameters: slot: Slot returned by adm_admit.
+ *
+ *  Returns: 1 if the command may run, 0 if the rate was exceeded.
+ */
+int adm_command(int slot) {
+  
+  if (!adm_table || slot < 0 || !adm_limits.commands.rate)
+    return 1;
+  
+  struct adm_set *set = &adm_table[slot / ADM_WAYS];
+  struct adm_entry *entry = &set->ways[slot % ADM_WAYS];
+  uint64_t now = adm_now();
+  
+  adm_lock(set);
+  int allowed = adm_take(&entry->commands, &adm_limits.commands, now);
+  entry->last_seen = now;
+  pthread_mutex_unlock(&set->lock);
+  return allowed;
+}
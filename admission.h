@@ -0,0 +1,33 @@
+/* admission.h
+ * Per-client admission control: limits the number of concurrent
+ * connections and the rate of connections and commands of each source
+ * address, shared by all server processes.
+ */
+
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <sys/socket.h>
+
+#define ADM_UNTRACKED -1 // slot of clients that are not being tracked
+
+// Token bucket: rate tokens per second, holding at most burst tokens
+struct adm_rate {
+  unsigned int rate;   // zero for no limit
+  unsigned int burst;
+};
+
+struct adm_limits {
+  unsigned int max_active;     // concurrent connections, zero for no limit
+  struct adm_rate connections; // new connections
+  struct adm_rate commands;    // commands, in all connections
+};
+
+int adm_init(const struct adm_limits *limits);
+int adm_parse_rate(const char *arg, struct adm_rate *rate);
+
+int adm_admit(const struct sockaddr *addr, int *slot);
+void adm_release(int slot);
+int adm_command(int slot);
+
+#endif
@@ -0,0 +1,110 @@
+/* bench/dispatch.c
+ * Measures finding the handler of command lines with proto_verb and
+ * proto_find, against comparing the line with the name of each
+ * command, over a table with the POP3 commands.
+ */
+
+#define _GNU_SOURCE
+
+#include "protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define ROUNDS 2000000
+
+static const struct command {
+  uint32_t verb;
+  const char *name;
+} commands[] = {
+  { PROTO_VERB('u', 's', 'e', 'r'), "USER" },
+  { PROTO_VERB('p', 'a', 's', 's'), "PASS" },
+  { PROTO_VERB('q', 'u', 'i', 't'), "QUIT" },
+  { PROTO_VERB('s', 't', 'a', 't'), "STAT" },
+  { PROTO_VERB('l', 'i', 's', 't'), "LIST" },
+  { PROTO_VERB('r', 'e', 't', 'r'), "RETR" },
+  { PROTO_VERB('d', 'e', 'l', 'e'), "DELE" },
+  { PROTO_VERB('n', 'o', 'o', 'p'), "NOOP" },
+  { PROTO_VERB('r', 's', 'e', 't'), "RSET" },
+  { PROTO_VERB('t', 'o', 'p', ' '), "TOP"  },
+  { PROTO_VERB('u', 'i', 'd', 'l'), "UIDL" },
+  { PROTO_VERB('c', 'a', 'p', 'a'), "CAPA" },
+};
+
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+// Typical lines of a session, including an unknown verb
+static const char *lines[] = {
+  "USER alice@example.com\r\n", "PASS secret\r\n", "STAT\r\n", "LIST\r\n",
+  "uidl\r\n", "RETR 1\r\n", "TOP 2 10\r\n", "Dele 1\r\n", "NOOP\r\n",
+  "XYZZY\r\n", "RSET\r\n", "QUIT\r\n",
+};
+
+#define LINE_COUNT (sizeof(lines) / sizeof(lines[0]))
+
+/** Returns the current time of a monotonic clock, in seconds. */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Finds a command with proto_verb and proto_find. */
+static const struct command *find_verb(char *line, size_t length) {
+  char *args;
+  return proto_find(proto_verb(line, length, &args), commands, COMMAND_COUNT,
+		    sizeof(commands[0]));
+}
+
+/** Reference lookup, comparing the line with each command name. */
+static const struct command *find_name(char *line, size_t length) {
+  for (size_t i = 0; i < COMMAND_COUNT; i++) {
+    size_t n = strlen(commands[i].name);
+    if (length > n && !strncasecmp(line, commands[i].name, n) &&
+	(line[n] == ' ' || line[n] == '\r'))
+      return &commands[i];
+  }
+  return NULL;
+}
+
+/** Dispatches all lines ROUNDS times, and prints the number of lines
+ *  per second.
+ */
+static void run(const char *name, const struct command *(*find)(char *, size_t),
+		char *copies[], size_t lengths[]) {
+  
+  size_t found = 0;
+  double start = now();
+  for (int r = 0; r < ROUNDS; r++)
+    for (size_t i = 0; i < LINE_COUNT; i++)
+      found += find(copies[i], lengths[i]) != NULL;
+  double elapsed = now() - start;
+  
+  if (found != (size_t) ROUNDS * (LINE_COUNT - 1)) {
+    fprintf(stderr, "%s: unexpected number of commands found\n", name);
+    exit(1);
+  }
+  printf("dispatch: %-10s %8.1f M lines/s\n", name, (double) ROUNDS * LINE_COUNT / elapsed / 1e6);
+}
+
+int main(void) {
+  
+  char *copies[LINE_COUNT];
+  size_t lengths[LINE_COUNT];
+  
+  // Lines are read from a network buffer, so they are not constant
+  for (size_t i = 0; i < LINE_COUNT; i++) {
+    copies[i] = strdup(lines[i]);
+    lengths[i] = strlen(lines[i]);
+  }
+  
+  run("proto_find", find_verb, copies, lengths);
+  run("name", find_name, copies, lengths);
+  
+  for (size_t i = 0; i < LINE_COUNT; i++)
+    free(copies[i]);
+  return 0;
+}
@@ -0,0 +1,140 @@
+/* bench/groupcommit.c
+ * Measures durable deliveries from concurrent processes made durable
+ * with gc_commit, against syncing each message file and its directory
+ * on its own.
+ *
+ * Usage: bench/groupcommit [directory]
+ *
+ * Messages are written to a temporary directory created in the given
+ * directory (by default, the current one), which should be in the
+ * file system holding the mail store.
+ */
+
+#define _GNU_SOURCE
+
+#include "groupcommit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define PROCESSES    16
+#define DELIVERIES   50 // by each process
+#define MESSAGE_SIZE 4096
+#define SYNC_WINDOW  2000 // microseconds
+
+static char directory[PATH_MAX];
+
+/** Returns the current time of a monotonic clock, in seconds. */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Writes a message file, as a delivery would.
+ *
+ *  Returns: the file descriptor of the new file, or -1 on error.
+ */
+static int write_message(int process, int delivery) {
+  
+  static char data[MESSAGE_SIZE];
+  char path[PATH_MAX + 32];
+  
+  snprintf(path, sizeof(path), "%s/%d.%d", directory, process, delivery);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1 || write(fd, data, sizeof(data)) != sizeof(data)) {
+    perror(path);
+    exit(1);
+  }
+  return fd;
+}
+
+/** Deliveries of one process, each synced on its own. */
+static void sync_each(int process) {
+  
+  int dir_fd = open(directory, O_RDONLY | O_DIRECTORY);
+  for (int i = 0; i < DELIVERIES; i++) {
+    int fd = write_message(process, i);
+    if (fsync(fd) == -1 || fsync(dir_fd) == -1) {
+      perror("fsync");
+      exit(1);
+    }
+    close(fd);
+  }
+  close(dir_fd);
+}
+
+/** Deliveries of one process, made durable with gc_commit. */
+static void group_commit(int process) {
+  
+  for (int i = 0; i < DELIVERIES; i++) {
+    close(write_message(process, i));
+    if (gc_commit() == -1) {
+      perror("gc_commit");
+      exit(1);
+    }
+  }
+}
+
+/** Runs the deliveries of all processes concurrently, and prints the
+ *  number of deliveries per second.
+ */
+static void run(const char *name, void (*deliver)(int process)) {
+  
+  int status, failed = 0;
+  double start = now();
+  
+  fflush(stdout);
+  for (int p = 0; p < PROCESSES; p++)
+    if (!fork()) {
+      deliver(p);
+      _exit(0);
+    }
+  while (wait(&status) > 0)
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+  double elapsed = now() - start;
+  
+  if (failed)
+    exit(1);
+  printf("groupcommit: %-10s %8.0f deliveries/s\n", name,
+	 PROCESSES * DELIVERIES / elapsed);
+}
+
+/** Removes the messages written by a run. */
+static void remove_messages(void) {
+  
+  char path[PATH_MAX + 32];
+  for (int p = 0; p < PROCESSES; p++)
+    for (int i = 0; i < DELIVERIES; i++) {
+      snprintf(path, sizeof(path), "%s/%d.%d", directory, p, i);
+      unlink(path);
+    }
+}
+
+int main(int argc, char *argv[]) {
+  
+  snprintf(directory, sizeof(directory), "%s/groupcommitXXXXXX", argc > 1 ? argv[1] : ".");
+  if (!mkdtemp(directory)) {
+    perror(directory);
+    return 1;
+  }
+  
+  run("fsync each", sync_each);
+  remove_messages();
+  
+  if (gc_init(directory, SYNC_WINDOW, PROCESSES) == -1) {
+    perror("gc_init");
+    return 1;
+  }
+  run("gc_commit", group_commit);
+  remove_messages();
+  
+  rmdir(directory);
+  return 0;
+}
@@ -0,0 +1,120 @@
+/* bench/mailzip.c
+ * Measures compressing messages with mz_compress, and reading them
+ * back with mz_read, over message text mixing plain text lines and
+ * base64 attachments.
+ */
+
+#include "mailzip.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MESSAGE_SIZE (16 * 1024 * 1024)
+#define ROUNDS       4
+
+static const char *words[] = {
+  "the", "message", "server", "delivery", "mailbox", "please", "find",
+  "attached", "report", "meeting", "regards", "thanks", "for", "your",
+  "reply", "and", "to", "of", "a", "we", "will", "on", "Monday",
+};
+
+/** Returns the current time of a monotonic clock, in seconds. */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Fills a buffer with message text: blocks of plain text lines,
+ *  alternating with blocks of base64 lines of 76 characters.
+ */
+static void make_message(char *data, size_t size) {
+  
+  static const char base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t i = 0;
+  
+  srand(1);
+  while (i < size) {
+    int attachment = rand() % 2, lines = 20 + rand() % 200;
+    for (int l = 0; l < lines && i < size; l++) {
+      int length = 0, max_length = attachment ? 76 : 70;
+      while (length < max_length && i < size) {
+	if (attachment) {
+	  data[i++] = base64[rand() % 64];
+	  length++;
+	} else {
+	  const char *word = words[rand() % (sizeof(words) / sizeof(words[0]))];
+	  for (; *word && i < size; length++)
+	    data[i++] = *word++;
+	  if (i < size)
+	    data[i++] = ' ';
+	  length++;
+	}
+      }
+      if (i < size)
+	data[i++] = '\r';
+      if (i < size)
+	data[i++] = '\n';
+    }
+  }
+}
+
+int main(void) {
+  
+  char *message = malloc(MESSAGE_SIZE);
+  FILE *raw = tmpfile(), *compressed = tmpfile();
+  uint64_t raw_size;
+  double compress_time = 0, read_time = 0;
+  
+  make_message(message, MESSAGE_SIZE);
+  if (!raw || !compressed || write(fileno(raw), message, MESSAGE_SIZE) != MESSAGE_SIZE) {
+    perror("tmpfile");
+    return 1;
+  }
+  
+  for (int r = 0; r < ROUNDS; r++) {
+    
+    double start = now();
+    lseek(fileno(raw), 0, SEEK_SET);
+    if (ftruncate(fileno(compressed), 0) == -1 || lseek(fileno(compressed), 0, SEEK_SET) ||
+	mz_compress(fileno(raw), fileno(compressed), &raw_size) < 0) {
+      fprintf(stderr, "mailzip: compression failed\n");
+      return 1;
+    }
+    compress_time += now() - start;
+    
+    start = now();
+    mz_reader_t reader = mz_open(fileno(compressed), 0);
+    const char *data;
+    ssize_t n;
+    size_t offset = 0;
+    while (reader && (n = mz_read(reader, &data)) > 0) {
+      if (offset + n > MESSAGE_SIZE || memcmp(message + offset, data, n)) {
+	n = -1;
+	break;
+      }
+      offset += n;
+    }
+    read_time += now() - start;
+    if (!reader || n < 0 || offset != MESSAGE_SIZE) {
+      fprintf(stderr, "mailzip: contents read back do not match\n");
+      return 1;
+    }
+    mz_close(reader);
+  }
+  
+  off_t stored = lseek(fileno(compressed), 0, SEEK_END);
+  printf("mailzip: mz_compress %8.1f MB/s (stored size %.1f%%)\n",
+	 (double) ROUNDS * MESSAGE_SIZE / compress_time / 1e6, 100.0 * stored / MESSAGE_SIZE);
+  printf("mailzip: mz_read     %8.1f MB/s\n",
+	 (double) ROUNDS * MESSAGE_SIZE / read_time / 1e6);
+  
+  fclose(raw);
+  fclose(compressed);
+  free(message);
+  return 0;
+}
@@ -0,0 +1,97 @@
+/* bench/spool.c
+ * Measures spooling messages that arrive in network-sized pieces with
+ * sp_write and sp_flush, in each cache mode, against writing each
+ * piece to the file as it arrives.
+ *
+ * Usage: bench/spool [directory]
+ *
+ * Spool files are created in the given directory (by default, the
+ * current one), which should be the spool directory of the server.
+ */
+
+#define _GNU_SOURCE
+
+#include "spool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MESSAGES     16
+#define MESSAGE_SIZE (4 * 1024 * 1024)
+#define PIECE_SIZE   1448 // payload of a TCP segment over Ethernet
+
+static const char *directory = ".";
+static char piece[PIECE_SIZE];
+
+/** Returns the current time of a monotonic clock, in seconds. */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Prints the throughput of a run that started at a given time. */
+static void report(const char *name, double start) {
+  double elapsed = now() - start;
+  printf("spool: %-14s %8.1f MB/s\n", name, (double) MESSAGES * MESSAGE_SIZE / elapsed / 1e6);
+}
+
+/** Spools all messages with sp_write, in a given cache mode. */
+static void run(const char *name, int mode) {
+  
+  sp_set_cache_mode(mode);
+  double start = now();
+  for (int m = 0; m < MESSAGES; m++) {
+    spool_file_t sf = sp_create();
+    if (!sf) {
+      perror("sp_create");
+      exit(1);
+    }
+    for (size_t done = 0; done < MESSAGE_SIZE; done += PIECE_SIZE)
+      sp_write(sf, piece, done + PIECE_SIZE > MESSAGE_SIZE ? MESSAGE_SIZE - done : PIECE_SIZE);
+    if (sp_flush(sf) < 0) {
+      perror("sp_flush");
+      exit(1);
+    }
+    sp_destroy(sf);
+  }
+  report(name, start);
+}
+
+/** Spools all messages writing each piece directly to the file. */
+static void run_unbuffered(void) {
+  
+  double start = now();
+  for (int m = 0; m < MESSAGES; m++) {
+    int fd = open(directory, O_TMPFILE | O_RDWR, 0600);
+    if (fd < 0) {
+      perror(directory);
+      exit(1);
+    }
+    for (size_t done = 0; done < MESSAGE_SIZE; done += PIECE_SIZE)
+      if (write(fd, piece, done + PIECE_SIZE > MESSAGE_SIZE ? MESSAGE_SIZE - done : PIECE_SIZE) < 0) {
+	perror("write");
+	exit(1);
+      }
+    close(fd);
+  }
+  report("write per piece", start);
+}
+
+int main(int argc, char *argv[]) {
+  
+  if (argc > 1)
+    directory = argv[1];
+  sp_set_directory(directory);
+  memset(piece, 'x', sizeof(piece));
+  
+  run("normal", SP_CACHE_NORMAL);
+  run("dontneed", SP_CACHE_DONTNEED);
+  run("direct", SP_CACHE_DIRECT);
+  run_unbuffered();
+  return 0;
+}
@@ -0,0 +1,84 @@
+/* bench/userlookup.c
+ * Measures is_valid_user with a large users file, for names that
+ * exist and names that do not, against scanning the file for each
+ * check.
+ */
+
+#define _GNU_SOURCE
+
+#include "mailuser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define USERS   100000
+#define LOOKUPS 1000000
+#define SCANS   100 // lookups done by scanning the file, which is slow
+
+/** Returns the current time of a monotonic clock, in seconds. */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Reference check, reading the users file until the name is found. */
+static int scan_user(const char *username, const char *password) {
+  
+  char name[MAX_USERNAME_SIZE + 1], pass[MAX_PASSWORD_SIZE + 1];
+  int found = 0;
+  FILE *file = fopen("users.txt", "r");
+  
+  if (!file)
+    return 0;
+  while (!found && fscanf(file, "%255s %255s", name, pass) == 2)
+    found = !strcasecmp(name, username) && (!password || !strcmp(pass, password));
+  fclose(file);
+  return found;
+}
+
+/** Runs a number of checks of random users, half of which exist, and
+ *  prints the number of checks per second.
+ */
+static void run(const char *name, int (*check)(const char *, const char *), int lookups) {
+  
+  char username[64];
+  int found = 0;
+  
+  srand(1);
+  double start = now();
+  for (int i = 0; i < lookups; i++) {
+    int n = rand() % (2 * USERS);
+    snprintf(username, sizeof(username), "user%d@example.com", n);
+    found += check(username, "secret") != 0;
+  }
+  double elapsed = now() - start;
+  
+  printf("userlookup: %-13s %12.0f checks/s (%d of %d found)\n", name,
+	 lookups / elapsed, found, lookups);
+}
+
+int main(void) {
+  
+  char directory[] = "/tmp/userlookupXXXXXX";
+  if (!mkdtemp(directory) || chdir(directory) == -1) {
+    perror(directory);
+    return 1;
+  }
+  
+  FILE *file = fopen("users.txt", "w");
+  for (int i = 0; i < USERS; i++)
+    fprintf(file, "user%d@example.com secret\n", i);
+  fclose(file);
+  
+  run("is_valid_user", is_valid_user, LOOKUPS);
+  run("file scan", scan_user, SCANS);
+  
+  unlink("users.txt");
+  rmdir(directory);
+  return 0;
+}
@@ -0,0 +1,131 @@
+/* datascan.c
+ * Scans blocks of message data for line terminators that need special
+ * handling while spooling a message.
+ *
+ * Message data is stored in the same form it is received (CRLF line
+ * endings, dot-stuffed), so most of a message can be copied as is. The
+ * only positions that need attention are line-feeds not preceded by a
+ * carriage return (bare LF, which must be converted to CRLF) and
+ * line-feeds followed by a '.', which may start the end-of-data line.
+ * On x86-64 the scan is done 16 (SSE2) or 32 (AVX2, if supported by
+ * the CPU) bytes at a time; other platforms use memchr.
+ */
+
+#include "datascan.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define DS_VECTOR 1
+#endif
+
+#ifdef DS_VECTOR
+
+/** Internal function that scans data[i..size) using SSE2, 16 bytes at
+ *  a time, stopping at the first block containing a bare LF or a LF
+ *  followed by '.'. Requires i >= 1, since the byte before each block
+ *  is also loaded.
+ *
+ *  Returns: the position where the scalar scan must continue.
+ */
+static size_t ds_scan_sse2(const char *data, size_t i, size_t size) {
+  
+  const __m128i lf  = _mm_set1_epi8('\n');
+  const __m128i cr  = _mm_set1_epi8('\r');
+  const __m128i dot = _mm_set1_epi8('.');
+  
+  // Each block also needs the byte that follows it
+  for (; i + 17 <= size; i += 16) {
+    __m128i cur = _mm_loadu_si128((const __m128i *) (data + i));
+    unsigned int lfs = _mm_movemask_epi8(_mm_cmpeq_epi8(cur, lf));
+    if (!lfs)
+      continue;
+    __m128i prev = _mm_loadu_si128((const __m128i *) (data + i - 1));
+    __m128i next = _mm_loadu_si128((const __m128i *) (data + i + 1));
+    unsigned int crs  = _mm_movemask_epi8(_mm_cmpeq_epi8(prev, cr));
+    unsigned int dots = _mm_movemask_epi8(_mm_cmpeq_epi8(next, dot));
+    unsigned int found = lfs & (~crs | dots);
+    if (found)
+      return i + __builtin_ctz(found);
+  }
+  return i;
+}
+
+/** Same as ds_scan_sse2, using AVX2 to process 32 bytes at a time. */
+__attribute__ ((target("avx2")))
+static size_t ds_scan_avx2(const char *data, size_t i, size_t size) {
+  
+  const __m256i lf  = _mm256_set1_epi8('\n');
+  const __m256i cr  = _mm256_set1_epi8('\r');
+  const __m256i dot = _mm256_set1_epi8('.');
+  
+  for (; i + 33 <= size; i += 32) {
+    __m256i cur = _mm256_loadu_si256((const __m256i *) (data + i));
+    unsigned int lfs = _mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, lf));
+    if (!lfs)
+      continue;
+    __m256i prev = _mm256_loadu_si256((const __m256i *) (data + i - 1));
+    __m256i next = _mm256_loadu_si256((const __m256i *) (data + i + 1));
+    unsigned int crs  = _mm256_movemask_epi8(_mm256_cmpeq_epi8(prev, cr));
+    unsigned int dots = _mm256_movemask_epi8(_mm256_cmpeq_epi8(next, dot));
+    unsigned int found = lfs & (~crs | dots);
+    if (found)
+      return i + __builtin_ctz(found);
+  }
+  return ds_scan_sse2(data, i, size);
+}
+
+/** Internal function that picks the widest implementation supported
+ *  by the CPU, the first time it is called.
+ */
+static size_t ds_scan_vector(const char *data, size_t i, size_t size) {
+  
+  static size_t (*impl)(const char *, size_t, size_t) = NULL;
+  if (!impl) {
+    __builtin_cpu_init();
+    impl = __builtin_cpu_supports("avx2") ? ds_scan_avx2 : ds_scan_sse2;
+  }
+  return impl(data, i, size);
+}
+
+#endif
+
+/** Finds the first line-feed in a block of message data that cannot
+ *  be copied as is: a line-feed not preceded by a carriage return
+ *  (bare LF), or a line-feed followed by a '.' in the same block.
+ *  Everything before the returned position contains only CRLF line
+ *  endings, none followed by a '.'.
+ *
+ *  Parameters: data: block of data to be scanned.
+ *              size: number of bytes in the block.
+ *              prev_cr: non-zero if the byte preceding the block
+ *                       (e.g., the last byte of the previous block)
+ *                       is a carriage return.
+ *
+ *  Returns: the position of the first such line-feed, or size if the
+ *           block does not contain one.
+ */
+size_t ds_scan(const char *data, size_t size, int prev_cr) {
+  
+  size_t i;
+  const char *lf;
+  
+  if (size == 0)
+    return 0;
+  
+  // The first byte is checked against the previous block
+  if (data[0] == '\n' && (!prev_cr || (size > 1 && data[1] == '.')))
+    return 0;
+  i = 1;
+  
+#ifdef DS_VECTOR
+  i = ds_scan_vector(data, i, size);
+#endif
+  
+  while (i < size && (lf = memchr(data + i, '\n', size - i)) != NULL) {
+    i = lf - data;
+    if (data[i - 1] != '\r' || (i + 1 < size && data[i + 1] == '.'))
+      return i;
+    i++;
+  }
+  return size;
+}
@@ -0,0 +1,13 @@
+/* datascan.h
+ * Scans blocks of message data for line terminators that need special
+ * handling while spooling a message.
+ */
+
+#ifndef _DATA_SCAN_H_
+#define _DATA_SCAN_H_
+
+#include <string.h>
+
+size_t ds_scan(const char *data, size_t size, int prev_cr);
+
+#endif
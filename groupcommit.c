@@ -0,0 +1,343 @@
+/* groupcommit.c
+ * Makes delivered messages durable, sharing a single file system sync
+ * among all deliveries that complete around the same time.
+ */
+
+#define _GNU_SOURCE
+
+#include "groupcommit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* The state is kept in shared memory created before the server forks,
+ * so that deliveries in all processes (workers or per-connection
+ * processes) take part in the same batches. Each commit takes a
+ * ticket. If no sync is running, the process becomes the leader: it
+ * waits up to the batching window for other deliveries (or until the
+ * batch is full), then syncs the whole file system containing the
+ * mail store, which covers the message files, mailbox directories and
+ * indexes of everybody in the batch. Other processes wait until a sync
+ * that started after they took their ticket completes.
+ */
+struct group_commit {
+  pthread_mutex_t lock;
+  pthread_cond_t  arrived;   // signalled when a new ticket is taken
+  pthread_cond_t  completed; // signalled when a sync completes
+  uint64_t        requested; // last ticket taken
+  uint64_t        synced;    // all tickets up to this one are durable
+  pid_t           leader;    // process running a sync, or 0
+};
+
+#define LEADER_CHECK_INTERVAL 1 // seconds between checks for a dead leader
+
+/* Deliveries committed with gc_commit_async are waited for by a thread
+ * of the process, so that the event loop is never blocked. Tickets
+ * are waited for in order, each wait covering all tickets taken so
+ * far, and the outcome is kept until the event loop asks for it.
+ */
+struct committer {
+  pthread_mutex_t lock;
+  pthread_cond_t  wanted_cond;  // signalled when a new ticket is taken
+  uint64_t        wanted;       // last ticket taken by the process
+  uint64_t        answered;     // outcome known up to this ticket
+  uint64_t        failed_first; // range of tickets whose sync failed
+  uint64_t        failed_last;  // (zero if none)
+  int             error;        // errno of the last failed sync
+  int             notify_fd;    // eventfd written once a sync completes
+  pid_t           pid;          // process running the thread, or 0
+};
+
+static struct group_commit *group_commit = NULL;
+static struct committer committer;
+static int sync_fd = -1;
+static long batch_window;
+static uint64_t batch_limit;
+
+/** Initializes group commit, enabling durable delivery. Must be called
+ *  before the server creates any process.
+ *
+ *  Parameters: directory: Any directory in the file system containing
+ *                         the mail store.
+ *              window_usec: Maximum time, in microseconds, a sync is
+ *                           delayed waiting for other deliveries.
+ *              batch_size: Number of deliveries that start a sync
+ *                          without waiting for the window to end.
+ *
+ *  Returns: 0 if successful, -1 otherwise (errno is set accordingly).
+ */
+int gc_init(const char *directory, long window_usec, int batch_size) {
+  
+  pthread_mutexattr_t mutex_attr;
+  pthread_condattr_t cond_attr;
+  
+  sync_fd = open(directory, O_RDONLY | O_DIRECTORY);
+  if (sync_fd < 0)
+    return -1;
+  
+  group_commit = mmap(NULL, sizeof(struct group_commit), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (group_commit == MAP_FAILED) {
+    group_commit = NULL;
+    close(sync_fd);
+    return -1;
+  }
+  
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&group_commit->lock, &mutex_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+  
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&group_commit->arrived, &cond_attr);
+  pthread_cond_init(&group_commit->completed, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  
+  group_commit->requested = group_commit->synced = 0;
+  group_commit->leader = 0;
+  batch_window = window_usec;
+  batch_limit = batch_size > 0 ? batch_size : 1;
+  return 0;
+}
+
+/** Indicates if durable delivery was enabled with gc_init.
+ *
+ *  Returns: a non-zero value if enabled, zero otherwise.
+ */
+int gc_enabled(void) {
+  return group_commit != NULL;
+}
+
+/** Internal function that locks the shared state, recovering it if
+ *  the previous owner died while holding the lock.
+ */
+static void gc_lock(void) {
+  if (pthread_mutex_lock(&group_commit->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&group_commit->lock);
+}
+
+/** Internal function that waits on a condition until an absolute
+ *  (monotonic) time.
+ *
+ *  Returns: zero if signalled, ETIMEDOUT if the time has passed.
+ */
+static int gc_wait(pthread_cond_t *cond, const struct timespec *deadline) {
+  int rv = pthread_cond_timedwait(cond, &group_commit->lock, deadline);
+  if (rv == EOWNERDEAD)
+    pthread_mutex_consistent(&group_commit->lock);
+  return rv;
+}
+
+/** Internal function that computes a monotonic time a number of
+ *  microseconds in the future.
+ */
+static void gc_deadline(struct timespec *deadline, long usec) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += usec / 1000000;
+  deadline->tv_nsec += (usec % 1000000) * 1000;
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+/** Internal function that waits, with the shared state locked, until
+ *  a ticket is durable, leading a sync if no other process is running
+ *  one.
+ *
+ *  Returns: 0 if successful, -1 if the sync failed (errno is set
+ *           accordingly).
+ */
+static int gc_sync(uint64_t ticket) {
+  
+  struct timespec deadline;
+  int rv = 0;
+  
+  while (group_commit->synced < ticket) {
+    
+    if (group_commit->leader) {
+      // Another process is syncing; take over if it died meanwhile
+      gc_deadline(&deadline, LEADER_CHECK_INTERVAL * 1000000L);
+      if (gc_wait(&group_commit->completed, &deadline) == ETIMEDOUT &&
+	  group_commit->leader && kill(group_commit->leader, 0) < 0 && errno == ESRCH)
+	group_commit->leader = 0;
+      continue;
+    }
+    
+    // Become the leader, and wait for more deliveries to join the batch
+    group_commit->leader = getpid();
+    gc_deadline(&deadline, batch_window);
+    while (group_commit->requested - group_commit->synced < batch_limit &&
+	   gc_wait(&group_commit->arrived, &deadline) != ETIMEDOUT);
+    
+    uint64_t target = group_commit->requested;
+    pthread_mutex_unlock(&group_commit->lock);
+    rv = syncfs(sync_fd);
+    int error = errno;
+    gc_lock();
+    
+    if (rv == 0 && group_commit->synced < target)
+      group_commit->synced = target;
+    group_commit->leader = 0;
+    pthread_cond_broadcast(&group_commit->completed);
+    if (rv < 0) {
+      errno = error;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Internal function that takes a ticket for the deliveries completed
+ *  so far by this process.
+ */
+static uint64_t gc_ticket(void) {
+  
+  uint64_t ticket;
+  
+  gc_lock();
+  ticket = ++group_commit->requested;
+  pthread_cond_signal(&group_commit->arrived);
+  pthread_mutex_unlock(&group_commit->lock);
+  return ticket;
+}
+
+/** Waits until all messages delivered so far by this process are
+ *  durable, i.e., written to stable storage together with the
+ *  directory entries pointing to them. Deliveries from all processes
+ *  that complete within the batching window share a single sync. If
+ *  durable delivery is not enabled, returns immediately.
+ *
+ *  Returns: 0 if successful, -1 if the sync failed.
+ */
+int gc_commit(void) {
+  
+  uint64_t ticket;
+  int rv;
+  
+  if (!group_commit)
+    return 0;
+  
+  ticket = gc_ticket();
+  gc_lock();
+  rv = gc_sync(ticket);
+  pthread_mutex_unlock(&group_commit->lock);
+  return rv;
+}
+
+/** Internal function run by the committer thread of a process, which
+ *  waits for the tickets taken by gc_commit_async on behalf of the
+ *  event loop, always for the latest one, and writes to the notify
+ *  descriptor every time a sync completes.
+ */
+static void *gc_committer_thread(void *arg) {
+  
+  const uint64_t one = 1;
+  
+  pthread_mutex_lock(&committer.lock);
+  while (1) {
+    
+    while (committer.answered >= committer.wanted)
+      pthread_cond_wait(&committer.wanted_cond, &committer.lock);
+    uint64_t ticket = committer.wanted;
+    pthread_mutex_unlock(&committer.lock);
+    
+    gc_lock();
+    int rv = gc_sync(ticket);
+    int error = errno;
+    pthread_mutex_unlock(&group_commit->lock);
+    
+    pthread_mutex_lock(&committer.lock);
+    if (rv < 0) {
+      // Failed ranges are merged, so a ticket may be reported as
+      // failed when it was not, but never the other way around
+      if (!committer.failed_last)
+	committer.failed_first = committer.answered + 1;
+      committer.failed_last = ticket;
+      committer.error = error;
+    }
+    committer.answered = ticket;
+    
+    if (write(committer.notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      perror("group commit notify");
+  }
+  return arg;
+}
+
+/** Starts making the messages delivered so far by this process
+ *  durable, like gc_commit, but without waiting: a thread of the
+ *  process waits for the sync instead, so that an event loop can keep
+ *  serving other clients, whose deliveries may then join the same
+ *  batch. The descriptor (an eventfd) is written to whenever a sync
+ *  completes, after which the outcome is found with gc_commit_result.
+ *  Must not be called if durable delivery is not enabled.
+ *
+ *  Parameters: notify_fd: eventfd signalled when a sync completes. It
+ *                         must be the same in all calls of a process.
+ *
+ *  Returns: A ticket identifying the deliveries being committed, or 0
+ *           if the thread could not be started (gc_commit must be used
+ *           instead).
+ */
+uint64_t gc_commit_async(int notify_fd) {
+  
+  uint64_t ticket;
+  int rv;
+  
+  // The thread is not inherited by forked processes
+  if (committer.pid != getpid()) {
+    pthread_t thread;
+    pthread_mutex_init(&committer.lock, NULL);
+    pthread_cond_init(&committer.wanted_cond, NULL);
+    committer.wanted = committer.answered = 0;
+    committer.failed_first = committer.failed_last = 0;
+    committer.notify_fd = notify_fd;
+    if ((rv = pthread_create(&thread, NULL, gc_committer_thread, NULL)) != 0) {
+      errno = rv;
+      perror("group commit thread");
+      return 0;
+    }
+    pthread_detach(thread);
+    committer.pid = getpid();
+  }
+  
+  ticket = gc_ticket();
+  pthread_mutex_lock(&committer.lock);
+  committer.wanted = ticket;
+  pthread_cond_signal(&committer.wanted_cond);
+  pthread_mutex_unlock(&committer.lock);
+  return ticket;
+}
+
+/** Finds the outcome of the deliveries committed with gc_commit_async.
+ *
+ *  Parameters: ticket: Ticket returned by gc_commit_async.
+ *
+ *  Returns: 1 if the deliveries are durable, 0 if the sync is still
+ *           running, -1 if it failed (errno is set accordingly).
+ */
+int gc_commit_result(uint64_t ticket) {
+  
+  int rv = 1;
+  
+  pthread_mutex_lock(&committer.lock);
+  if (ticket > committer.answered) {
+    rv = 0;
+  } else if (ticket >= committer.failed_first && ticket <= committer.failed_last) {
+    errno = committer.error;
+    rv = -1;
+  }
+  pthread_mutex_unlock(&committer.lock);
+  return rv;
+}
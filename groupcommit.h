@@ -0,0 +1,17 @@
+/* groupcommit.h
+ * Makes delivered messages durable, sharing a single file system sync
+ * among all deliveries that complete around the same time.
+ */
+
+#ifndef _GROUP_COMMIT_H_
+#define _GROUP_COMMIT_H_
+
+#include <stdint.h>
+
+int gc_init(const char *directory, long window_usec, int batch_size);
+int gc_enabled(void);
+int gc_commit(void);
+uint64_t gc_commit_async(int notify_fd);
+int gc_commit_result(uint64_t ticket);
+
+#endif
@@ -4,7 +4,11 @@
  * Modified: Nov 5, 2017
  */
 
+#define _GNU_SOURCE
+
 #include "mailuser.h"
+#include "segstore.h"
+#include "mailzip.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,44 +20,304 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
 
 #define USER_FILE_NAME "users.txt"
 #define MAIL_BASE_DIRECTORY "mail.store"
 #define MAIL_FILE_SUFFIX ".mail"
+#define MAIL_COMPRESSED_SUFFIX ".mailz" // suffix of compressed message files
+#define MAIL_DIRECTORY_SIZE (sizeof(MAIL_BASE_DIRECTORY) + MAX_USERNAME_SIZE + 1)
+#define MAIL_INDEX_NAME ".index"
+#define MAIL_INDEX_MAGIC 0x3458444dU // "MDX4"
+#define MAIL_INDEX_MAGIC_V2 0x3258444dU // "MDX2", records without TOP boundaries
+#define MAIL_INDEX_MAGIC_V3 0x3358444dU // "MDX3", records without flags
+#define MAIL_FLAG_COMPRESSED 0x1 // message stored in compressed format
+#define MAIL_TOP_LINES 10 // body line ends recorded for TOP
+#define MAIL_SCAN_CHUNK_SIZE 16384 // bytes read at a time when scanning messages
+#define SEGMENT_DIRECTORY MAIL_BASE_DIRECTORY "/.segments"
+#define BLOB_DIRECTORY MAIL_BASE_DIRECTORY "/.blobs"
+#define BLOB_NAME_SIZE 32 // 16 hex digits, '-', collision counter and NUL
+#define BLOB_CHUNK_SIZE 16384 // bytes read at a time when hashing or comparing blobs
+#define USER_FILE_CHECK_INTERVAL 1 // seconds between checks for changes in the users file
+
+struct user_entry {
+  char *name;
+  char *password;
+  unsigned int hash;
+};
+
+struct user_table {
+  size_t mask;  // number of slots minus one (a power of two)
+  size_t count;
+  struct user_entry *slots;
+  char *data;   // contents of the users file
+  struct stat file_stat;
+};
+
+/* The mailbox index (MAIL_INDEX_NAME in each mailbox directory) keeps
+ * the name and size of every message, so that a mailbox can be loaded
+ * without listing the directory and calling stat on each message. The
+ * name of a message file is also its unique ID. The index is only
+ * trusted if the modification time of the directory matches the one
+ * recorded in the header, i.e., if no message file was created or
+ * removed without the index being updated. Changes to a mailbox are
+ * serialized with flock on the mailbox directory.
+ *
+ * Messages may also be stored in shared segment files (see
+ * segstore.c) instead of their own files. For these messages the
+ * index is the only record of the message in the mailbox, so their
+ * records are kept even when the rest of the index is rebuilt from
+ * the directory contents.
+ *
+ * Each record also keeps where the headers of the message end and
+ * where its first body lines end, found when the message is
+ * delivered, so that TOP can send the start of a message without
+ * looking for the end of the headers.
+ *
+ * Whether a message is compressed (see mailzip.c) is decided when it
+ * is delivered, and recorded in the flags of its record and, for
+ * message files, in their suffix (MAIL_COMPRESSED_SUFFIX), so that it
+ * survives a rebuild of the index. It is never taken from the contents
+ * of the message, which are under the control of the sender.
+ */
+struct mail_top {
+  uint32_t header_length;             // up to and including the blank line after the headers
+  uint32_t line_count;                // body lines recorded in line_ends
+  uint32_t line_ends[MAIL_TOP_LINES]; // end of each of the first body lines
+};
+
+struct mail_index_header {
+  uint32_t magic;
+  uint32_t count;          // number of records
+  uint64_t length;         // total length of the records, in bytes
+  int64_t dir_mtime_sec;   // modification time of the mailbox directory
+  int64_t dir_mtime_nsec;
+};
+
+struct mail_index_record {
+  uint64_t size;           // message size, in bytes
+  uint64_t offset;         // position of the message in its segment
+  uint32_t segment;        // segment holding the message, or 0 for a file
+  uint32_t name_length;    // length of name, including NUL and padding
+  uint64_t flags;          // MAIL_FLAG_* values
+  struct mail_top top;     // header and line boundaries (see above)
+  char name[];             // file name or, for segments, unique ID
+};
+
+// Record layouts of MDX2 and MDX3 indexes, converted when found (see
+// mail_index_upgrade)
+struct mail_index_record_v2 {
+  uint64_t size;
+  uint64_t offset;
+  uint32_t segment;
+  uint32_t name_length;
+  char name[];
+};
+
+struct mail_index_record_v3 {
+  uint64_t size;
+  uint64_t offset;
+  uint32_t segment;
+  uint32_t name_length;
+  struct mail_top top;
+  char name[];
+};
+
+// Storage used for new messages (MAIL_STORE_*)
+static int mail_store = MAIL_STORE_FILES;
+// Whether new messages are compressed (see mailzip.c)
+static int mail_compress = 0;
 
 struct user_list {
   char *user;
+  // Where the last message was saved for this user (see remove_user_mail)
+  char *saved;              // unique ID in the mailbox, or NULL if not saved
+  uint32_t segment;         // segment holding the message, or 0 for a file
+  uint64_t offset;          // position of the message in its segment
   struct user_list *next;
 };
 
 struct mail_item {
-  char file_name[NAME_MAX];
   size_t file_size;
+  uint64_t offset;          // position of the message in its file
+  uint32_t segment;         // segment holding the message, or 0 for a file
+  unsigned int name_offset; // position of the file name in the list's name pool
+  unsigned int uid_offset;  // position of the unique ID in the list's name pool
+  struct mail_top top;
+  unsigned int compressed:1;
   unsigned int deleted:1;
+  unsigned int removed:1;   // record removed from the index by this list
+  struct mail_list *list;
 };
 
 struct mail_list {
-  struct mail_item item;
-  struct mail_list *next;
+  char *directory;          // mailbox directory
+  struct mail_item *items;
+  unsigned int length;      // number of items, including deleted ones
+  unsigned int capacity;
+  unsigned int count;       // number of non-deleted items
+  size_t size;              // total size of non-deleted items
+  char *names;              // pool of NUL-terminated file names
+  size_t names_length;
+  size_t names_capacity;
 };
 
-/** Internal function that opens the users file list. If file has been
- *  opened before, rewinds the pointer to beginning of the file.
- * 
- *  Returns: file pointer for users file, or NULL if file cannot be opened.
+/** Internal function that computes a case-insensitive hash (FNV-1a)
+ *  of a user name.
+ */
+static unsigned int user_hash(const char *username) {
+  
+  unsigned int hash = 2166136261u;
+  for (; *username; username++) {
+    hash ^= (unsigned char) tolower((unsigned char) *username);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/** Internal function that finds the slot for a user name in a user
+ *  table: either the slot where the user is stored, or the empty slot
+ *  where it would be inserted.
+ */
+static struct user_entry *user_table_slot(struct user_table *table, const char *username,
+					   unsigned int hash) {
+  
+  size_t pos = hash & table->mask;
+  while (table->slots[pos].name &&
+	 (table->slots[pos].hash != hash || strcasecmp(table->slots[pos].name, username)))
+    pos = (pos + 1) & table->mask;
+  return &table->slots[pos];
+}
+
+/** Internal function that releases all memory used by a user table. */
+static void user_table_destroy(struct user_table *table) {
+  if (table) {
+    free(table->slots);
+    free(table->data);
+    free(table);
+  }
+}
+
+/** Internal function that loads the users file into a new hash table
+ *  (open addressing with linear probing, kept at most half full). The
+ *  file contains pairs of user names and passwords separated by white
+ *  space. If a user name appears more than once, the first one is
+ *  used. If the file cannot be read, the table is empty.
+ *
+ *  Parameters: file_stat: information about the users file, used to
+ *                         detect later changes to the file.
+ *
+ *  Returns: the new user table.
  */
-static FILE *user_file_list(void) {
+static struct user_table *user_table_load(const struct stat *file_stat) {
+  
+  struct user_table *table = calloc(1, sizeof(struct user_table));
+  size_t size = file_stat ? file_stat->st_size : 0;
+  size_t count = 0, capacity = 16;
+  FILE *file_ptr;
+  char *token, *saveptr;
+  
+  if (file_stat)
+    table->file_stat = *file_stat;
+  
+  // The whole file is kept in memory, and entries point to its tokens
+  table->data = malloc(size + 1);
+  table->data[0] = 0;
+  if (file_stat && (file_ptr = fopen(USER_FILE_NAME, "r")) != NULL) {
+    size = fread(table->data, 1, size, file_ptr);
+    table->data[size] = 0;
+    fclose(file_ptr);
+  }
+  
+  for (size_t i = 0; i < size; i++)
+    if (table->data[i] == '\n')
+      count++;
+  while (capacity < 2 * (count + 1))
+    capacity *= 2;
+  table->mask = capacity - 1;
+  table->slots = calloc(capacity, sizeof(struct user_entry));
+  
+  for (token = strtok_r(table->data, " \t\r\n", &saveptr); token;
+       token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+    
+    char *password = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (!password)
+      break;
+    if (strlen(token) > MAX_USERNAME_SIZE || strlen(password) > MAX_PASSWORD_SIZE)
+      continue;
+    
+    // Grow the table if the file has more entries than lines
+    if (2 * (table->count + 1) > capacity) {
+      struct user_entry *old_slots = table->slots;
+      size_t old_capacity = capacity;
+      capacity *= 2;
+      table->mask = capacity - 1;
+      table->slots = calloc(capacity, sizeof(struct user_entry));
+      for (size_t i = 0; i < old_capacity; i++)
+	if (old_slots[i].name)
+	  *user_table_slot(table, old_slots[i].name, old_slots[i].hash) = old_slots[i];
+      free(old_slots);
+    }
+    
+    unsigned int hash = user_hash(token);
+    struct user_entry *entry = user_table_slot(table, token, hash);
+    if (!entry->name) {
+      entry->name = token;
+      entry->password = password;
+      entry->hash = hash;
+      table->count++;
+    }
+  }
+  
+  return table;
+}
 
-  static FILE *file_ptr = NULL;
-  if (!file_ptr)
-    file_ptr = fopen(USER_FILE_NAME, "r+");
-  if (file_ptr)
-    rewind(file_ptr);
-  return file_ptr;
+/** Internal function that returns the current user table, loading the
+ *  users file the first time it is called. Afterwards, the file is
+ *  checked for changes (modification time, size or inode) at most
+ *  once every USER_FILE_CHECK_INTERVAL seconds, and reloaded into a
+ *  new table if it changed. The new table replaces the old one only
+ *  once it is completely built.
+ * 
+ *  Returns: the current user table.
+ */
+static struct user_table *user_table(void) {
+  
+  static struct user_table *table = NULL;
+  static time_t last_check = 0;
+  struct stat file_stat;
+  time_t now = time(NULL);
+  
+  if (table && now - last_check < USER_FILE_CHECK_INTERVAL)
+    return table;
+  last_check = now;
+  
+  int found = stat(USER_FILE_NAME, &file_stat) == 0;
+  if (table && found &&
+      table->file_stat.st_ino == file_stat.st_ino &&
+      table->file_stat.st_size == file_stat.st_size &&
+      table->file_stat.st_mtim.tv_sec == file_stat.st_mtim.tv_sec &&
+      table->file_stat.st_mtim.tv_nsec == file_stat.st_mtim.tv_nsec)
+    return table;
+  if (table && !found && !table->count)
+    return table;
+  
+  struct user_table *new_table = user_table_load(found ? &file_stat : NULL);
+  user_table_destroy(table);
+  table = new_table;
+  return table;
 }
 
 /** Checks if the user name is valid. If password is informed, also
- *  checks if the password matches the user name.
+ *  checks if the password matches the user name. User names are not
+ *  case sensitive. The users file is kept in memory as a hash table,
+ *  so each check takes constant time.
  *  
  *  Parameters: username: Non-NULL name of the user to check.
  *              password: Unencrypted password to check. If NULL, will
@@ -65,18 +329,12 @@ static FILE *user_file_list(void) {
  */
 int is_valid_user(const char *username, const char *password) {
   
-  FILE *file_ptr = user_file_list();
-  if (!file_ptr) return 0;
-  
-  char user_file[MAX_USERNAME_SIZE+1];
-  char pw_file[MAX_PASSWORD_SIZE+1];
+  struct user_table *table = user_table();
+  struct user_entry *entry = user_table_slot(table, username, user_hash(username));
   
-  while (fscanf(file_ptr, "%s%s", user_file, pw_file) == 2) {
-    if (!strcasecmp(username, user_file))
-      return password == NULL || !strcmp(password, pw_file);
-  }
-
-  return 0;
+  if (!entry->name)
+    return 0;
+  return password == NULL || !strcmp(password, entry->password);
 }
 
 /** Creates a new, empty, list of users.
@@ -98,6 +356,7 @@ user_list_t create_user_list(void) {
 void add_user_to_list(user_list_t *list, const char *username) {
   user_list_t new_list = malloc(sizeof(struct user_list));
   new_list->user = strdup(username);
+  new_list->saved = NULL;
   new_list->next = *list;
   *list = new_list;
 }
@@ -110,48 +369,1118 @@ void destroy_user_list(user_list_t list) {
   while (list) {
     user_list_t next = list->next;
     free(list->user);
+    free(list->saved);
     free(list);
     list = next;
   }
 }
 
+/** Internal function that records where a message was saved for a
+ *  user, so that it can be removed if the delivery fails.
+ *
+ *  Parameters: user: Entry of the user in a list of recipients.
+ *              uid: Unique ID of the message in the user's mailbox.
+ *              segment: Segment holding the message, or 0 for a file.
+ *              offset: Position of the message in its segment.
+ */
+static void user_list_saved(user_list_t user, const char *uid, uint32_t segment,
+			    uint64_t offset) {
+  free(user->saved);
+  user->saved = strdup(uid);
+  user->segment = segment;
+  user->offset = offset;
+}
+
+/** Internal function that checks if a file in a mailbox directory
+ *  holds a message, based on its suffix, and finds the flags recorded
+ *  in the suffix.
+ *
+ *  Parameters: name: File name.
+ *              flags: Pointer where the MAIL_FLAG_* values are
+ *                     returned, or NULL.
+ *
+ *  Returns: a non-zero value if the file holds a message.
+ */
+static int mail_file_flags(const char *name, uint64_t *flags) {
+  
+  const char *suffix = strrchr(name, '.');
+  uint64_t found;
+  
+  if (!suffix || suffix == name)
+    return 0;
+  if (!strcmp(suffix, MAIL_FILE_SUFFIX))
+    found = 0;
+  else if (!strcmp(suffix, MAIL_COMPRESSED_SUFFIX))
+    found = MAIL_FLAG_COMPRESSED;
+  else
+    return 0;
+  
+  if (flags)
+    *flags = found;
+  return 1;
+}
+
+/** Internal function that creates a new, empty list of emails for a
+ *  mailbox directory.
+ */
+static struct mail_list *mail_list_create(const char *directory) {
+  
+  struct mail_list *list = calloc(1, sizeof(struct mail_list));
+  list->directory = strdup(directory);
+  list->capacity = 16;
+  list->items = malloc(list->capacity * sizeof(struct mail_item));
+  list->names_capacity = 1024;
+  list->names = malloc(list->names_capacity);
+  return list;
+}
+
+/** Internal function that adds a string to the name pool of a list of
+ *  emails.
+ *
+ *  Returns: the position of the string in the pool.
+ */
+static unsigned int mail_list_add_name(struct mail_list *list, const char *name) {
+  
+  size_t name_length = strlen(name) + 1;
+  unsigned int offset = list->names_length;
+  
+  while (list->names_length + name_length > list->names_capacity) {
+    list->names_capacity *= 2;
+    list->names = realloc(list->names, list->names_capacity);
+  }
+  memcpy(list->names + list->names_length, name, name_length);
+  list->names_length += name_length;
+  return offset;
+}
+
+/** Internal function that appends a message to a list of emails. The
+ *  item pointers are only set once the list is complete (see
+ *  mail_list_finish), since the array may be moved while it grows.
+ *
+ *  Parameters: list: List of emails to be extended.
+ *              file_name: Name of the file containing the message.
+ *              uid: Unique ID of the message, or NULL if the file
+ *                   name (without directory) is the unique ID.
+ *              fields: Index record with the size, location and
+ *                      boundaries of the message (name not used).
+ */
+static void mail_list_append(struct mail_list *list, const char *file_name, const char *uid,
+			     const struct mail_index_record *fields) {
+  
+  if (list->length == list->capacity) {
+    list->capacity *= 2;
+    list->items = realloc(list->items, list->capacity * sizeof(struct mail_item));
+  }
+  
+  struct mail_item *item = &list->items[list->length++];
+  item->file_size = fields->size;
+  item->segment = fields->segment;
+  item->offset = fields->offset;
+  item->top = fields->top;
+  item->compressed = (fields->flags & MAIL_FLAG_COMPRESSED) != 0;
+  item->deleted = 0;
+  item->removed = 0;
+  item->name_offset = mail_list_add_name(list, file_name);
+  if (uid)
+    item->uid_offset = mail_list_add_name(list, uid);
+  else
+    item->uid_offset = item->name_offset + (strrchr(file_name, '/') + 1 - file_name);
+  
+  list->count++;
+  list->size += fields->size;
+}
+
+/** Internal function that appends the message in a mailbox index
+ *  record to a list of emails.
+ */
+static void mail_list_append_record(struct mail_list *list,
+				    const struct mail_index_record *record) {
+  
+  char filename[PATH_MAX];
+  
+  if (record->segment) {
+    seg_path(SEGMENT_DIRECTORY, record->segment, filename, sizeof(filename));
+    mail_list_append(list, filename, record->name, record);
+  } else {
+    snprintf(filename, sizeof(filename), "%s/%s", list->directory, record->name);
+    mail_list_append(list, filename, NULL, record);
+  }
+}
+
+/** Internal function that links every item of a complete list of
+ *  emails back to the list, so that deletions can update the list
+ *  totals.
+ */
+static void mail_list_finish(struct mail_list *list) {
+  for (unsigned int i = 0; i < list->length; i++)
+    list->items[i].list = list;
+}
+
+/** Internal function that checks if a mailbox index header is
+ *  consistent with the index file size, i.e., if its records can be
+ *  read.
+ *
+ *  Parameters: header: Header read from the index file.
+ *              file_size: Size of the index file.
+ *
+ *  Returns: a non-zero value if the records can be read, zero otherwise.
+ */
+static int mail_index_usable(const struct mail_index_header *header, off_t file_size) {
+  return header->magic == MAIL_INDEX_MAGIC &&
+    sizeof(struct mail_index_header) + header->length <= (uint64_t) file_size;
+}
+
+/** Internal function that checks if a mailbox index is up to date
+ *  with the current state of the mailbox directory, i.e., if it lists
+ *  all message files in the directory.
+ *
+ *  Parameters: header: Header read from the index file.
+ *              dir_fd: File descriptor of the mailbox directory.
+ *
+ *  Returns: a non-zero value if the index is current, zero otherwise.
+ */
+static int mail_index_current(const struct mail_index_header *header, int dir_fd) {
+  
+  struct stat dir_stat;
+  
+  return fstat(dir_fd, &dir_stat) == 0 &&
+    header->dir_mtime_sec == dir_stat.st_mtim.tv_sec &&
+    header->dir_mtime_nsec == dir_stat.st_mtim.tv_nsec;
+}
+
+/** Internal function that writes the index header. If the index is
+ *  current, the modification time of the mailbox directory is
+ *  recorded in the header; otherwise the index is marked as needing
+ *  to be rebuilt from the directory. This must be the last change to
+ *  the index in any update, and the mailbox must be locked
+ *  exclusively.
+ */
+static void mail_index_commit(int index_fd, struct mail_index_header *header, int dir_fd,
+			      int current) {
+  
+  struct stat dir_stat;
+  if (current && fstat(dir_fd, &dir_stat) < 0)
+    current = 0;
+  
+  header->magic = MAIL_INDEX_MAGIC;
+  header->dir_mtime_sec = current ? dir_stat.st_mtim.tv_sec : 0;
+  header->dir_mtime_nsec = current ? dir_stat.st_mtim.tv_nsec : 0;
+  pwrite(index_fd, header, sizeof(*header), 0);
+}
+
+/** Internal function that appends a record to a buffer of index
+ *  records, growing it as needed.
+ *
+ *  Parameters: buffer: Pointer to the buffer (may be reallocated).
+ *              length: Pointer to the current length of the buffer.
+ *              capacity: Pointer to the capacity of the buffer.
+ *              fields: Record with the size, location and boundaries
+ *                      of the message (name_length is not used).
+ *              name: Message file name (without directory), or unique
+ *                    ID for messages in segments.
+ */
+static void mail_index_add_record(char **buffer, size_t *length, size_t *capacity,
+				  const struct mail_index_record *fields, const char *name) {
+  
+  struct mail_index_record record = *fields;
+  size_t name_length = strlen(name) + 1;
+  
+  record.name_length = (name_length + 7) & ~7;
+  while (*length + sizeof(record) + record.name_length > *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 4096;
+    *buffer = realloc(*buffer, *capacity);
+  }
+  
+  memcpy(*buffer + *length, &record, sizeof(record));
+  memcpy(*buffer + *length + sizeof(record), name, name_length);
+  memset(*buffer + *length + sizeof(record) + name_length, 0, record.name_length - name_length);
+  *length += sizeof(record) + record.name_length;
+}
+
+/** Internal function that replaces the contents of a mailbox index
+ *  with a new set of records. The header is only written after all
+ *  records are written. The mailbox must be locked exclusively.
+ *
+ *  Parameters: dir_fd: File descriptor of the mailbox directory.
+ *              records: Buffer with the new records.
+ *              length: Length of the records buffer.
+ *              count: Number of records in the buffer.
+ *              current: Non-zero if the records list all message files
+ *                       in the directory (see mail_index_commit).
+ *
+ *  Returns: 0 if successful, -1 otherwise.
+ */
+static int mail_index_store(int dir_fd, const char *records, size_t length, uint32_t count,
+			    int current) {
+  
+  struct mail_index_header header = { .count = count, .length = length };
+  int rv = -1;
+  int index_fd = openat(dir_fd, MAIL_INDEX_NAME, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (index_fd < 0)
+    return -1;
+  
+  if (pwrite(index_fd, &header, sizeof(header), 0) == sizeof(header) &&
+      (!length || pwrite(index_fd, records, length, sizeof(header)) == (ssize_t) length)) {
+    mail_index_commit(index_fd, &header, dir_fd, current);
+    rv = 0;
+  }
+  close(index_fd);
+  return rv;
+}
+
+/** Internal function that maps the index of a mailbox in memory, if
+ *  it exists and its records can be read. The mailbox must be locked.
+ *
+ *  Parameters: dir_fd: File descriptor of the mailbox directory.
+ *              map_length: Pointer where the length of the mapping
+ *                          (to be passed to munmap) is returned.
+ *              current: Pointer where a non-zero value is returned if
+ *                       the index is current (see mail_index_current).
+ *
+ *  Returns: the index header, followed by its records, or NULL if
+ *           there is no usable index.
+ */
+static struct mail_index_header *mail_index_map(int dir_fd, size_t *map_length, int *current) {
+  
+  struct stat index_stat;
+  struct mail_index_header *header;
+  int index_fd = openat(dir_fd, MAIL_INDEX_NAME, O_RDONLY);
+  if (index_fd < 0)
+    return NULL;
+  
+  if (fstat(index_fd, &index_stat) < 0 ||
+      index_stat.st_size < (off_t) sizeof(struct mail_index_header)) {
+    close(index_fd);
+    return NULL;
+  }
+  
+  *map_length = index_stat.st_size;
+  header = mmap(NULL, *map_length, PROT_READ, MAP_PRIVATE, index_fd, 0);
+  close(index_fd);
+  if (header == MAP_FAILED)
+    return NULL;
+  
+  if (!mail_index_usable(header, index_stat.st_size)) {
+    munmap(header, *map_length);
+    return NULL;
+  }
+  *current = mail_index_current(header, dir_fd);
+  return header;
+}
+
+/** Internal function that returns the next record of a mapped index,
+ *  checking that it is completely within the records area.
+ *
+ *  Parameters: header: Mapped index.
+ *              offset: Pointer to the offset of the record within the
+ *                      records area; updated to the following record.
+ *
+ *  Returns: the record, or NULL if there are no more (valid) records.
+ */
+static const struct mail_index_record *mail_index_next(const struct mail_index_header *header,
+						       uint64_t *offset) {
+  
+  const char *records = (const char *) (header + 1);
+  const struct mail_index_record *record = (const void *) (records + *offset);
+  
+  if (*offset + sizeof(*record) > header->length ||
+      *offset + sizeof(*record) + record->name_length > header->length ||
+      !record->name_length || record->name[record->name_length - 1])
+    return NULL;
+  
+  *offset += sizeof(*record) + record->name_length;
+  return record;
+}
+
+/** Internal function that appends a newly delivered message to the
+ *  index of a mailbox. The mailbox must be locked exclusively, and the
+ *  index must have been checked before the message file (if any) was
+ *  created.
+ *
+ *  Parameters: dir_fd: File descriptor of the mailbox directory.
+ *              index_fd: File descriptor of the index.
+ *              header: Index header, as read before the message file
+ *                      was created.
+ *              fields: Record with the size, location and boundaries
+ *                      of the message.
+ *              name: Message file name (without directory), or unique
+ *                    ID for messages in segments.
+ *              current: Non-zero if the index was current before the
+ *                       delivery.
+ *
+ *  Returns: 0 if successful, -1 otherwise.
+ */
+static int mail_index_append(int dir_fd, int index_fd, struct mail_index_header *header,
+			     const struct mail_index_record *fields, const char *name, int current) {
+  
+  char *record = NULL;
+  size_t length = 0, capacity = 0;
+  int rv = -1;
+  
+  mail_index_add_record(&record, &length, &capacity, fields, name);
+  if (pwrite(index_fd, record, length, sizeof(*header) + header->length) == (ssize_t) length) {
+    header->count++;
+    header->length += length;
+    mail_index_commit(index_fd, header, dir_fd, current);
+    rv = 0;
+  }
+  free(record);
+  return rv;
+}
+
+/** Internal function that creates a unique name for a new message,
+ *  built from the current time, the process ID and a sequence number,
+ *  so that a collision is only possible if the clock goes back or a
+ *  process ID is reused within the same microsecond.
+ *
+ *  Parameters: name: Buffer where the name is returned.
+ *              size: Size of the buffer.
+ *              suffix: Suffix appended to the name.
+ */
+static void mail_unique_name(char *name, size_t size, const char *suffix) {
+  
+  static unsigned int sequence = 0;
+  struct timeval now;
+  
+  gettimeofday(&now, NULL);
+  snprintf(name, size, "%ld.%06ld.%d.%u%s", (long) now.tv_sec, (long) now.tv_usec,
+	   (int) getpid(), sequence++, suffix);
+}
+
+/** Internal function that scans the start of a message, in its wire
+ *  form, for the end of its headers and the ends of its first body
+ *  lines. Scanning stops once the requested number of body lines is
+ *  found.
+ *
+ *  Parameters: fd: File descriptor of the file holding the message.
+ *              offset: Position of the message in the file.
+ *              size: Size of the message (before compression).
+ *              compressed: Non-zero if the message is stored in
+ *                          compressed format (see mailzip.c).
+ *              lines: Number of body lines to be found.
+ *              top: Pointer where the end of the headers and the ends
+ *                   of the first MAIL_TOP_LINES body lines are returned.
+ *
+ *  Returns: the length of the headers followed by the requested body
+ *           lines, or the size of the message if it is shorter.
+ */
+static uint64_t mail_top_scan(int fd, off_t offset, uint64_t size, int compressed,
+			      unsigned int lines, struct mail_top *top) {
+  
+  char buffer[MAIL_SCAN_CHUNK_SIZE];
+  const char *data;
+  uint64_t position = 0, line_start = 0, end = size;
+  unsigned int body_lines = 0;
+  int in_body = 0;
+  char previous = '\0';
+  ssize_t rv;
+  
+  memset(top, 0, sizeof(*top));
+  top->header_length = size;
+  mz_reader_t reader = compressed ? mz_open(fd, offset) : NULL;
+  if (compressed && !reader)
+    return size;
+  
+  for (;;) {
+    if (reader) {
+      rv = mz_read(reader, &data);
+    } else {
+      rv = size - position < sizeof(buffer) ? size - position : sizeof(buffer);
+      rv = rv ? pread(fd, buffer, rv, offset + position) : 0;
+      data = buffer;
+    }
+    if (rv <= 0)
+      break;
+    
+    for (const char *p = data; p < data + rv; previous = *p++, position++) {
+      if (*p != '\n')
+	continue;
+      
+      // The headers end with the first empty line
+      if (!in_body) {
+	if (position == line_start || (position == line_start + 1 && previous == '\r')) {
+	  in_body = 1;
+	  top->header_length = position + 1;
+	  if (!lines) {
+	    end = position + 1;
+	    goto done;
+	  }
+	}
+      } else {
+	if (body_lines < MAIL_TOP_LINES)
+	  top->line_ends[top->line_count++] = position + 1;
+	if (++body_lines >= lines) {
+	  end = position + 1;
+	  goto done;
+	}
+      }
+      line_start = position + 1;
+    }
+  }
+  
+ done:
+  mz_close(reader);
+  return end;
+}
+
+/** Internal function that converts a mailbox index written in an
+ *  earlier layout to the current one: MDX2 records have no TOP
+ *  boundaries, which are found by scanning each message, and neither
+ *  MDX2 nor MDX3 records have flags. Messages in segments are taken as
+ *  not compressed, and message files get the flags of their suffix.
+ *  Records of messages in segments must be kept, since the index is
+ *  their only record in the mailbox; records of files that no longer
+ *  exist are dropped. The mailbox must be locked exclusively.
+ *
+ *  Parameters: dir_fd: File descriptor of the mailbox directory.
+ *              directory: Path of the mailbox directory.
+ */
+static void mail_index_upgrade(int dir_fd, const char *directory) {
+  
+  struct mail_index_header header;
+  struct stat index_stat;
+  char filename[PATH_MAX];
+  size_t record_size;
+  
+  int index_fd = openat(dir_fd, MAIL_INDEX_NAME, O_RDONLY);
+  if (index_fd < 0)
+    return;
+  if (pread(index_fd, &header, sizeof(header), 0) != sizeof(header) ||
+      (header.magic != MAIL_INDEX_MAGIC_V2 && header.magic != MAIL_INDEX_MAGIC_V3) ||
+      fstat(index_fd, &index_stat) < 0 ||
+      sizeof(header) + header.length > (uint64_t) index_stat.st_size) {
+    close(index_fd);
+    return;
+  }
+  
+  char *old = malloc(header.length ? header.length : 1);
+  if (pread(index_fd, old, header.length, sizeof(header)) != (ssize_t) header.length) {
+    free(old);
+    close(index_fd);
+    return;
+  }
+  close(index_fd);
+  
+  // Both layouts start with the fields of an MDX2 record
+  record_size = header.magic == MAIL_INDEX_MAGIC_V2 ?
+    sizeof(struct mail_index_record_v2) : sizeof(struct mail_index_record_v3);
+  
+  int current = mail_index_current(&header, dir_fd);
+  char *records = NULL;
+  size_t length = 0, capacity = 0;
+  uint32_t count = 0;
+  uint64_t offset = 0;
+  
+  while (offset + record_size <= header.length) {
+    
+    const struct mail_index_record_v2 *record = (const void *) (old + offset);
+    const char *name = old + offset + record_size;
+    if (offset + record_size + record->name_length > header.length ||
+	!record->name_length || name[record->name_length - 1])
+      break;
+    offset += record_size + record->name_length;
+    
+    struct mail_index_record fields = {
+      .size = record->size, .offset = record->offset, .segment = record->segment
+    };
+    if (!record->segment && !mail_file_flags(name, &fields.flags))
+      continue;
+    
+    if (header.magic == MAIL_INDEX_MAGIC_V3) {
+      fields.top = ((const struct mail_index_record_v3 *) record)->top;
+      if (!record->segment && faccessat(dir_fd, name, F_OK, 0) < 0)
+	continue;
+    } else {
+      if (record->segment)
+	seg_path(SEGMENT_DIRECTORY, record->segment, filename, sizeof(filename));
+      else
+	snprintf(filename, sizeof(filename), "%s/%s", directory, name);
+      
+      int fd = open(filename, O_RDONLY);
+      if (fd >= 0) {
+	mail_top_scan(fd, fields.offset, fields.size, fields.flags & MAIL_FLAG_COMPRESSED,
+		      MAIL_TOP_LINES, &fields.top);
+	close(fd);
+      } else if (!record->segment) {
+	continue;
+      } else {
+	fields.top.header_length = fields.size;
+      }
+    }
+    
+    mail_index_add_record(&records, &length, &capacity, &fields, name);
+    count++;
+  }
+  
+  mail_index_store(dir_fd, records, length, count, current);
+  free(records);
+  free(old);
+}
+
+/** Internal function that saves a new email message into shared
+ *  segment files (see segstore.c). The message is stored once, with
+ *  one reference per recipient, and a record pointing to it is
+ *  appended to the index of each recipient's mailbox.
+ *
+ *  Parameters: fd: File descriptor of the file containing the
+ *                  contents of the email message.
+ *              users: List of recipient users to the message.
+ *              fields: Record with the size and boundaries of the
+ *                      message, as recorded in the index.
+ *
+ *  Returns: 0 if the message was saved for every user, -1 otherwise.
+ */
+static int save_user_mail_segment(int fd, user_list_t users,
+				  const struct mail_index_record *fields) {
+  
+  char mail_dir[MAIL_DIRECTORY_SIZE];
+  char uid[NAME_MAX + 1];
+  struct mail_index_header header;
+  struct mail_index_record record = *fields;
+  uint32_t segment;
+  uint64_t offset;
+  unsigned int refs = 0, failed = 0;
+  
+  for (user_list_t user = users; user; user = user->next)
+    refs++;
+  if (!refs)
+    return 0;
+  
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  if (seg_append(SEGMENT_DIRECTORY, fd, refs, &segment, &offset) < 0)
+    return -1;
+  record.segment = segment;
+  record.offset = offset;
+  
+  for (; users; users = users->next) {
+    
+    snprintf(mail_dir, sizeof(mail_dir), MAIL_BASE_DIRECTORY "/%s", users->user);
+    mkdir(mail_dir, 0777);
+    
+    int dir_fd = open(mail_dir, O_RDONLY | O_DIRECTORY);
+    int index_fd = dir_fd < 0 ? -1 : openat(dir_fd, MAIL_INDEX_NAME, O_RDWR | O_CREAT, 0666);
+    if (index_fd < 0) {
+      if (dir_fd >= 0)
+	close(dir_fd);
+      failed++;
+      continue;
+    }
+    flock(dir_fd, LOCK_EX);
+    mail_index_upgrade(dir_fd, mail_dir);
+    
+    // The record is added even if the rest of the index is not
+    // current, since it will be kept when the index is rebuilt. An
+    // unusable index is started anew, to be rebuilt from the directory.
+    struct stat index_stat;
+    int current = 0;
+    if (pread(index_fd, &header, sizeof(header), 0) == sizeof(header) &&
+	fstat(index_fd, &index_stat) == 0 && mail_index_usable(&header, index_stat.st_size)) {
+      current = mail_index_current(&header, dir_fd);
+    } else {
+      memset(&header, 0, sizeof(header));
+      ftruncate(index_fd, 0);
+    }
+    
+    mail_unique_name(uid, sizeof(uid), "");
+    if (mail_index_append(dir_fd, index_fd, &header, &record, uid, current) < 0)
+      failed++;
+    else
+      user_list_saved(users, uid, segment, offset);
+    close(index_fd);
+    close(dir_fd);
+  }
+  
+  int rv = failed ? -1 : 0;
+  while (failed--)
+    seg_release(SEGMENT_DIRECTORY, segment, offset);
+  return rv;
+}
+
+/** Internal function that saves a new email message into the mailbox
+ *  of each user in a list, as a hard link to an existing file, and
+ *  appends it to the mailbox index.
+ *
+ *  Parameters: basefile: Name of the file containing the message.
+ *              users: List of recipient users to the message.
+ *              suffix: Suffix of the new file names.
+ *              fields: Record with the size and boundaries of the
+ *                      message, as recorded in the index.
+ *
+ *  Returns: 0 if the message was saved for every user, -1 otherwise.
+ */
+static int save_user_mail_files(const char *basefile, user_list_t users, const char *suffix,
+				const struct mail_index_record *fields) {
+  
+  char mail_dir[MAIL_DIRECTORY_SIZE];
+  char mail_file[PATH_MAX];
+  char mail_name[NAME_MAX + 1];
+  struct stat file_stat;
+  int failed = 0;
+  
+  // Create base directory if it doesn't exist yet (error ignored)
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  
+  for (; users; users = users->next) {
+    
+    // Create recipient directory if it doesn't exist yet (error ignored)
+    snprintf(mail_dir, sizeof(mail_dir), MAIL_BASE_DIRECTORY "/%s", users->user);
+    mkdir(mail_dir, 0777);
+    
+    int dir_fd = open(mail_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+      failed++;
+      continue;
+    }
+    flock(dir_fd, LOCK_EX);
+    
+    // The index is only updated if it was current before this
+    // delivery; otherwise it will be rebuilt from the directory
+    struct mail_index_header header;
+    int index_fd = openat(dir_fd, MAIL_INDEX_NAME, O_RDWR);
+    if (index_fd >= 0 &&
+	(pread(index_fd, &header, sizeof(header), 0) != sizeof(header) ||
+	 fstat(index_fd, &file_stat) < 0 ||
+	 !mail_index_usable(&header, file_stat.st_size) ||
+	 !mail_index_current(&header, dir_fd))) {
+      close(index_fd);
+      index_fd = -1;
+    }
+    
+    int rv;
+    do {
+      mail_unique_name(mail_name, sizeof(mail_name), suffix);
+      snprintf(mail_file, sizeof(mail_file), "%s/%s", mail_dir, mail_name);
+    } while ((rv = linkat(AT_FDCWD, basefile, AT_FDCWD, mail_file, AT_SYMLINK_FOLLOW)) < 0 &&
+	     errno == EEXIST);
+    
+    if (rv == 0)
+      user_list_saved(users, mail_name, 0, 0);
+    else
+      failed++;
+    
+    if (index_fd >= 0) {
+      if (rv == 0)
+	mail_index_append(dir_fd, index_fd, &header, fields, mail_name, 1);
+      close(index_fd);
+    }
+    close(dir_fd);
+  }
+  return failed ? -1 : 0;
+}
+
+/** Internal function that computes a hash (64-bit FNV-1a) of the
+ *  contents of a file, used to find identical messages in the blob
+ *  store.
+ *
+ *  Returns: 0 if successful, -1 if the file could not be read.
+ */
+static int mail_blob_hash(int fd, uint64_t *hash) {
+  
+  unsigned char buffer[BLOB_CHUNK_SIZE];
+  off_t offset = 0;
+  ssize_t rv;
+  
+  *hash = 14695981039346656037ull;
+  while ((rv = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+    for (ssize_t i = 0; i < rv; i++) {
+      *hash ^= buffer[i];
+      *hash *= 1099511628211ull;
+    }
+    offset += rv;
+  }
+  return rv < 0 ? -1 : 0;
+}
+
+/** Internal function that checks if two files have the same contents,
+ *  to confirm a match found by hash.
+ *
+ *  Returns: a non-zero value if the contents are identical.
+ */
+static int mail_blob_equal(int fd, int blob_fd) {
+  
+  char buffer[BLOB_CHUNK_SIZE], blob_buffer[BLOB_CHUNK_SIZE];
+  struct stat file_stat, blob_stat;
+  off_t offset = 0;
+  ssize_t rv;
+  
+  if (fstat(fd, &file_stat) < 0 || fstat(blob_fd, &blob_stat) < 0 ||
+      file_stat.st_size != blob_stat.st_size)
+    return 0;
+  
+  while ((rv = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+    if (pread(blob_fd, blob_buffer, rv, offset) != rv || memcmp(buffer, blob_buffer, rv))
+      return 0;
+    offset += rv;
+  }
+  return rv == 0;
+}
+
+/** Internal function that finds the name of the blob, if any, a
+ *  message file in a mailbox is linked to. The blob name is the last
+ *  component of the file name before the suffix (MAIL_FILE_SUFFIX or
+ *  MAIL_COMPRESSED_SUFFIX); names of message files not in the blob
+ *  store have no '-' in that position.
+ *
+ *  Parameters: file_name: Name of the message file.
+ *              blob: Buffer of BLOB_NAME_SIZE bytes where the blob
+ *                    name is returned.
+ *
+ *  Returns: a non-zero value if the file is linked to a blob.
+ */
+static int mail_blob_name(const char *file_name, char *blob) {
+  
+  const char *end = strrchr(file_name, '.');
+  const char *start = end;
+  
+  if (!mail_file_flags(file_name, NULL))
+    return 0;
+  while (start > file_name && start[-1] != '.' && start[-1] != '/')
+    start--;
+  if (end - start >= BLOB_NAME_SIZE || !memchr(start, '-', end - start))
+    return 0;
+  
+  memcpy(blob, start, end - start);
+  blob[end - start] = '\0';
+  return 1;
+}
+
+/** Internal function that removes a blob once no mailbox links to it,
+ *  i.e., once the blob store holds its only link. The blob store must
+ *  be locked exclusively.
+ */
+static void mail_blob_release(int blobs_fd, const char *blob) {
+  
+  struct stat blob_stat;
+  if (fstatat(blobs_fd, blob, &blob_stat, 0) == 0 && blob_stat.st_nlink == 1)
+    unlinkat(blobs_fd, blob, 0);
+}
+
+/** Internal function that saves a new email message through the
+ *  content-addressed blob store. Blobs are named after the hash of
+ *  their contents (plus a counter to tell apart different contents
+ *  with the same hash), and a message identical to an existing blob,
+ *  confirmed byte by byte, is linked to that blob instead of being
+ *  stored again. Mailbox files are hard links to the blob, so the
+ *  link count of the blob is its reference count, and the blob name
+ *  is part of each mailbox file name so that it can be released once
+ *  the message is deleted. The blob store is locked while the links
+ *  are created, so that a blob cannot be removed in the meantime.
+ *
+ *  Parameters: basefile: Name of a temporary file containing the
+ *                        contents of the email message.
+ *              users: List of recipient users to the message.
+ *              file_suffix: Suffix of the new file names.
+ *              fields: Record with the size and boundaries of the
+ *                      message, as recorded in the index.
+ *
+ *  Returns: 0 if the message was saved for every user, -1 otherwise.
+ */
+static int save_user_mail_blob(const char *basefile, user_list_t users, const char *file_suffix,
+				const struct mail_index_record *fields) {
+  
+  char blob[BLOB_NAME_SIZE];
+  char blob_file[sizeof(BLOB_DIRECTORY) + BLOB_NAME_SIZE];
+  char suffix[BLOB_NAME_SIZE + sizeof(MAIL_COMPRESSED_SUFFIX) + 1];
+  uint64_t hash;
+  int blobs_fd = -1;
+  int rv;
+  
+  int fd = open(basefile, O_RDONLY);
+  if (fd >= 0 && mail_blob_hash(fd, &hash) == 0) {
+    mkdir(MAIL_BASE_DIRECTORY, 0777);
+    mkdir(BLOB_DIRECTORY, 0777);
+    blobs_fd = open(BLOB_DIRECTORY, O_RDONLY | O_DIRECTORY);
+  }
+  
+  // Without the blob store, the message is saved as a regular file
+  if (blobs_fd < 0) {
+    if (fd >= 0)
+      close(fd);
+    return save_user_mail_files(basefile, users, file_suffix, fields);
+  }
+  flock(blobs_fd, LOCK_EX);
+  
+  for (unsigned int n = 0;; n++) {
+    
+    snprintf(blob, sizeof(blob), "%016llx-%u", (unsigned long long) hash, n);
+    int blob_fd = openat(blobs_fd, blob, O_RDONLY);
+    if (blob_fd < 0) {
+      if (errno != ENOENT || linkat(AT_FDCWD, basefile, blobs_fd, blob, AT_SYMLINK_FOLLOW) < 0)
+	blob[0] = '\0';
+      break;
+    }
+    
+    int equal = mail_blob_equal(fd, blob_fd);
+    close(blob_fd);
+    if (equal)
+      break;
+  }
+  
+  if (blob[0]) {
+    snprintf(blob_file, sizeof(blob_file), BLOB_DIRECTORY "/%s", blob);
+    snprintf(suffix, sizeof(suffix), ".%s%s", blob, file_suffix);
+    rv = save_user_mail_files(blob_file, users, suffix, fields);
+    // Removes a new blob if no mailbox could link to it
+    mail_blob_release(blobs_fd, blob);
+  } else {
+    rv = save_user_mail_files(basefile, users, file_suffix, fields);
+  }
+  
+  close(blobs_fd);
+  close(fd);
+  return rv;
+}
+
+/** Sets how new messages are stored. With MAIL_STORE_FILES (the
+ *  default), each message is stored in its own file in each
+ *  recipient's mailbox directory (hard links shared by all
+ *  recipients). With MAIL_STORE_SEGMENTS, messages are appended to
+ *  large segment files shared by all mailboxes, which avoids creating
+ *  a file per message. With MAIL_STORE_BLOBS, mailbox files are links
+ *  to a deduplicated blob store, so identical messages delivered in
+ *  separate transactions share a single copy. Messages already stored
+ *  remain readable either way.
+ *
+ *  Parameters: store: One of the MAIL_STORE_* constants.
+ */
+void set_mail_store(int store) {
+  mail_store = store;
+}
+
+/** Sets whether new messages are compressed when they are stored
+ *  (see mailzip.c). Sizes reported for compressed messages are still
+ *  those of their original contents, and messages already stored
+ *  remain readable either way; open_mail_item returns the contents as
+ *  stored, which should be read with mz_open if is_mail_item_compressed
+ *  is true.
+ *
+ *  Parameters: compress: Non-zero to compress new messages.
+ */
+void set_mail_compression(int compress) {
+  mail_compress = compress;
+}
+
 /** Saves a new email message into the mail storage for a list of
  *  users. This function uses hard links to create the files based on
  *  an existing temporary file. It assumes the temporary file is in
  *  the same file system as the newly created files. Typically, saving
  *  the temporary file in a local directory (where the executable is
- *  running) is enough for this to work.
+ *  running) is enough for this to work. Each new file gets a unique
+ *  name built from the current time, the process ID and a sequence
+ *  number, so delivery does not depend on the size of the mailbox.
+ *  The new file is also appended to the mailbox index. Depending on
+ *  the mail store (see set_mail_store), the message may instead be
+ *  appended to a shared segment file, or linked through the blob
+ *  store. If compression is enabled (see set_mail_compression), the
+ *  message is compressed first.
+ *
+ *  The contents are expected in their on-the-wire POP3 form (CRLF
+ *  line endings, lines starting with '.' dot-stuffed, no terminating
+ *  line), so that they can be retrieved without any conversion.
+ *
+ *  The message is saved for either all users or none of them: if it
+ *  cannot be saved for some user, the copies saved for the others are
+ *  removed (see remove_user_mail).
  *
  *  Parameters: basefile: Name of a temporary file containing the
  *                        contents of the email message.
  *              users: List of recipient users to the message.
+ *
+ *  Returns: 0 if successful, -1 if the message was not saved.
+ */
+int save_user_mail(const char *basefile, user_list_t users) {
+  
+  int fd = open(basefile, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  int rv = save_user_mail_fd(fd, users);
+  close(fd);
+  return rv;
+}
+
+/** Saves a new email message into the mail storage for a list of
+ *  users, like save_user_mail, but based on an open file instead of a
+ *  file name. The file may be an anonymous file (created with
+ *  O_TMPFILE) in the same file system as the mail storage, which is
+ *  linked into each mailbox through /proc/self/fd, without ever
+ *  having a name of its own.
+ *
+ *  Parameters: fd: File descriptor of the file containing the
+ *                  contents of the email message.
+ *              users: List of recipient users to the message.
+ *
+ *  Returns: 0 if successful, -1 if the message was not saved.
  */
-void save_user_mail(const char *basefile, user_list_t users) {
+int save_user_mail_fd(int fd, user_list_t users) {
   
-  char mail_file[NAME_MAX + 1];
+  char path[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+  char compressed_file[] = MAIL_BASE_DIRECTORY "/.compressXXXXXX";
+  struct mail_index_record fields = { 0 };
+  struct stat file_stat;
+  int compressed_fd = -1;
+  int rv;
   
-  // Create base directory if it doesn't exist yet (error ignored)
-  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  for (user_list_t user = users; user; user = user->next) {
+    free(user->saved);
+    user->saved = NULL;
+  }
+  
+  if (fstat(fd, &file_stat) < 0)
+    return -1;
+  fields.size = file_stat.st_size;
+  mail_top_scan(fd, 0, fields.size, 0, MAIL_TOP_LINES, &fields.top);
+  
+  // The compressed copy is created in the mail store, so it can be
+  // linked into mailboxes; a named file is used if O_TMPFILE is not
+  // supported, and removed once the message is saved.
+  if (mail_compress) {
+    mkdir(MAIL_BASE_DIRECTORY, 0777);
+    compressed_fd = open(MAIL_BASE_DIRECTORY, O_TMPFILE | O_RDWR, 0600);
+    if (compressed_fd >= 0)
+      compressed_file[0] = '\0';
+    else
+      compressed_fd = mkstemp(compressed_file);
+    
+    uint64_t size;
+    if (compressed_fd >= 0 && mz_compress(fd, compressed_fd, &size) == 0) {
+      fd = compressed_fd;
+      fields.flags |= MAIL_FLAG_COMPRESSED;
+    } else {
+      if (compressed_fd >= 0) {
+	if (compressed_file[0])
+	  unlink(compressed_file);
+	close(compressed_fd);
+	compressed_fd = -1;
+      }
+    }
+  }
+  
+  const char *suffix = fields.flags & MAIL_FLAG_COMPRESSED ?
+    MAIL_COMPRESSED_SUFFIX : MAIL_FILE_SUFFIX;
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  if (mail_store == MAIL_STORE_SEGMENTS)
+    rv = save_user_mail_segment(fd, users, &fields);
+  else if (mail_store == MAIL_STORE_BLOBS)
+    rv = save_user_mail_blob(path, users, suffix, &fields);
+  else
+    rv = save_user_mail_files(path, users, suffix, &fields);
+  
+  if (compressed_fd >= 0) {
+    if (compressed_file[0])
+      unlink(compressed_file);
+    close(compressed_fd);
+  }
+  
+  if (rv < 0)
+    remove_user_mail(users);
+  return rv;
+}
+
+/** Removes the message last saved for a list of users (with
+ *  save_user_mail or save_user_mail_fd) from their mailboxes, e.g.,
+ *  when the delivery could not be made durable and will be retried by
+ *  the client. Users for whom the message was not saved are skipped.
+ *
+ *  Parameters: users: List of recipient users passed to the call that
+ *                     saved the message.
+ */
+void remove_user_mail(user_list_t users) {
+  
+  char mail_dir[MAIL_DIRECTORY_SIZE];
+  char blob[BLOB_NAME_SIZE];
   
   for (; users; users = users->next) {
     
-    // Create recipient directory if it doesn't exist yet (error ignored)
-    int i = 0;
-    sprintf(mail_file, MAIL_BASE_DIRECTORY "/%s", users->user);
-    mkdir(mail_file, 0777);
+    if (!users->saved)
+      continue;
     
-    // Tries to create a file called 0.mail, if it exists tries 1.mail, and so on
-    do {
-      sprintf(mail_file, MAIL_BASE_DIRECTORY "/%s/%d" MAIL_FILE_SUFFIX, users->user, i++);
-    } while (link(basefile, mail_file) < 0 && errno == EEXIST);
+    snprintf(mail_dir, sizeof(mail_dir), MAIL_BASE_DIRECTORY "/%s", users->user);
+    int dir_fd = open(mail_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+      
+      struct mail_index_header *header;
+      size_t map_length;
+      int current, removed = 0;
+      
+      flock(dir_fd, LOCK_EX);
+      header = mail_index_map(dir_fd, &map_length, &current);
+      if (!users->segment)
+	unlinkat(dir_fd, users->saved, 0);
+      
+      if (header) {
+	const struct mail_index_record *record;
+	uint64_t offset = 0;
+	uint32_t count = 0;
+	char *records = NULL;
+	size_t length = 0, capacity = 0;
+	
+	while ((record = mail_index_next(header, &offset)) != NULL) {
+	  if (!strcmp(record->name, users->saved)) {
+	    removed = 1;
+	    continue;
+	  }
+	  mail_index_add_record(&records, &length, &capacity, record, record->name);
+	  count++;
+	}
+	munmap(header, map_length);
+	if (removed && mail_index_store(dir_fd, records, length, count, current) < 0)
+	  removed = 0;
+	free(records);
+      }
+      
+      // As in destroy_mail_list, the segment reference is released only
+      // once the record is gone, while the mailbox is locked
+      if (removed && users->segment)
+	seg_release(SEGMENT_DIRECTORY, users->segment, users->offset);
+      close(dir_fd);
+    }
+    
+    // The blob store is locked after the mailbox is unlocked
+    if (!users->segment && mail_blob_name(users->saved, blob)) {
+      int blobs_fd = open(BLOB_DIRECTORY, O_RDONLY | O_DIRECTORY);
+      if (blobs_fd >= 0) {
+	flock(blobs_fd, LOCK_EX);
+	mail_blob_release(blobs_fd, blob);
+	close(blobs_fd);
+      }
+    }
+    
+    free(users->saved);
+    users->saved = NULL;
+  }
+}
+
+/** Checks that a directory where messages are spooled before delivery
+ *  is in the same file system as the mail store (which is created if
+ *  needed), since messages are delivered by linking spool files into
+ *  mailboxes.
+ *
+ *  Parameters: directory: Spool directory.
+ *
+ *  Returns: 0 if both are in the same file system, -1 otherwise (errno
+ *           is set to EXDEV if they are in different file systems).
+ */
+int check_mail_spool_directory(const char *directory) {
+  
+  struct stat spool_stat, store_stat;
+  
+  mkdir(MAIL_BASE_DIRECTORY, 0777);
+  if (stat(directory, &spool_stat) < 0 || stat(MAIL_BASE_DIRECTORY, &store_stat) < 0)
+    return -1;
+  if (spool_stat.st_dev != store_stat.st_dev) {
+    errno = EXDEV;
+    return -1;
   }
+  return 0;
 }
 
 /** Creates a list of email messages for a username, based on existing
  *  email files created using save_user_mail (or equivalent). These
  *  messages only load the file names and sizes, the messages
  *  themselves are not kept in memory. If the user does not exist or
- *  does not have any messages, an empty list is returned.
+ *  does not have any messages, an empty list is returned. The list is
+ *  read from the mailbox index if it is valid; otherwise the mailbox
+ *  directory is listed and the index is rebuilt.
  *
  *  Parameters: username: Name of the user whose email messages should
  *                        be retrieved.
@@ -161,56 +1490,195 @@ void save_user_mail(const char *basefile, user_list_t users) {
  */
 mail_list_t load_user_mail(const char *username) {
   
-  char filename[NAME_MAX + 1];
-  sprintf(filename, MAIL_BASE_DIRECTORY "/%s", username);
+  char dirname[MAIL_DIRECTORY_SIZE];
+  char filename[PATH_MAX];
+  snprintf(dirname, sizeof(dirname), MAIL_BASE_DIRECTORY "/%s", username);
+  
+  int dir_fd = open(dirname, O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0) return NULL;
+  
+  struct mail_list *list = mail_list_create(dirname);
+  struct mail_index_header *header;
+  size_t map_length;
+  
+  const struct mail_index_record *record;
+  uint64_t offset;
+  int current;
+  
+  // Use the index if it is current
+  flock(dir_fd, LOCK_SH);
+  if ((header = mail_index_map(dir_fd, &map_length, &current)) != NULL) {
+    
+    if (current) {
+      offset = 0;
+      while ((record = mail_index_next(header, &offset)) != NULL)
+	mail_list_append_record(list, record);
+      
+      if (list->length == header->count) {
+	munmap(header, map_length);
+	close(dir_fd);
+	mail_list_finish(list);
+	return list;
+      }
+      
+      list->length = list->count = 0;
+      list->size = list->names_length = 0;
+    }
+    munmap(header, map_length);
+  }
+  
+  // Otherwise list the directory and rebuild the index
+  flock(dir_fd, LOCK_EX);
+  mail_index_upgrade(dir_fd, dirname);
   
-  DIR *dir = opendir(filename);
-  if (!dir) return NULL;
+  DIR *dir = opendir(dirname);
+  if (!dir) {
+    close(dir_fd);
+    destroy_mail_list(list);
+    return NULL;
+  }
   
   struct stat file_stat;
   struct dirent *dir_entry;
-  const size_t suflen = strlen(MAIL_FILE_SUFFIX);
-  struct mail_list *list = NULL;
+  uint64_t flags;
+  char *records = NULL;
+  size_t records_length = 0, records_capacity = 0;
+  
+  // Messages in segments are only recorded in the index
+  if ((header = mail_index_map(dir_fd, &map_length, &current)) != NULL) {
+    offset = 0;
+    while ((record = mail_index_next(header, &offset)) != NULL) {
+      if (record->segment) {
+	mail_list_append_record(list, record);
+	mail_index_add_record(&records, &records_length, &records_capacity, record, record->name);
+      }
+    }
+    munmap(header, map_length);
+  }
   
   while ((dir_entry = readdir(dir)) != NULL) {
     
-    if (dir_entry->d_type == DT_REG &&
-	strlen(dir_entry->d_name) > suflen &&
-	!strcmp(dir_entry->d_name + strlen(dir_entry->d_name) - suflen, MAIL_FILE_SUFFIX)) {
-      
-      struct mail_list *item = malloc(sizeof(struct mail_list));
-      sprintf(item->item.file_name, MAIL_BASE_DIRECTORY "/%s/%s", username, dir_entry->d_name);
+    if (dir_entry->d_type == DT_REG && mail_file_flags(dir_entry->d_name, &flags)) {
       
-      if (stat(item->item.file_name, &file_stat) < 0) {
-	free(item);
+      // Compressed messages are listed with their original size
+      snprintf(filename, sizeof(filename), "%s/%s", dirname, dir_entry->d_name);
+      int fd = open(filename, O_RDONLY);
+      if (fd < 0)
+	continue;
+      if (fstat(fd, &file_stat) < 0) {
+	close(fd);
+	continue;
+      }
+      struct mail_index_record fields = { .size = file_stat.st_size, .flags = flags };
+      if ((flags & MAIL_FLAG_COMPRESSED) && !mz_raw_size(fd, 0, &fields.size)) {
+	close(fd);
 	continue;
       }
+      mail_top_scan(fd, 0, fields.size, flags & MAIL_FLAG_COMPRESSED, MAIL_TOP_LINES, &fields.top);
+      close(fd);
       
-      item->item.file_size = file_stat.st_size;
-      item->item.deleted = 0;
-      item->next = list;
-      list = item;
+      mail_list_append(list, filename, NULL, &fields);
+      mail_index_add_record(&records, &records_length, &records_capacity,
+			    &fields, dir_entry->d_name);
     }
   }
   
   closedir(dir);
+  mail_index_store(dir_fd, records, records_length, list->length, 1);
+  free(records);
+  close(dir_fd);
+  mail_list_finish(list);
   return list;
 }
 
 /** Frees all memory used by a list of emails. Also deletes any files
- *  marked to be deleted.
+ *  marked to be deleted, and removes them from the mailbox index.
  *
  *  Parameters: list: List of emails to be deleted.
  */
 void destroy_mail_list(mail_list_t list) {
-  while (list) {
+  
+  if (!list) return;
+  
+  int dir_fd = -1;
+  if (list->count < list->length &&
+      (dir_fd = open(list->directory, O_RDONLY | O_DIRECTORY)) >= 0) {
     
-    if (list->item.deleted) unlink(list->item.file_name);
+    struct mail_index_header *header;
+    size_t map_length;
+    int current;
     
-    mail_list_t next = list->next;
-    free(list);
-    list = next;
+    flock(dir_fd, LOCK_EX);
+    header = mail_index_map(dir_fd, &map_length, &current);
+    
+    for (unsigned int i = 0; i < list->length; i++)
+      if (list->items[i].deleted && !list->items[i].segment)
+	unlink(list->names + list->items[i].name_offset);
+    
+    // Compact the index, keeping messages delivered after the list was
+    // loaded. Records are in the same order as the items in the list.
+    if (header) {
+      const struct mail_index_record *record;
+      uint64_t offset = 0;
+      unsigned int i = 0;
+      uint32_t count = 0;
+      char *records = NULL;
+      size_t length = 0, capacity = 0;
+      
+      while ((record = mail_index_next(header, &offset)) != NULL) {
+	
+	while (i < list->length && strcmp(list->names + list->items[i].uid_offset, record->name))
+	  i++;
+	if (i < list->length && list->items[i].deleted) {
+	  list->items[i++].removed = 1;
+	  continue;
+	}
+	i++;
+	
+	mail_index_add_record(&records, &length, &capacity, record, record->name);
+	count++;
+      }
+      
+      munmap(header, map_length);
+      if (mail_index_store(dir_fd, records, length, count, current) < 0)
+	for (unsigned int i = 0; i < list->length; i++)
+	  list->items[i].removed = 0;
+      free(records);
+    }
+    
+    // References to segments are only released once no index points
+    // to the message anymore. Only records removed above are released,
+    // while the mailbox is still locked, since another session may have
+    // removed the same message already.
+    for (unsigned int i = 0; i < list->length; i++)
+      if (list->items[i].removed && list->items[i].segment)
+	seg_release(SEGMENT_DIRECTORY, list->items[i].segment, list->items[i].offset);
+    
+    close(dir_fd);
+    
+    // Blobs are released after the mailbox is unlocked, since
+    // deliveries lock the blob store before the mailbox
+    int blobs_fd = -1;
+    char blob[BLOB_NAME_SIZE];
+    for (unsigned int i = 0; i < list->length; i++) {
+      if (list->items[i].deleted && !list->items[i].segment &&
+	  mail_blob_name(list->names + list->items[i].name_offset, blob)) {
+	if (blobs_fd < 0) {
+	  if ((blobs_fd = open(BLOB_DIRECTORY, O_RDONLY | O_DIRECTORY)) < 0)
+	    break;
+	  flock(blobs_fd, LOCK_EX);
+	}
+	mail_blob_release(blobs_fd, blob);
+      }
+    }
+    if (blobs_fd >= 0)
+      close(blobs_fd);
   }
+  
+  free(list->directory);
+  free(list->items);
+  free(list->names);
+  free(list);
 }
 
 /** Returns the number of email messages available in a list of
@@ -221,12 +1689,7 @@ void destroy_mail_list(mail_list_t list) {
  *  Returns: Number of non-deleted messages in list.
  */
 unsigned int get_mail_count(mail_list_t list) {
-  unsigned int rv = 0;
-  while (list) {
-    if (!list->item.deleted) rv++;
-    list = list->next;
-  }
-  return rv;
+  return list ? list->count : 0;
 }
 
 /** Returns the email message object at a specific position in a list
@@ -249,13 +1712,9 @@ unsigned int get_mail_count(mail_list_t list) {
  */
 mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
   
-  while (list) {
-    if (!pos--)
-      return list->item.deleted ? NULL : &list->item;
-    list = list->next;
-  }
-  
-  return NULL;
+  if (!list || pos >= list->length || list->items[pos].deleted)
+    return NULL;
+  return &list->items[pos];
 }
 
 /** Returns the total amount of bytes in all email messages in a list
@@ -266,12 +1725,7 @@ mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
  *  Returns: Total size for all non-deleted messages in list.
  */
 size_t get_mail_list_size(mail_list_t list) {
-  size_t rv = 0;
-  while (list) {
-    rv += list->item.deleted ? 0 : list->item.file_size;
-    list = list->next;
-  }
-  return rv;
+  return list ? list->size : 0;
 }
 
 /** Returns the total amount of bytes in an email message.
@@ -284,18 +1738,98 @@ size_t get_mail_item_size(mail_item_t item) {
   return item->file_size;
 }
 
+/** Returns the length of the start of an email message holding its
+ *  headers, the empty line after them and a number of body lines, as
+ *  sent by the POP3 TOP command. The length is found from the
+ *  boundaries recorded when the message was delivered; the message is
+ *  only read if more body lines are requested than were recorded.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *              lines: Number of body lines.
+ *
+ *  Returns: Length of the start of the message, in bytes (the size of
+ *           the message if it has fewer body lines).
+ */
+size_t get_mail_item_top_size(mail_item_t item, unsigned int lines) {
+  
+  struct mail_top top;
+  off_t offset;
+  
+  if (!lines)
+    return item->top.header_length;
+  if (lines <= item->top.line_count)
+    return item->top.line_ends[lines - 1];
+  if (item->top.line_count < MAIL_TOP_LINES)
+    return item->file_size;
+  
+  int fd = open_mail_item(item, &offset);
+  if (fd < 0)
+    return item->file_size;
+  size_t length = mail_top_scan(fd, offset, item->file_size, item->compressed, lines, &top);
+  close(fd);
+  return length;
+}
+
 /** Returns the name of the file containing the contents of an email
  *  message. The name is returned as a string that should not be
  *  modified by the caller, as it is used in the internal
  *  representation of the email item. It will remain valid and
  *  unmodified until the list of emails containing it is destroyed.
+ *  Messages stored in segments share their file with other messages;
+ *  use open_mail_item to find where the message starts.
  *
  *  Parameters: item: Email message to be assessed.
  *
  *  Returns: Name of the file containing the email contents.
  */
 const char *get_mail_item_filename(mail_item_t item) {
-  return item->file_name;
+  return item->list->names + item->name_offset;
+}
+
+/** Returns the unique ID of an email message, as used by the POP3
+ *  UIDL command. The ID is assigned when the message is delivered (it
+ *  is the name of the message file, or the name recorded in the index
+ *  for messages in segments), and never changes while the message is
+ *  kept in the mailbox. The string should not be modified by the
+ *  caller, and remains valid until the list of emails containing it
+ *  is destroyed.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *
+ *  Returns: Unique ID of the message.
+ */
+const char *get_mail_item_uid(mail_item_t item) {
+  return item->list->names + item->uid_offset;
+}
+
+/** Checks if an email message is stored in compressed format (see
+ *  mailzip.c). This is recorded when the message is delivered, and
+ *  does not depend on its contents.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *
+ *  Returns: a non-zero value if the message is compressed.
+ */
+int is_mail_item_compressed(mail_item_t item) {
+  return item->compressed;
+}
+
+/** Opens the file containing the contents of an email message for
+ *  reading. The message starts at the returned offset (which is only
+ *  non-zero for messages stored in segments). Compressed messages (see
+ *  is_mail_item_compressed) must be read with mz_open; others take
+ *  get_mail_item_size bytes.
+ *
+ *  Parameters: item: Email message to be opened.
+ *              offset: Pointer where the position of the message in
+ *                      the file is returned.
+ *
+ *  Returns: a file descriptor, to be closed by the caller, or -1 if
+ *           the file could not be opened.
+ */
+int open_mail_item(mail_item_t item, off_t *offset) {
+  *offset = item->offset;
+  return open(get_mail_item_filename(item), O_RDONLY);
 }
 
 /** Marks a message as deleted in the internal email list. Does not
@@ -306,7 +1840,12 @@ const char *get_mail_item_filename(mail_item_t item) {
  *  Parameters: item: Email message to be marked as deleted.
  */
 void mark_mail_item_deleted(mail_item_t item) {
+  
+  if (item->deleted) return;
+  
   item->deleted = 1;
+  item->list->count--;
+  item->list->size -= item->file_size;
 }
 
 /** Marks all deleted messages in a list as no longer deleted.
@@ -319,10 +1858,16 @@ unsigned int reset_mail_list_deleted_flag(mail_list_t list) {
   
   unsigned int rv = 0;
   
-  while (list) {
-    rv += list->item.deleted;
-    list->item.deleted = 0;
-    list = list->next;
+  if (!list) return 0;
+  
+  for (unsigned int i = 0; i < list->length; i++) {
+    struct mail_item *item = &list->items[i];
+    if (item->deleted) {
+      item->deleted = 0;
+      list->count++;
+      list->size += item->file_size;
+      rv++;
+    }
   }
   
   return rv;
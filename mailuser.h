@@ -8,10 +8,15 @@
 #define _MAILUSER_H_
 
 #include <stdio.h>
+#include <sys/types.h>
 
 #define MAX_USERNAME_SIZE 255
 #define MAX_PASSWORD_SIZE 255
 
+#define MAIL_STORE_FILES    0
+#define MAIL_STORE_SEGMENTS 1
+#define MAIL_STORE_BLOBS    2
+
 typedef struct user_list *user_list_t;
 typedef struct mail_item *mail_item_t;
 typedef struct mail_list *mail_list_t;
@@ -22,7 +27,12 @@ user_list_t create_user_list(void);
 void add_user_to_list(user_list_t *list, const char *username);
 void destroy_user_list(user_list_t list);
 
-void save_user_mail(const char *basefile, user_list_t users);
+void set_mail_store(int store);
+void set_mail_compression(int compress);
+int save_user_mail(const char *basefile, user_list_t users);
+int save_user_mail_fd(int fd, user_list_t users);
+void remove_user_mail(user_list_t users);
+int check_mail_spool_directory(const char *directory);
 mail_list_t load_user_mail(const char *username);
 
 void destroy_mail_list(mail_list_t list);
@@ -32,7 +42,11 @@ size_t get_mail_list_size(mail_list_t list);
 unsigned int reset_mail_list_deleted_flag(mail_list_t list);
 
 size_t get_mail_item_size(mail_item_t item);
+size_t get_mail_item_top_size(mail_item_t item, unsigned int lines);
 const char *get_mail_item_filename(mail_item_t item);
+const char *get_mail_item_uid(mail_item_t item);
+int is_mail_item_compressed(mail_item_t item);
+int open_mail_item(mail_item_t item, off_t *offset);
 void mark_mail_item_deleted(mail_item_t item);
 
 #endif
@@ -0,0 +1,331 @@
+/* mailzip.c
+ * Compressed-at-rest format for stored messages, with a built-in LZ
+ * codec and a block reader for streaming decompression.
+ */
+
+#include "mailzip.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MZ_MAGIC 0x50495a4dU // "MZIP"
+#define MZ_BLOCK_SIZE 65536
+#define MZ_MAX_BLOCK_SIZE (1024 * 1024)
+#define MZ_STORED 0x80000000U // block stored without compression
+#define MZ_MIN_MATCH 4
+#define MZ_HASH_BITS 13
+
+// Worst case size of a compressed block, for incompressible data
+#define MZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+/* A compressed file starts with a header, followed by blocks of
+ * compressed data. Each block holds block_size bytes of the original
+ * contents (the last one may be shorter), and is preceded by a 32-bit
+ * length; blocks that do not shrink are stored as is, flagged with
+ * MZ_STORED in the length. Since blocks are independent, a message
+ * can be decompressed one block at a time while it is sent.
+ *
+ * Blocks are compressed with a simple LZ77 scheme, in the style of
+ * LZ4: a sequence of literal bytes followed by a copy of earlier
+ * output, with 16-bit offsets. Each sequence starts with a token
+ * holding the literal count (high nibble) and the match length minus
+ * MZ_MIN_MATCH (low nibble); a nibble of 15 is followed by extra
+ * length bytes, added until a byte below 255. The last sequence only
+ * has literals.
+ */
+struct mz_header {
+  uint32_t magic;
+  uint32_t block_size;
+  uint64_t raw_size;   // size of the original contents
+};
+
+struct mz_reader {
+  int fd;
+  off_t position;      // position of the next block in the file
+  uint64_t remaining;  // original bytes not yet returned
+  uint32_t block_size;
+  unsigned char *input;
+  unsigned char *output;
+};
+
+/** Internal function that reads 32 bits from an unaligned position. */
+static uint32_t mz_read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+/** Internal function that writes a length that did not fit in a token
+ *  nibble, as a series of bytes.
+ */
+static unsigned char *mz_put_length(unsigned char *out, size_t length) {
+  for (; length >= 255; length -= 255)
+    *out++ = 255;
+  *out++ = length;
+  return out;
+}
+
+/** Internal function that writes a sequence: literals, followed by a
+ *  match (if match_length is not zero).
+ */
+static unsigned char *mz_put_sequence(unsigned char *out, const unsigned char *literals,
+				      size_t literal_length, size_t offset, size_t match_length) {
+
+  size_t extra_match = match_length ? match_length - MZ_MIN_MATCH : 0;
+
+  *out++ = (literal_length >= 15 ? 15 : literal_length) << 4 | (extra_match >= 15 ? 15 : extra_match);
+  if (literal_length >= 15)
+    out = mz_put_length(out, literal_length - 15);
+  memcpy(out, literals, literal_length);
+  out += literal_length;
+
+  if (match_length) {
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    if (extra_match >= 15)
+      out = mz_put_length(out, extra_match - 15);
+  }
+  return out;
+}
+
+/** Internal function that compresses a block of at most 64 KB.
+ *
+ *  Returns: the size of the compressed block, written to dst, which
+ *           must hold at least MZ_BOUND(size) bytes.
+ */
+static size_t mz_compress_block(const unsigned char *src, size_t size, unsigned char *dst) {
+
+  uint32_t table[1 << MZ_HASH_BITS]; // last position + 1 of each hashed prefix
+  unsigned char *out = dst;
+  size_t anchor = 0, i = 0;
+
+  memset(table, 0, sizeof(table));
+  while (i + MZ_MIN_MATCH <= size) {
+
+    uint32_t prefix = mz_read32(src + i);
+    uint32_t hash = (prefix * 2654435761U) >> (32 - MZ_HASH_BITS);
+    size_t candidate = table[hash];
+    table[hash] = i + 1;
+
+    if (!candidate || mz_read32(src + candidate - 1) != prefix) {
+      i++;
+      continue;
+    }
+
+    size_t match = candidate - 1, length = MZ_MIN_MATCH;
+    while (i + length < size && src[match + length] == src[i + length])
+      length++;
+
+    out = mz_put_sequence(out, src + anchor, i - anchor, i - match, length);
+    i += length;
+    anchor = i;
+  }
+
+  out = mz_put_sequence(out, src + anchor, size - anchor, 0, 0);
+  return out - dst;
+}
+
+/** Internal function that decompresses a block.
+ *
+ *  Returns: the size of the decompressed data, or -1 if the block is
+ *           corrupt or does not fit in capacity bytes.
+ */
+static ssize_t mz_decompress_block(const unsigned char *src, size_t size,
+				   unsigned char *dst, size_t capacity) {
+
+  const unsigned char *end = src + size;
+  size_t out = 0;
+  unsigned char byte;
+
+  while (src < end) {
+
+    unsigned int token = *src++;
+    size_t length = token >> 4;
+    if (length == 15) {
+      do {
+	if (src == end)
+	  return -1;
+	length += byte = *src++;
+      } while (byte == 255);
+    }
+    if (length > (size_t) (end - src) || length > capacity - out)
+      return -1;
+    memcpy(dst + out, src, length);
+    src += length;
+    out += length;
+
+    // The last sequence has no match
+    if (src == end)
+      break;
+
+    if (end - src < 2)
+      return -1;
+    size_t offset = src[0] | src[1] << 8;
+    src += 2;
+    length = token & 15;
+    if (length == 15) {
+      do {
+	if (src == end)
+	  return -1;
+	length += byte = *src++;
+      } while (byte == 255);
+    }
+    length += MZ_MIN_MATCH;
+    if (!offset || offset > out || length > capacity - out)
+      return -1;
+
+    // Matches may overlap the data being written, so copy byte by byte
+    for (unsigned char *p = dst + out, *stop = p + length; p < stop; p++)
+      *p = p[-offset];
+    out += length;
+  }
+  return out;
+}
+
+/** Compresses the contents of a file into another file.
+ *
+ *  Parameters: src_fd: File descriptor of the file to be compressed,
+ *                      read from its beginning.
+ *              dst_fd: File descriptor of an empty file where the
+ *                      compressed contents are written.
+ *              raw_size: Pointer where the size of the original
+ *                        contents is returned.
+ *
+ *  Returns: 0 if successful, -1 otherwise.
+ */
+int mz_compress(int src_fd, int dst_fd, uint64_t *raw_size) {
+
+  struct mz_header header = { .magic = MZ_MAGIC, .block_size = MZ_BLOCK_SIZE };
+  unsigned char *input = malloc(MZ_BLOCK_SIZE);
+  unsigned char *output = malloc(sizeof(uint32_t) + MZ_BOUND(MZ_BLOCK_SIZE));
+  off_t position = sizeof(header);
+  ssize_t rv = -1;
+
+  while (input && output &&
+	 (rv = pread(src_fd, input, MZ_BLOCK_SIZE, header.raw_size)) > 0) {
+
+    uint32_t length = mz_compress_block(input, rv, output + sizeof(length));
+    if (length >= rv) {
+      memcpy(output + sizeof(length), input, rv);
+      length = rv | MZ_STORED;
+    }
+    memcpy(output, &length, sizeof(length));
+
+    size_t block_length = sizeof(length) + (length & ~MZ_STORED);
+    if (pwrite(dst_fd, output, block_length, position) != (ssize_t) block_length) {
+      rv = -1;
+      break;
+    }
+    position += block_length;
+    header.raw_size += rv;
+  }
+
+  free(input);
+  free(output);
+  if (rv < 0 || pwrite(dst_fd, &header, sizeof(header), 0) != sizeof(header))
+    return -1;
+
+  *raw_size = header.raw_size;
+  return 0;
+}
+
+/** Checks if a file (or a message at some position in a file) is in
+ *  compressed format, and finds the size of its original contents.
+ *
+ *  Parameters: fd: File descriptor of the file.
+ *              offset: Position of the contents in the file.
+ *              raw_size: Pointer where the original size is returned.
+ *
+ *  Returns: 1 if the contents are compressed, 0 otherwise.
+ */
+int mz_raw_size(int fd, off_t offset, uint64_t *raw_size) {
+
+  struct mz_header header;
+
+  if (pread(fd, &header, sizeof(header), offset) != sizeof(header) ||
+      header.magic != MZ_MAGIC)
+    return 0;
+
+  *raw_size = header.raw_size;
+  return 1;
+}
+
+/** Creates a reader that decompresses the contents of a compressed
+ *  file one block at a time.
+ *
+ *  Parameters: fd: File descriptor of the file, which must remain
+ *                  open while the reader is used.
+ *              offset: Position of the compressed contents in the file.
+ *
+ *  Returns: a new reader, or NULL if the contents are not in
+ *           compressed format.
+ */
+mz_reader_t mz_open(int fd, off_t offset) {
+
+  struct mz_header header;
+
+  if (pread(fd, &header, sizeof(header), offset) != sizeof(header) ||
+      header.magic != MZ_MAGIC || !header.block_size || header.block_size > MZ_MAX_BLOCK_SIZE)
+    return NULL;
+
+  mz_reader_t reader = malloc(sizeof(struct mz_reader));
+  reader->fd = fd;
+  reader->position = offset + sizeof(header);
+  reader->remaining = header.raw_size;
+  reader->block_size = header.block_size;
+  reader->input = malloc(header.block_size);
+  reader->output = malloc(header.block_size);
+  return reader;
+}
+
+/** Decompresses the next block of contents.
+ *
+ *  Parameters: reader: Reader created with mz_open.
+ *              data: Pointer where a pointer to the decompressed data
+ *                    is returned. The data remains valid until the
+ *                    next call.
+ *
+ *  Returns: the number of bytes decompressed, 0 at the end of the
+ *           contents, or -1 if the file could not be read or is
+ *           corrupt.
+ */
+ssize_t mz_read(mz_reader_t reader, const char **data) {
+
+  uint32_t length;
+  size_t expected = reader->remaining < reader->block_size ?
+    reader->remaining : reader->block_size;
+
+  if (!expected)
+    return 0;
+
+  if (pread(reader->fd, &length, sizeof(length), reader->position) != sizeof(length))
+    return -1;
+
+  size_t stored_length = length & ~MZ_STORED;
+  unsigned char *block = (length & MZ_STORED) ? reader->output : reader->input;
+  if (stored_length > reader->block_size ||
+      pread(reader->fd, block, stored_length, reader->position + sizeof(length)) !=
+      (ssize_t) stored_length)
+    return -1;
+
+  ssize_t rv = stored_length;
+  if (!(length & MZ_STORED))
+    rv = mz_decompress_block(reader->input, stored_length, reader->output, reader->block_size);
+  if (rv != (ssize_t) expected)
+    return -1;
+
+  reader->position += sizeof(length) + stored_length;
+  reader->remaining -= rv;
+  *data = (const char *) reader->output;
+  return rv;
+}
+
+/** Frees a reader created with mz_open. The file is not closed.
+ */
+void mz_close(mz_reader_t reader) {
+  if (!reader) return;
+  free(reader->input);
+  free(reader->output);
+  free(reader);
+}
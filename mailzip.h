@@ -0,0 +1,21 @@
+/* mailzip.h
+ * Compressed-at-rest format for stored messages, with a built-in LZ
+ * codec and a block reader for streaming decompression.
+ */
+
+#ifndef _MAIL_ZIP_H_
+#define _MAIL_ZIP_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct mz_reader *mz_reader_t;
+
+int mz_compress(int src_fd, int dst_fd, uint64_t *raw_size);
+int mz_raw_size(int fd, off_t offset, uint64_t *raw_size);
+
+mz_reader_t mz_open(int fd, off_t offset);
+ssize_t mz_read(mz_reader_t reader, const char **data);
+void mz_close(mz_reader_t reader);
+
+#endif
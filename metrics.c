@@ -0,0 +1,395 @@
+/* metrics.c
+ * Counters and latency histograms shared by all server processes, and
+ * an admin socket exposing them in the Prometheus text format.
+ */
+
+#define _GNU_SOURCE // sched_getcpu
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+/* Metrics are defined (by the server and the protocol) before mt_init
+ * is called, which lays them out in shared memory created before the
+ * server forks. The memory is split in shards, one per CPU, each with
+ * a copy of every metric; a process records in the shard of the CPU
+ * it runs on, with relaxed atomic additions, so recording never takes
+ * a lock and processes on different CPUs do not share cache lines.
+ * Shards are only added together when the metrics are reported.
+ *
+ * Histograms use logarithmic buckets with four sub-buckets for each
+ * power of two, in the style of HDR histograms: every latency is
+ * recorded with a relative error below 25%, for values between one
+ * microsecond and more than a day, in a fixed number of buckets.
+ */
+
+#define MT_MAX_METRICS 64
+#define MT_MAX_SHARDS  64
+#define MT_SUB_BITS    2
+#define MT_BUCKETS     (36 << MT_SUB_BITS)
+#define MT_BACKLOG     4
+#define MT_IO_TIMEOUT  1 // seconds each read or write may block
+#define MT_DEADLINE    5 // seconds a client may take to get a report
+
+struct mt_metric {
+  int type;
+  const char *name;
+  const char *labels; // label pairs without braces, or NULL
+  const char *help;
+  size_t offset;      // position of the metric in each shard
+};
+
+static struct mt_metric mt_metrics[MT_MAX_METRICS] = {
+  [MT_CONNECTIONS] = { MT_COUNTER, "server_connections_total", NULL,
+		       "Connections accepted." },
+  [MT_REFUSED] = { MT_COUNTER, "server_refused_connections_total", NULL,
+		   "Connections refused by admission control." },
+  [MT_TIMEOUTS] = { MT_COUNTER, "server_session_timeouts_total", NULL,
+		    "Sessions closed after being idle for too long." },
+  [MT_ACTIVE_SESSIONS] = { MT_GAUGE, "server_active_sessions", NULL,
+			   "Sessions currently open." },
+  [MT_BYTES_IN] = { MT_COUNTER, "server_received_bytes_total", NULL,
+		    "Bytes received from clients." },
+  [MT_BYTES_OUT] = { MT_COUNTER, "server_sent_bytes_total", NULL,
+		     "Bytes sent to clients." },
+};
+static int mt_count = MT_BYTES_OUT + 1;
+
+static int64_t *mt_shards = NULL;
+static size_t mt_shard_size;  // values in each shard
+static int mt_shard_count;
+static int mt_listener = -1;
+
+/** Defines a new metric. Metrics with the same name (and different
+ *  labels) must be defined one after the other, and all definitions
+ *  must be done before mt_init.
+ *
+ *  Parameters: type: MT_COUNTER, MT_GAUGE or MT_HISTOGRAM.
+ *              name: Name of the metric, which must remain valid.
+ *              labels: Labels of this instance of the metric (e.g.,
+ *                      verb="noop"), or NULL.
+ *              help: Description of the metric (only used in the
+ *                    first definition of each name).
+ *
+ *  Returns: the identifier of the metric, or -1 if no more metrics
+ *           can be defined.
+ */
+int mt_define(int type, const char *name, const char *labels, const char *help) {
+
+  if (mt_shards || mt_count == MT_MAX_METRICS)
+    return -1;
+
+  mt_metrics[mt_count].type = type;
+  mt_metrics[mt_count].name = name;
+  mt_metrics[mt_count].labels = labels;
+  mt_metrics[mt_count].help = help;
+  return mt_count++;
+}
+
+/** Creates the shared memory where metrics are recorded. Must be
+ *  called before the server forks; until then, nothing is recorded.
+ *
+ *  Returns: 0 if successful, -1 otherwise (errno is set accordingly).
+ */
+int mt_init(void) {
+
+  size_t size = 0;
+  for (int i = 0; i < mt_count; i++) {
+    mt_metrics[i].offset = size;
+    // Histograms keep their buckets followed by the sum of all values
+    size += mt_metrics[i].type == MT_HISTOGRAM ? MT_BUCKETS + 1 : 1;
+  }
+  // Each shard starts in its own cache line
+  mt_shard_size = (size + 7) & ~(size_t) 7;
+
+  long cpus = sysconf(_SC_NPROCESSORS_CONF);
+  mt_shard_count = cpus < 1 ? 1 : cpus > MT_MAX_SHARDS ? MT_MAX_SHARDS : cpus;
+
+  void *shards = mmap(NULL, mt_shard_count * mt_shard_size * sizeof(int64_t),
+		      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shards == MAP_FAILED)
+    return -1;
+  mt_shards = shards;
+  return 0;
+}
+
+/** Returns the current time of a monotonic clock, in microseconds, to
+ *  be used as the start of latencies passed to mt_observe. Returns
+ *  zero if metrics are not enabled, so that no time is spent reading
+ *  the clock.
+ */
+uint64_t mt_now(void) {
+
+  struct timespec ts;
+
+  if (!mt_shards)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Internal function that returns the shard of the current CPU. */
+static int64_t *mt_shard(void) {
+  int cpu = sched_getcpu();
+  return mt_shards + (cpu < 0 ? 0 : cpu % mt_shard_count) * mt_shard_size;
+}
+
+/** Adds a value to a counter or gauge. Has no effect if metrics are
+ *  not enabled.
+ *
+ *  Parameters: id: Identifier of the metric.
+ *              value: Value to be added (negative for gauges that
+ *                     decrease).
+ */
+void mt_add(int id, int64_t value) {
+  if (!mt_shards || id < 0)
+    return;
+  __atomic_fetch_add(&mt_shard()[mt_metrics[id].offset], value, __ATOMIC_RELAXED);
+}
+
+/** Internal function that finds the bucket of a value: values below
+ *  four have their own bucket, and each power of two above is split
+ *  in four buckets of the same width.
+ */
+static int mt_bucket(uint64_t value) {
+
+  if (value < (1 << MT_SUB_BITS))
+    return value;
+
+  int exponent = 63 - __builtin_clzll(value);
+  int sub = (value >> (exponent - MT_SUB_BITS)) & ((1 << MT_SUB_BITS) - 1);
+  int bucket = ((exponent - MT_SUB_BITS + 1) << MT_SUB_BITS) + sub;
+  return bucket < MT_BUCKETS ? bucket : MT_BUCKETS - 1;
+}
+
+/** Internal function that returns the largest value recorded in a
+ *  bucket.
+ */
+static uint64_t mt_bucket_limit(int bucket) {
+
+  if (bucket < (1 << MT_SUB_BITS))
+    return bucket;
+
+  int shift = (bucket >> MT_SUB_BITS) - 1;
+  uint64_t sub = bucket & ((1 << MT_SUB_BITS) - 1);
+  return (((1 << MT_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+/** Records a latency in a histogram. Has no effect if metrics are not
+ *  enabled.
+ *
+ *  Parameters: id: Identifier of the metric.
+ *              usec: Latency, in microseconds (e.g., the difference
+ *                    between two calls to mt_now).
+ */
+void mt_observe(int id, uint64_t usec) {
+
+  if (!mt_shards || id < 0)
+    return;
+
+  int64_t *values = mt_shard() + mt_metrics[id].offset;
+  __atomic_fetch_add(&values[mt_bucket(usec)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&values[MT_BUCKETS], usec, __ATOMIC_RELAXED);
+}
+
+/** Internal function that adds up a value over all shards. */
+static int64_t mt_total(size_t offset) {
+
+  int64_t total = 0;
+  for (int i = 0; i < mt_shard_count; i++)
+    total += __atomic_load_n(&mt_shards[i * mt_shard_size + offset], __ATOMIC_RELAXED);
+  return total;
+}
+
+/** Internal function that prints a number of microseconds in seconds. */
+static void mt_print_seconds(FILE *out, uint64_t usec) {
+  fprintf(out, "%llu.%06llu", (unsigned long long) usec / 1000000,
+	  (unsigned long long) usec % 1000000);
+}
+
+/** Internal function that writes a histogram. Only buckets where the
+ *  cumulative count changes are written, since most of them are empty.
+ */
+static void mt_report_histogram(FILE *out, const struct mt_metric *metric) {
+
+  const char *labels = metric->labels ? metric->labels : "";
+  const char *separator = metric->labels ? "," : "";
+  int64_t count = 0;
+
+  for (int i = 0; i < MT_BUCKETS; i++) {
+    int64_t value = mt_total(metric->offset + i);
+    if (!value)
+      continue;
+    count += value;
+    fprintf(out, "%s_bucket{%s%sle=\"", metric->name, labels, separator);
+    mt_print_seconds(out, mt_bucket_limit(i));
+    fprintf(out, "\"} %lld\n", (long long) count);
+  }
+  fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lld\n", metric->name, labels, separator,
+	  (long long) count);
+
+  fprintf(out, "%s_sum%s%s%s ", metric->name, metric->labels ? "{" : "", labels,
+	  metric->labels ? "}" : "");
+  mt_print_seconds(out, mt_total(metric->offset + MT_BUCKETS));
+  fprintf(out, "\n%s_count%s%s%s %lld\n", metric->name, metric->labels ? "{" : "", labels,
+	  metric->labels ? "}" : "", (long long) count);
+}
+
+/** Internal function that writes all metrics in the Prometheus text
+ *  exposition format.
+ */
+static void mt_report(FILE *out) {
+
+  static const char *types[] = { "counter", "gauge", "histogram" };
+
+  for (int i = 0; i < mt_count; i++) {
+    const struct mt_metric *metric = &mt_metrics[i];
+
+    if (!i || strcmp(metric->name, mt_metrics[i - 1].name))
+      fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", metric->name, metric->help,
+	      metric->name, types[metric->type]);
+
+    if (metric->type == MT_HISTOGRAM)
+      mt_report_histogram(out, metric);
+    else if (metric->labels)
+      fprintf(out, "%s{%s} %lld\n", metric->name, metric->labels,
+	      (long long) mt_total(metric->offset));
+    else
+      fprintf(out, "%s %lld\n", metric->name, (long long) mt_total(metric->offset));
+  }
+}
+
+/** Internal function that sends a report to a client of the admin
+ *  socket. Each send blocks for at most MT_IO_TIMEOUT seconds, and the
+ *  client is dropped once MT_DEADLINE seconds have passed, so a client
+ *  that does not read cannot hold the admin thread.
+ */
+static void mt_send_report(int fd, const char *report, size_t size) {
+
+  time_t deadline = time(NULL) + MT_DEADLINE;
+
+  while (size > 0 && time(NULL) < deadline) {
+    ssize_t rv = send(fd, report, size, MSG_NOSIGNAL);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv <= 0)
+      return;
+    report += rv;
+    size -= rv;
+  }
+}
+
+/** Internal function, run by the admin thread, that answers each
+ *  connection to the admin socket with a report of all metrics. The
+ *  request is not interpreted, so the socket can be scraped over HTTP
+ *  or read with a plain TCP client. The report is written to memory
+ *  first, so that it is sent with as few system calls as possible.
+ */
+static void *mt_admin_thread(void *arg) {
+
+  char request[1024];
+  struct timeval timeout = { .tv_sec = MT_IO_TIMEOUT };
+
+  while (1) {
+    int fd = accept(mt_listener, NULL, NULL);
+    if (fd == -1) {
+      if (errno != EINTR)
+	perror("metrics: accept");
+      continue;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Consume (the start of) an HTTP request, if the client sends one
+    recv(fd, request, sizeof(request), 0);
+
+    char *report = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&report, &size);
+    if (out) {
+      fprintf(out, "HTTP/1.0 200 OK\r\n"
+	      "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+      mt_report(out);
+      if (fclose(out) == 0)
+	mt_send_report(fd, report, size);
+    }
+    free(report);
+    close(fd);
+  }
+  return NULL;
+}
+
+/** Starts serving the metrics on a local admin socket, bound to the
+ *  loopback address only, from a thread of the calling (main)
+ *  process. Must be called after mt_init.
+ *
+ *  The thread is started before the engines fork, since the main
+ *  process keeps forking while the server runs (a process per
+ *  connection in the fork engine, and restarted workers in the others),
+ *  so there is no point after the last fork. Forking with the thread
+ *  running is safe: only the forking thread exists in the child, which
+ *  never uses the state of the admin thread (children close the admin
+ *  socket with mt_detach), and the only library state the thread
+ *  shares is malloc and stdio, whose locks glibc takes across fork so
+ *  they are consistent in the child. The shared metrics are only read
+ *  by the thread, with atomic loads.
+ *
+ *  Parameters: port: String corresponding to the port number (or
+ *                    name) of the admin socket.
+ *
+ *  Returns: 0 if successful, -1 otherwise.
+ */
+int mt_serve(const char *port) {
+
+  struct addrinfo hints, *info;
+  pthread_t thread;
+  int yes = 1;
+  int rv;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family   = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rv = getaddrinfo("127.0.0.1", port, &hints, &info)) != 0) {
+    fprintf(stderr, "metrics: %s\n", gai_strerror(rv));
+    return -1;
+  }
+
+  mt_listener = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+  if (mt_listener == -1 ||
+      setsockopt(mt_listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+      bind(mt_listener, info->ai_addr, info->ai_addrlen) == -1 ||
+      listen(mt_listener, MT_BACKLOG) == -1) {
+    perror("metrics");
+    freeaddrinfo(info);
+    return -1;
+  }
+  freeaddrinfo(info);
+
+  if ((rv = pthread_create(&thread, NULL, mt_admin_thread, NULL)) != 0) {
+    fprintf(stderr, "metrics: %s\n", strerror(rv));
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/** Closes the admin socket in a process forked from the main process,
+ *  which keeps serving it. Metrics are still recorded.
+ */
+void mt_detach(void) {
+  if (mt_listener >= 0)
+    close(mt_listener);
+  mt_listener = -1;
+}
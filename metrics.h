@@ -0,0 +1,33 @@
+/* metrics.h
+ * Counters and latency histograms shared by all server processes, and
+ * an admin socket exposing them in the Prometheus text format.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+// Types of metrics
+#define MT_COUNTER   0
+#define MT_GAUGE     1
+#define MT_HISTOGRAM 2 // latencies, in microseconds
+
+// Metrics kept by the server itself, always defined
+#define MT_CONNECTIONS     0 // connections accepted
+#define MT_REFUSED         1 // connections refused by admission control
+#define MT_TIMEOUTS        2 // sessions closed for being idle
+#define MT_ACTIVE_SESSIONS 3
+#define MT_BYTES_IN        4
+#define MT_BYTES_OUT       5
+
+int mt_define(int type, const char *name, const char *labels, const char *help);
+int mt_init(void);
+int mt_serve(const char *port);
+void mt_detach(void);
+
+uint64_t mt_now(void);
+void mt_add(int id, int64_t value);
+void mt_observe(int id, uint64_t usec);
+
+#endif
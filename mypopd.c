@@ -1,5 +1,9 @@
 #include "netbuffer.h"
+#include "outbuffer.h"
 #include "mailuser.h"
+#include "mailzip.h"
+#include "protocol.h"
+#include "metrics.h"
 #include "server.h"
 
 #include <stdio.h>
@@ -7,379 +11,666 @@
 #include <unistd.h>
 #include <sys/utsname.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <limits.h>
 
 #define MAX_LINE_LENGTH 1024
+#define MAX_OUTPUT_SIZE 65536
 
-static void handle_client(int fd);
-int valid_commands(char line[]);
+// Inactivity autologout timer from RFC 1939, in seconds
+#define DEFAULT_TIMEOUT (10 * 60)
+
+#define POP_USAGE SERVER_USAGE " [-t timeout]"
+
+// Session states, as bits for pop_commands
+#define STATE_BIT(state) (1U << (state))
+#define AUTHORIZATION_STATES (STATE_BIT(0) | STATE_BIT(1))
+#define TRANSACTION_STATES STATE_BIT(2)
+#define ANY_STATE (AUTHORIZATION_STATES | TRANSACTION_STATES)
+
+struct pop_session {
+    int fd;
+    char user[MAX_USERNAME_SIZE];
+    char pass[MAX_PASSWORD_SIZE];
+    mail_list_t mailList;
+    char count[10], size[20];
+    int state; // Authorization = 1, Transaction = 2
+    unsigned int cnt;
+    out_buffer_t out;
+    struct utsname uts;
+    // Compressed message being sent, one block at a time
+    mz_reader_t reader;
+    int message;
+    size_t remaining;
+};
+
+static void *open_session(int fd);
+static int handle_line(struct pop_session *s, char line[], int response);
+static int send_message(struct pop_session *s, mail_item_t mail, size_t length, const char *status);
+static int send_blocks(struct pop_session *s);
+static int handle_input(void *session, net_buffer_t buffer);
+static void close_session(void *session, int reason);
+static int flush_session(void *session);
+static unsigned int session_timeout(void *session);
+static void define_metrics(void);
 void update(char count[], char size[], mail_list_t mailList);
 
+static const struct session_ops pop_session_ops = {
+    .max_line = MAX_LINE_LENGTH,
+    .open     = open_session,
+    .input    = handle_input,
+    .close    = close_session,
+    .flush    = flush_session,
+    .timeout  = session_timeout,
+    .refusal  = "-ERR too many connections, try again later\r\n",
+};
+
+// Time the server waits for the next command
+static unsigned int timeout = DEFAULT_TIMEOUT;
+
 int main(int argc, char *argv[]) {
 
-    if (argc != 2) {
-        fprintf(stderr, "Invalid arguments. Expected: %s <port>\n", argv[0]);
+    struct server_config config;
+    int opt;
+    char *end;
+
+    server_config_init(&config);
+    while ((opt = getopt(argc, argv, SERVER_OPTIONS "t:")) != -1) {
+        if (opt == 't') {
+            // Autologout timeout in seconds, zero waits forever
+            unsigned long value = strtoul(optarg, &end, 10);
+            if (*end || !*optarg || value > UINT_MAX) {
+                fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                return 1;
+            }
+            timeout = value;
+        } else if (server_config_option(&config, opt, optarg) <= 0) {
+            fprintf(stderr, "Invalid arguments. Expected: %s " POP_USAGE " <port>\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Invalid arguments. Expected: %s " POP_USAGE " <port>\n", argv[0]);
         return 1;
     }
 
-    run_server(argv[1], handle_client);
+    define_metrics();
+    run_server(argv[optind], &config, &pop_session_ops);
 
     return 0;
 }
-/**
+/** open_session creates the state of a new POP3 session and greets the client.
  *
  * Based on RFC1939
  */
-void handle_client(int fd) {
-    // Variables For The Function Block
-    char user[MAX_USERNAME_SIZE];
-    char pass[MAX_PASSWORD_SIZE];
-    mail_list_t mailList = NULL;
-    char count[10], size[20];
-    int state = 0; // Authorization = 1, Transaction = 2
-    int res; // For res = send_string error checking
+static void *open_session(int fd) {
+    struct pop_session *s = malloc(sizeof(struct pop_session));
+    s->fd = fd;
+    s->mailList = NULL;
+    s->state = 0;
+    s->cnt = 0;
+    s->user[0] = '\0';
+    s->out = ob_create(fd, MAX_OUTPUT_SIZE);
+    s->reader = NULL;
 
     // Greetings
-    struct utsname uts;
-    uname(&uts);
-    res = send_string(fd, "+OK %s POP3 server ready\r\n", uts.nodename);
-    if (res == -1)
-        return;
-    net_buffer_t buffer = nb_create(fd, MAX_LINE_LENGTH); // read buffer
-    // Command Reading and Processing
-    while (1) {
-        // Reading
-        int c = 0;
-        unsigned int cnt;
-        char line[MAX_LINE_LENGTH]; // line
-        int response = nb_read_line(buffer, line);
-        //printf("%s", line);
-        if (response == -1 || response == 0) {
-            if (response == -1){
-                send_string(fd, "-ERR connection was terminated abruptly\r\n");
-            }
-            if (response == 0)
-                send_string(fd, "+OK connection was terminated successfully\r\n");
-            if (mailList != NULL) {
-                reset_mail_list_deleted_flag(mailList);
-                destroy_mail_list(mailList);
-            }
-            line[0] = '\0'; // clearing line
-            break;
+    uname(&s->uts);
+    ob_printf(s->out, "+OK %s POP3 server ready\r\n", s->uts.nodename);
+    if (ob_flush(s->out) == -1) {
+        ob_destroy(s->out);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+/** close_session ends a POP3 session. Messages marked as deleted are only
+ *  removed if the session finished with QUIT (which already released the
+ *  mail list), otherwise their deleted flag is reset.
+ *
+ * @param session: the session being closed
+ * @param reason: SESSION_DONE, SESSION_EOF, SESSION_ERROR or SESSION_TIMEOUT
+ */
+static void close_session(void *session, int reason) {
+    struct pop_session *s = session;
+    if (reason == SESSION_ERROR)
+        ob_printf(s->out, "-ERR connection was terminated abruptly\r\n");
+    if (reason == SESSION_TIMEOUT)
+        ob_printf(s->out, "-ERR autologout timer expired, closing connection\r\n");
+    if (reason == SESSION_EOF)
+        ob_printf(s->out, "+OK connection was terminated successfully\r\n");
+    ob_flush(s->out);
+    ob_destroy(s->out);
+    if (s->reader != NULL) {
+        mz_close(s->reader);
+        close(s->message);
+    }
+    if (s->mailList != NULL) {
+        reset_mail_list_deleted_flag(s->mailList);
+        destroy_mail_list(s->mailList);
+    }
+    free(s);
+}
+/** session_timeout gives the autologout timer of a POP3 session. The
+ *  timer is restarted whenever the client sends data, and a session
+ *  that times out is closed without deleting any messages (RFC 1939).
+ *
+ * @return the timeout in seconds, or zero to wait forever
+ */
+static unsigned int session_timeout(void *session) {
+    return timeout;
+}
+/** flush_session sends the pending replies of a session, including the
+ *  rest of a compressed message, without waiting for a client that is not
+ *  reading them.
+ *
+ * @return 1 if all replies were sent, 0 if some are pending, -1 on error
+ */
+static int flush_session(void *session) {
+    struct pop_session *s = session;
+    int res;
+    while ((res = ob_flush(s->out)) == 0 && s->reader != NULL) {
+        if (send_blocks(s) == -1)
+            return -1;
+    }
+    return res == -1 ? -1 : !res;
+}
+/** handle_input processes all complete command lines available in the
+ *  buffer, without blocking for more data. Replies are only flushed once
+ *  all commands received together are processed, so that pipelined
+ *  commands (see CAPA) are answered with a single write. Commands are
+ *  left in the buffer while the client is not reading the replies.
+ *
+ * @return 0 if the session must be closed, -1 if it stopped because
+ *         replies are pending, 1 otherwise
+ */
+static int handle_input(void *session, net_buffer_t buffer) {
+    struct pop_session *s = session;
+    char line[MAX_LINE_LENGTH + 1]; // line
+    int response;
+    while ((response = nb_get_line(buffer, line)) > 0) {
+        if (!handle_line(s, line, response)) {
+            ob_flush(s->out);
+            return 0;
         }
-        else if (response > MAX_LINE_LENGTH || strlen(line) < 6 || (line[strlen(line)-2] != '\r'
-                                                                    || line[strlen(line)-1] != '\n')) {
-            res = send_string(fd, "-ERR invalid request\r\n");
-            if (res == -1) {
-                line[0] = '\0';
-                break;
-            }
-            continue;
+        if (s->reader != NULL || ob_pending(s->out)) {
+            int res = flush_session(s);
+            if (res == -1)
+                return 0;
+            if (res == 0)
+                return -1;
         }
-        char cmd[MAX_LINE_LENGTH];
-        char para[MAX_LINE_LENGTH];
-        strcpy(cmd, line);
-        if(strchr(cmd, ' ') == NULL) {
-            cmd[strlen(cmd)-2] = '\0';
-            para[0] = '\0';
+    }
+    return ob_flush(s->out) != -1;
+}
+/** pop_user handles USER, which selects the mailbox of a user.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_user(struct pop_session *s, char *para) {
+    int res;
+    if (strlen(para) < 1) {
+        res = ob_printf(s->out, "-ERR user requires a username parameter\r\n");
+    }
+    else if (is_valid_user(para, NULL) == 0) {
+        res = ob_printf(s->out, "-ERR user doesn't exist, try again\r\n");
+    }
+    else {
+        res = ob_printf(s->out, "+OK enter your password\r\n");
+        strcpy(s->user, para);
+        para[0] = '\0'; // flushing
+        s->state = 1;
+    }
+    if (res == -1)
+        return 0;
+    return 1;
+}
+/** pop_pass handles PASS, which authenticates the user and loads the mailbox.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_pass(struct pop_session *s, char *para) {
+    int res;
+    if (s->state == 0) {
+        res = ob_printf(s->out, "-ERR no valid username provided\r\n");
+    }
+    else if (strlen(para) < 1) {
+        res = ob_printf(s->out, "-ERR pass requires a password parameter\r\n");
+    }
+    else if (is_valid_user(s->user, para) == 0){
+        res = ob_printf(s->out, "-ERR password invalid, start with username again\r\n");
+        s->user[0] = '\0';// flushing username
+    }
+    else {
+        s->mailList = load_user_mail(s->user);
+        update(s->count, s->size, s->mailList);
+        s->cnt = get_mail_count(s->mailList);
+        res = ob_printf(s->out, "+OK\r\n");
+        if (res == -1) {
+            return 0;
         }
-        else {
-            // Arguments||Parameters Processing
-            if(strlen(cmd) >= 8) {
-                int idx = 0;
-                for (int i = 0; i < strlen(cmd); i++) {
-                    if(cmd[i] == ' ') {
-                        idx = i+1;
-                        break;
-                    }
+        strcpy(s->pass, para);
+        s->state++; // state = 2
+    }
+    if (res == -1) {
+        return 0;
+    }
+    return 1;
+}
+/** pop_quit handles QUIT, which ends the session and removes messages marked
+ *  as deleted.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_quit(struct pop_session *s, char *para) {
+    if (s->state == 2) {
+        destroy_mail_list(s->mailList);
+        s->mailList = NULL;
+    }
+    ob_printf(s->out, "+OK %s POP3 server signing off \r\n", s->uts.nodename);
+    return 0;
+}
+/** pop_stat handles STAT, which reports the number and total size of the messages.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_stat(struct pop_session *s, char *para) {
+    int res;
+    update(s->count, s->size, s->mailList);
+    res = ob_printf(s->out, "+OK %s %s\r\n", s->count, s->size);
+    if (res == -1) {
+        return 0;
+    }
+    return 1;
+}
+/** pop_list handles LIST, which reports the size of one or all messages.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_list(struct pop_session *s, char *para) {
+    int res;
+    update(s->count, s->size, s->mailList);
+    if (s->cnt == 0)
+        res = ob_printf(s->out, "+OK no mail in the mailbox\r\n");
+    else {
+        if (strlen(para) >= 1) {
+            unsigned int num = (unsigned int)strtol(para, (char **) NULL, 10);
+            if (num == 0)
+                res = ob_printf(s->out, "-ERR invalid argument\r\n");
+            else {
+                mail_item_t mail = get_mail_item(s->mailList, num - 1);
+                if (mail == NULL)
+                    res = ob_printf(s->out, "-ERR no such message\r\n");
+                else {
+                    res = ob_printf(s->out, "+OK %s %zu\r\n", para, get_mail_item_size(mail));
                 }
-                cmd[idx - 1] = '\0';
-                strncpy(para, line+idx, MAX_LINE_LENGTH);
-                para[strlen(para) - 2] = '\0';
             }
         }
-        c = valid_commands(cmd); // gathering info about the command
-        if (c == 0) {
-            res = send_string(fd, "-ERR invalid command\r\n");
-            if (res == -1)
-                break;
-            continue;
-        }
-        cmd[0] = '\0'; //clearing command holder
-        line[0] = '\0'; // clearing line
-        // Processing
-        if (c <= 2 && (state == 0 || state == 1)) {
-
-            // Only in Authorization State
-
-            if (c == 1) { // USER
-                if (strlen(para) < 1) {
-                    res = send_string(fd, "-ERR user requires a username parameter\r\n");
-                }
-                else if (is_valid_user(para, NULL) == 0) {
-                    res = send_string(fd, "-ERR user doesn't exist, try again\r\n");
-                }
-                else {
-                    res = send_string(fd, "+OK enter your password\r\n");
-                    strcpy(user, para);
-                    para[0] = '\0'; // flushing
-                    state++; // state = 1
-                }
-                if (res == -1)
-                    break;
-                continue;
+        else {
+            res = ob_printf(s->out, "+OK %s messages (%s octets)\r\n", s->count, s->size);
+            if (res == -1) {
+                return 0;
             }
-            if (c == 2) { // PASS
-                if (state == 0) {
-                    res = send_string(fd, "-ERR no valid username provided\r\n");
-                }
-                else if (strlen(para) < 1) {
-                    res = send_string(fd, "-ERR pass requires a password parameter\r\n");
-                }
-                else if (is_valid_user(user, para) == 0){
-                    res = send_string(fd, "-ERR password invalid, start with username again\r\n");
-                    user[0] = '\0';// flushing username
-                }
-                else {
-                    mailList = load_user_mail(user);
-                    update(count, size, mailList);
-                    cnt = get_mail_count(mailList);
-                    res = send_string(fd, "+OK\r\n");
-                    if (res == -1) {
-                        destroy_mail_list(mailList);
-                        break;
-                    }
-                    strcpy(pass, para);
-                    state++; // state = 2
+            for (int i = 0; i < s->cnt; i++) {
+                mail_item_t mail = get_mail_item(s->mailList,(unsigned int) i);
+                if (mail != NULL) {
+                    res = ob_printf(s->out, "%d %zu\r\n", i + 1, get_mail_item_size(mail));
+                    if (res == -1)
+                        return 0;
                 }
-                if (res == -1) {
-                    break;
-                }
-                continue;
             }
+            res = ob_printf(s->out, ".\r\n");
         }
-        if (c == 3) { // QUIT
-            if (state == 2) {
-                destroy_mail_list(mailList);
+    }
+    if (res == -1) {
+        return 0;
+    }
+    return 1;
+}
+/** pop_retr handles RETR, which sends a message.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_retr(struct pop_session *s, char *para) {
+    int res;
+    update(s->count, s->size, s->mailList);
+    if (strlen(para) >= 1) {
+        unsigned int num = (unsigned int)strtol(para, (char **) NULL, 10);
+        if (num == 0)
+            res = ob_printf(s->out, "-ERR invalid argument\r\n");
+        else {
+            mail_item_t mail = get_mail_item(s->mailList, num - 1);
+            if (mail == NULL)
+                res = ob_printf(s->out, "-ERR no such message\r\n");
+            else {
+                size_t size = get_mail_item_size(mail);
+                char status[32];
+                snprintf(status, sizeof(status), "+OK %zu octets", size);
+                res = send_message(s, mail, size, status);
             }
-            send_string(fd, "+OK %s POP3 server signing off \r\n", uts.nodename);
-            break;
         }
-        if (state == 2 && c >= 4) {
-
-            // Only in Transaction State
-
-            if (c == 4) { // STAT
-                update(count, size, mailList);
-                res = send_string(fd, "+OK %s %s\r\n", count, size);
-                if (res == -1) {
-                    destroy_mail_list(mailList);
-                    break;
-                }
-                continue;
+    } else
+        res = ob_printf(s->out, "-ERR no argument provided\r\n");
+    if (res == -1) {
+        return 0;
+    }
+    return 1;
+}
+/** pop_dele handles DELE, which marks a message as deleted.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_dele(struct pop_session *s, char *para) {
+    int res;
+    if (strlen (para) >= 1) {
+        unsigned int num = (unsigned int)strtol(para, (char **) NULL, 10);
+        if (num == 0)
+            res = ob_printf(s->out, "-ERR invalid argument\r\n");
+        else if (num > s->cnt)
+            res = ob_printf(s->out, "-ERR no such message, only %s messages in the mailbox\r\n", s->count);
+        else {
+            mail_item_t mail = get_mail_item(s->mailList, num - 1);
+            if(mail == NULL) {
+                res = ob_printf(s->out, "-ERR %s already deleted\r\n", para);
             }
-            if (c == 5) { // LIST
-                update(count, size, mailList);
-                if (cnt == 0)
-                    res = send_string(fd, "+OK no mail in the mailbox\r\n");
-                else {
-                    if (strlen(para) >= 1) {
-                        unsigned int num = (unsigned int)strtol(para, (char **) NULL, 10);
-                        if (num == 0)
-                            res = send_string(fd, "-ERR invalid argument\r\n");
-                        else {
-                            mail_item_t mail = get_mail_item(mailList, num - 1);
-                            if (mail == NULL)
-                                res = send_string(fd, "-ERR no such message\r\n");
-                            else {
-                                char mailSize[10] = "";
-                                sprintf(mailSize, "%zu", get_mail_item_size(mail));
-                                res = send_string(fd, "+OK %s %s\r\n", para, mailSize);
-                            }
-                        }
-                    }
-                    else {
-                        res = send_string(fd, "+OK %s messages (%s octets)\r\n", count, size);
-                        if (res == -1) {
-                            destroy_mail_list(mailList);
-                            break;
-                        }
-                        for (int i = 0; i < cnt; i++) {
-                            mail_item_t mail = get_mail_item(mailList,(unsigned int) i);
-                            if (mail != NULL) {
-                                char item[10] = "";
-                                char mailSize[10] = "";
-                                sprintf(item, "%u", i+1);
-                                sprintf(mailSize, "%zu", get_mail_item_size(mail));
-                                res = send_string(fd, "%s %s\r\n", item, mailSize);
-                                if (res == -1) {
-                                    destroy_mail_list(mailList);
-                                    nb_destroy(buffer);
-                                    return;
-                                }
-                            }
-                        }
-                        res = send_string(fd, ".\r\n");
-                    }
-                }
-                if (res == -1) {
-                    destroy_mail_list(mailList);
-                    break;
-                }
-                continue;
+            else {
+                mark_mail_item_deleted(mail);
+                res = ob_printf(s->out, "+OK message %s deleted\r\n", para);
             }
-            if (c == 6) { // RETR
-                update(count, size, mailList);
-                if (strlen(para) >= 1) {
-                    unsigned int num = (unsigned int)strtol(para, (char **) NULL, 10);
-                    if (num == 0)
-                        res = send_string(fd, "-ERR invalid argument\r\n");
-                    else {
-                        mail_item_t mail = get_mail_item(mailList, num - 1);
-                        if (mail == NULL)
-                            res = send_string(fd, "-ERR no such message\r\n");
-                        else {
-                            char mailSize[10] = "";
-                            sprintf(mailSize, "%zu", get_mail_item_size(mail));
-                            res = send_string(fd, "+OK %s octets\r\n", mailSize);
-                            if (res == -1) {
-                                destroy_mail_list(mailList);
-                                break;
-                            }
-                            char fileName[FILENAME_MAX];
-                            strcpy(fileName, get_mail_item_filename(mail));
-                            char data[MAX_LINE_LENGTH];
-                            FILE* email = fopen(fileName, "r"); // Read-Only
-                            if (email == NULL) {
-                                res =send_string(fd, "-ERR message doesn't exist\r\n");
-                                if (res == -1)
-                                    break;
-                                continue;
-                            }
-                            int err; // for error checking
+        }
+    } else
+        res = ob_printf(s->out, "-ERR no argument provided\r\n");
+    if (res == -1) {
+        return 0;
+    }
+    return 1;
+}
+/** pop_noop handles NOOP, which does nothing.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_noop(struct pop_session *s, char *para) {
+    int res;
+    res = ob_printf(s->out, "+OK\r\n");
+    if (res == -1) {
+        return 0;
+    }
+    return 1;
+}
+/** pop_rset handles RSET, which unmarks all messages marked as deleted.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_rset(struct pop_session *s, char *para) {
+    int res;
+    reset_mail_list_deleted_flag(s->mailList);
+    update(s->count, s->size, s->mailList);
+    res = ob_printf(s->out, "+OK %s's mailbox has %s messages (%s octets)\r\n", s->user, s->count, s->size);
+    if (res == -1) {
+        return 0;
+    }
+    return 1;
+}
+/** pop_top handles TOP, which sends the headers and the first body lines of a message.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_top(struct pop_session *s, char *para) {
+    int res;
+    update(s->count, s->size, s->mailList);
+    char *rest, *end;
+    long num = strtol(para, &rest, 10);
+    long lines = strtol(rest, &end, 10);
+    // Asking for more lines than any message has sends the whole body
+    if (lines > UINT_MAX)
+        lines = UINT_MAX;
+    if (num <= 0 || num > UINT_MAX || lines < 0 || end == rest || *end != '\0')
+        res = ob_printf(s->out, "-ERR invalid argument\r\n");
+    else {
+        mail_item_t mail = get_mail_item(s->mailList, num - 1);
+        if (mail == NULL)
+            res = ob_printf(s->out, "-ERR no such message\r\n");
+        else {
+            // The headers and the first lines are found from the
+            // boundaries recorded at delivery
+            res = send_message(s, mail, get_mail_item_top_size(mail, lines), "+OK");
+        }
+    }
+    if (res == -1) {
+        return 0;
+    }
+    return 1;
+}
+/** pop_uidl handles UIDL, which reports the unique ID of one or all messages.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_uidl(struct pop_session *s, char *para) {
+    int res;
+    update(s->count, s->size, s->mailList);
+    if (strlen(para) >= 1) {
+        unsigned int num = (unsigned int)strtol(para, (char **) NULL, 10);
+        mail_item_t mail = num == 0 ? NULL : get_mail_item(s->mailList, num - 1);
+        if (num == 0)
+            res = ob_printf(s->out, "-ERR invalid argument\r\n");
+        else if (mail == NULL)
+            res = ob_printf(s->out, "-ERR no such message\r\n");
+        else
+            res = ob_printf(s->out, "+OK %u %s\r\n", num, get_mail_item_uid(mail));
+    }
+    else {
+        res = ob_printf(s->out, "+OK\r\n");
+        for (int i = 0; res != -1 && i < s->cnt; i++) {
+            mail_item_t mail = get_mail_item(s->mailList, (unsigned int) i);
+            if (mail != NULL)
+                res = ob_printf(s->out, "%d %s\r\n", i + 1, get_mail_item_uid(mail));
+        }
+        if (res != -1)
+            res = ob_printf(s->out, ".\r\n");
+    }
+    if (res == -1) {
+        return 0;
+    }
+    return 1;
+}
+/** pop_capa handles CAPA, which lists the capabilities of the server.
+ *
+ * @param s: the current session
+ * @param para: arguments of the command, without the line terminator
+ * @return 0 if the session must be closed, 1 otherwise
+ */
+static int pop_capa(struct pop_session *s, char *para) {
+    int res;
+    res = ob_printf(s->out, "+OK capability list follows\r\n"
+                    "USER\r\nTOP\r\nUIDL\r\nPIPELINING\r\n.\r\n");
+    if (res == -1) {
+        return 0;
+    }
+    return 1;
+}
+// Commands accepted in each state (see handle_line)
+static const struct pop_command {
+    uint32_t verb;
+    int (*handler)(struct pop_session *s, char *para);
+    unsigned int states; // states in which the command is accepted
+} pop_commands[] = {
+    { PROTO_VERB('u', 's', 'e', 'r'), pop_user, AUTHORIZATION_STATES },
+    { PROTO_VERB('p', 'a', 's', 's'), pop_pass, AUTHORIZATION_STATES },
+    { PROTO_VERB('q', 'u', 'i', 't'), pop_quit, ANY_STATE },
+    { PROTO_VERB('s', 't', 'a', 't'), pop_stat, TRANSACTION_STATES },
+    { PROTO_VERB('l', 'i', 's', 't'), pop_list, TRANSACTION_STATES },
+    { PROTO_VERB('r', 'e', 't', 'r'), pop_retr, TRANSACTION_STATES },
+    { PROTO_VERB('d', 'e', 'l', 'e'), pop_dele, TRANSACTION_STATES },
+    { PROTO_VERB('n', 'o', 'o', 'p'), pop_noop, TRANSACTION_STATES },
+    { PROTO_VERB('r', 's', 'e', 't'), pop_rset, TRANSACTION_STATES },
+    { PROTO_VERB('t', 'o', 'p', ' '), pop_top,  TRANSACTION_STATES },
+    { PROTO_VERB('u', 'i', 'd', 'l'), pop_uidl, TRANSACTION_STATES },
+    { PROTO_VERB('c', 'a', 'p', 'a'), pop_capa, ANY_STATE },
+};
 
-                            err = fseek(email, 0, SEEK_SET);
-                            if (err != 0) {
-                                res = send_string(fd, "-ERR message is corrupted\r\n");
-                                if (res == -1)
-                                    break;
-                                continue;
-                            }
+#define COMMAND_COUNT (sizeof(pop_commands) / sizeof(pop_commands[0]))
 
-                            while (fgets(data, MAX_LINE_LENGTH, email) != NULL) {
-                                res = send_string(fd, "%s", data);
-                                if (res == -1) {
-                                    nb_destroy(buffer);
-                                    return;
-                                }
-                            }
-                            if (ferror(email)) {
-                                clearerr(email);
-                                res = send_string(fd, "-ERR message is corrupted\r\n");
-                                if (res == -1){
-                                    break;
-                                }
-                            }
-                            res = send_string(fd,".\r\n");
-                            err = fclose(email);
-                            if (err == EOF) {
-                                res = send_string(fd, "-ERR message can't be closed\r\n");
-                                if (res == -1)
-                                    break;
-                                continue;
-                            }
-                        }
-                    }
-                } else
-                    res = send_string(fd,"-ERR no argument provided\r\n");
-                if (res == -1) {
-                    destroy_mail_list(mailList);
-                    break;
-                }
-                continue;
-            }
-            if (c == 7) { // DELE
-                if (strlen (para) >= 1) {
-                    unsigned int num = (unsigned int)strtol(para, (char **) NULL, 10);
-                    if (num == 0)
-                        res = send_string(fd, "-ERR invalid argument\r\n");
-                    else if (num > cnt)
-                        res = send_string(fd,"-ERR no such message, only %s messages in the mailbox\r\n", count);
-                    else {
-                        mail_item_t mail = get_mail_item(mailList, num - 1);
-                        if(mail == NULL) {
-                            res = send_string(fd, "-ERR %s already deleted\r\n", para);
-                        }
-                        else {
-                            mark_mail_item_deleted(mail);
-                            res = send_string(fd,"+OK message %s deleted\r\n", para);
-                        }
-                    }
-                } else
-                    res = send_string(fd, "-ERR no argument provided\r\n");
-                if (res == -1) {
-                    destroy_mail_list(mailList);
-                    break;
-                }
-                continue;
-            }
-            if (c == 8) { // NOOP
-                res = send_string(fd, "+OK\r\n");
-                if (res == -1) {
-                    destroy_mail_list(mailList);
-                    break;
-                }
-                continue;
-            }
-            if (c == 9) { // RSET
-                reset_mail_list_deleted_flag(mailList);
-                update(count, size, mailList);
-                res = send_string(fd, "+OK %s's mailbox has %s messages (%s octets)\r\n", user, count, size);
-                if (res == -1) {
-                    destroy_mail_list(mailList);
-                    break;
-                }
-                continue;
-            }
-        } else {
-            res = send_string(fd, "-ERR you must be authenticated\r\n");
-            if (res == -1) {
-                break;
-            }
-            continue;
-        }
+// Latency histogram of each command in pop_commands
+static int command_metrics[COMMAND_COUNT];
+
+/** define_metrics defines the latency histogram of each POP3 command,
+ *  recorded in addition to the metrics of the server itself (see
+ *  metrics.h).
+ */
+static void define_metrics(void) {
+    static char labels[COMMAND_COUNT][16];
+    char verb[5];
+    for (int i = 0; i < COMMAND_COUNT; i++) {
+        proto_verb_name(pop_commands[i].verb, verb);
+        snprintf(labels[i], sizeof(labels[i]), "verb=\"%s\"", verb);
+        command_metrics[i] = mt_define(MT_HISTOGRAM, "pop3_command_duration_seconds", labels[i],
+                                       "Time spent running POP3 commands.");
     }
-    nb_destroy(buffer); // flushing the buffer
 }
-/** valid_commands compares the command in the command line and return an
- *  an integer result according to the spec mentioned below.
+/** handle_line processes a single command line received from the client.
+ *  The command is found in pop_commands from its verb, and dispatched to
+ *  its handler if it is accepted in the current state. The arguments are
+ *  left in place in the line.
  *
- * @param line: the string from the buffer
- * @return 1 if command is USER, 2 if PASS, 3 if QUIT, 4 if STAT, 5 if LIST,
- *         6 if RETR, 7 if DELE, 8 if NOOP, 9 if RSET and 0 otherwise marking
- *         the command invalid.
+ * @param s: the current session
+ * @param line: null-terminated line, including the line terminator
+ * @param response: number of bytes in the line
+ * @return 0 if the session must be closed, 1 otherwise
  */
-int valid_commands(char line[]) {
-    if (strcasecmp(line, "USER") == 0)
+static int handle_line(struct pop_session *s, char line[], int response) {
+    int res; // For res = ob_printf error checking
+    size_t length = strlen(line);
+    char *para;
+    // Clients exceeding their command rate are disconnected
+    if (!server_admit_command(s->fd)) {
+        ob_printf(s->out, "-ERR too many commands, closing connection\r\n");
+        return 0;
+    }
+    if (response > MAX_LINE_LENGTH || length < 6 || (line[length-2] != '\r'
+                                                     || line[length-1] != '\n')) {
+        res = ob_printf(s->out, "-ERR invalid request\r\n");
+        if (res == -1)
+            return 0;
         return 1;
-    else if (strcasecmp(line, "PASS") == 0)
-        return 2;
-    else if (strcasecmp(line, "QUIT") == 0)
-        return 3;
-    else if (strcasecmp(line, "STAT") == 0)
-        return 4;
-    else if (strcasecmp(line, "LIST") == 0)
-        return 5;
-    else if (strcasecmp(line, "RETR") == 0)
-        return 6;
-    else if (strcasecmp(line, "DELE") == 0)
-        return 7;
-    else if (strcasecmp(line, "NOOP") == 0)
-        return 8;
-    else if (strcasecmp(line, "RSET") == 0)
-        return 9;
+    }
+    const struct pop_command *command = proto_find(proto_verb(line, length, &para), pop_commands,
+                                                   sizeof(pop_commands) / sizeof(pop_commands[0]),
+                                                   sizeof(pop_commands[0]));
+    if (command == NULL) {
+        res = ob_printf(s->out, "-ERR invalid command\r\n");
+    }
+    else if (!(command->states & STATE_BIT(s->state))) {
+        if (s->state == 2)
+            res = ob_printf(s->out, "-ERR already authenticated\r\n");
+        else
+            res = ob_printf(s->out, "-ERR you must be authenticated\r\n");
+    }
     else {
+        // Arguments follow the verb and a space, up to the line terminator
+        line[length - 2] = '\0';
+        if (*para == ' ')
+            para++;
+        uint64_t start = mt_now();
+        int rv = command->handler(s, para);
+        mt_observe(command_metrics[command - pop_commands], mt_now() - start);
+        return rv;
+    }
+    if (res == -1)
         return 0;
+    return 1;
+}
+/** send_message sends a status line and the start of a message, followed
+ *  by the terminating line of a multi-line reply. Messages are stored in their on-the-wire
+ *  form (CRLF line endings, dot-stuffed), so the file is queued as is, to
+ *  be sent with sendfile; messages recorded as compressed at delivery are
+ *  decompressed one block at a time as they are sent (see send_blocks).
+ *
+ * @param s: the current session
+ * @param mail: the message to be sent
+ * @param length: number of bytes of the message to be sent
+ * @param status: positive status line, sent if the message can be opened
+ * @return -1 if the reply could not be sent, a non-negative value otherwise
+ */
+static int send_message(struct pop_session *s, mail_item_t mail, size_t length, const char *status) {
+    off_t offset;
+    int res;
+    int email = open_mail_item(mail, &offset);
+    if (email == -1)
+        return ob_printf(s->out, "-ERR message doesn't exist\r\n");
+    if (ob_printf(s->out, "%s\r\n", status) == -1) {
+        close(email);
+        return -1;
+    }
+    if (is_mail_item_compressed(mail)) {
+        s->reader = mz_open(email, offset);
+        if (s->reader == NULL) {
+            close(email);
+            return -1;
+        }
+        s->message = email;
+        s->remaining = length;
+        return send_blocks(s);
     }
+    res = ob_sendfile(s->out, email, offset, length);
+    close(email);
+    if (res != -1)
+        res = ob_printf(s->out, ".\r\n");
+    return res;
+}
+/** send_blocks adds the blocks of the compressed message being sent to the
+ *  replies, followed by the terminating line once the message is complete.
+ *  It stops early if the client is not reading the replies, leaving the
+ *  rest of the message to flush_session.
+ *
+ * @param s: the current session
+ * @return -1 if the message could not be sent, a non-negative value otherwise
+ */
+static int send_blocks(struct pop_session *s) {
+    const char *data;
+    ssize_t n = 1;
+    while (s->remaining > 0 && !ob_pending(s->out)) {
+        n = mz_read(s->reader, &data);
+        if (n <= 0)
+            break;
+        if ((size_t) n > s->remaining)
+            n = s->remaining;
+        if (ob_write(s->out, data, n) == -1) {
+            n = -1;
+            break;
+        }
+        s->remaining -= n;
+    }
+    if (n > 0 && s->remaining > 0)
+        return 0;
+    mz_close(s->reader);
+    close(s->message);
+    s->reader = NULL;
+    if (n < 0)
+        return -1;
+    return ob_printf(s->out, ".\r\n");
 }
 /** update updates the count and size for the complete list of the mails for
  *  the user which have not been marked for deletion
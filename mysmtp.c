@@ -1,14 +1,34 @@
 #include "netbuffer.h"
+#include "datascan.h"
+#include "outbuffer.h"
 #include "mailuser.h"
 #include "server.h"
+#include "spool.h"
+#include "groupcommit.h"
+#include "protocol.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/utsname.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 
 #define MAX_BUFFER_SIZE 1024
+#define MAX_OUTPUT_SIZE 65536
+#define DEFAULT_MAX_MESSAGE_SIZE (10 * 1024 * 1024)
+
+#define DEFAULT_SYNC_BATCH 64
+
+// Server timeouts from RFC 5321 (section 4.5.3.2), in seconds
+#define DEFAULT_COMMAND_TIMEOUT (5 * 60)
+#define DEFAULT_DATA_TIMEOUT (3 * 60)   // for each block of message data
+
+#define SMTP_USAGE SERVER_USAGE " [-s max_size] [-d spool_dir] [-p normal|dontneed|direct]" \
+  " [-y window_usec] [-n batch] [-m files|segments|blobs] [-z]" \
+  " [-t command_timeout] [-T data_timeout]"
 
 // Define current session state codes
 #define INITIAL_STATE 0
@@ -16,6 +36,14 @@
 #define MAIL_STATE 2
 #define RECIPIENT_STATE 3
 #define DATA_STATE 4
+#define BDAT_STATE 5   // transaction started with BDAT, waiting for the next chunk
+#define CHUNK_STATE 6  // receiving the contents of a BDAT chunk
+#define DISCARD_STATE 7 // skipping the contents of a rejected BDAT chunk
+
+// Session states, as bits for smtp_commands
+#define STATE_BIT(state) (1U << (state))
+#define COMMAND_STATES (STATE_BIT(GREETING_STATE) | STATE_BIT(MAIL_STATE) | \
+                        STATE_BIT(RECIPIENT_STATE) | STATE_BIT(BDAT_STATE))
 
 #define RESPONSE_OK "250 OK\r\n"
 #define RESPONSE_BAD_SEQUENCE "503 Bad sequence of commands\r\n"
@@ -27,52 +55,181 @@
 #define RESPONSE_MAILBOX_NOT_FOUND "550 mail box not found\r\n"
 #define RESPONSE_START_MAIL "354 OK Start mail input\r\n"
 #define RESPONSE_SERVICE_UNAVAILABLE "421 Service not available, closing channel\r\n"
+#define RESPONSE_TIMEOUT "421 Timeout exceeded, closing channel\r\n"
+#define RESPONSE_TOO_MANY_CONNECTIONS "421 Too many connections, try again later\r\n"
+#define RESPONSE_TOO_MANY_COMMANDS "421 Too many commands, closing channel\r\n"
 #define RESPONSE_LOCAL_ERROR "451 Requested action aborted due to local error\r\n"
+#define RESPONSE_SIZE_EXCEEDED "552 Message size exceeds fixed maximum message size\r\n"
+
+struct smtp_session {
+  int client_fd;
+  int session_state;
+  spool_file_t spool_file;
+  int end_with_crlf;
+  int end_with_cr;
+  int recipients;
+  size_t chunk_remaining;
+  int chunk_last;
+  int resume_state;           // state after a rejected chunk is skipped
+  const char *discard_reply;  // reply to a rejected chunk
+  size_t size_remaining;  // bytes that may still be added to the message
+  int size_exceeded;
+  char reverse_path[MAX_BUFFER_SIZE];
+  user_list_t user_list;
+  uint64_t commit_ticket;     // delivery waiting for its sync, or 0
+  uint64_t commit_start;      // time that sync was requested
+  user_list_t commit_users;   // recipients of that delivery
+  out_buffer_t out;
+  struct utsname sys_info;
+};
+
+// Message data being written to the spool file while processing input
+struct spool_batch {
+  spool_file_t file;
+  int error;
+  size_t remaining;  // bytes that may still be written to the file
+  int discard;       // set once the limit is exceeded
+};
+
+static void *open_session(int client_fd);
+static int process_input(void *session, net_buffer_t net_buffer);
+static void close_session(void *session, int reason);
+static int flush_output(void *session);
+static unsigned int session_timeout(void *session);
+static void define_metrics(void);
+static int finish_delivery(struct smtp_session *session);
+
+// Maximum size of a message, in bytes, as stored
+static size_t max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
+
+// Time the server waits for the next command, or for message data
+static unsigned int command_timeout = DEFAULT_COMMAND_TIMEOUT;
+static unsigned int data_timeout = DEFAULT_DATA_TIMEOUT;
+
+// Latency of each phase of a delivery (see deliver_message)
+static int spool_write_metric, link_metric, sync_metric;
 
-static void process_client(int client_fd);
+static const struct session_ops smtp_session_ops = {
+  .max_line = MAX_BUFFER_SIZE,
+  .open     = open_session,
+  .input    = process_input,
+  .close    = close_session,
+  .flush    = flush_output,
+  .timeout  = session_timeout,
+  .refusal  = RESPONSE_TOO_MANY_CONNECTIONS,
+};
 
 int main(int argc, char *argv[]) {
   
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-    return 1;
+  struct server_config config;
+  int opt;
+  char *end;
+  const char *spool_directory = ".";
+  long sync_window = -1;
+  int sync_batch = DEFAULT_SYNC_BATCH;
+  
+  server_config_init(&config);
+  while ((opt = getopt(argc, argv, SERVER_OPTIONS "s:d:p:y:n:m:zt:T:")) != -1) {
+    if (opt == 'd') {
+      spool_directory = optarg;
+    } else if (opt == 'p') {
+      // How spool files use the page cache
+      if (!strcmp(optarg, "normal")) {
+        sp_set_cache_mode(SP_CACHE_NORMAL);
+      } else if (!strcmp(optarg, "dontneed")) {
+        sp_set_cache_mode(SP_CACHE_DONTNEED);
+      } else if (!strcmp(optarg, "direct")) {
+        sp_set_cache_mode(SP_CACHE_DIRECT);
+      } else {
+        fprintf(stderr, "Invalid cache policy: %s\n", optarg);
+        return 1;
+      }
+    } else if (opt == 'm') {
+      // How delivered messages are stored
+      if (!strcmp(optarg, "files")) {
+        set_mail_store(MAIL_STORE_FILES);
+      } else if (!strcmp(optarg, "segments")) {
+        set_mail_store(MAIL_STORE_SEGMENTS);
+      } else if (!strcmp(optarg, "blobs")) {
+        set_mail_store(MAIL_STORE_BLOBS);
+      } else {
+        fprintf(stderr, "Invalid mail store: %s\n", optarg);
+        return 1;
+      }
+    } else if (opt == 'z') {
+      // Compress messages in the mail store
+      set_mail_compression(1);
+    } else if (opt == 'y') {
+      // Durable delivery, syncing in batches within this window
+      sync_window = strtol(optarg, &end, 10);
+      if (*end || sync_window < 0) {
+        fprintf(stderr, "Invalid sync window: %s\n", optarg);
+        return 1;
+      }
+    } else if (opt == 'n') {
+      sync_batch = strtol(optarg, &end, 10);
+      if (*end || sync_batch <= 0) {
+        fprintf(stderr, "Invalid sync batch size: %s\n", optarg);
+        return 1;
+      }
+    } else if (opt == 't' || opt == 'T') {
+      // Timeouts in seconds, zero waits forever
+      unsigned long timeout = strtoul(optarg, &end, 10);
+      if (*end || !*optarg || timeout > UINT_MAX) {
+        fprintf(stderr, "Invalid timeout: %s\n", optarg);
+        return 1;
+      }
+      if (opt == 't')
+        command_timeout = timeout;
+      else
+        data_timeout = timeout;
+    } else if (opt == 's') {
+      max_message_size = strtoul(optarg, &end, 10);
+      if (*end || !max_message_size) {
+        fprintf(stderr, "Invalid maximum message size: %s\n", optarg);
+        return 1;
+      }
+    } else if (server_config_option(&config, opt, optarg) <= 0) {
+      fprintf(stderr, "Usage: %s " SMTP_USAGE " <port>\n", argv[0]);
+      return 1;
+    }
   }
   
-  run_server(argv[1], process_client);
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: %s " SMTP_USAGE " <port>\n", argv[0]);
+    return 1;
+  }
   
-  return 0;
-}
-
-/**
- * Validates and replies to commands based on their correctness and support.
- *
- * @param client_fd socket file descriptor
- * @param command command string to validate
- *
- * @return non-negative value if command is valid, -1 otherwise  
- */
-int validateCommandAndRespond(int client_fd, char *command) {
-  if (!strncasecmp(command, "HELO ", 5) || !strncasecmp(command, "MAIL FROM:", 10) ||
-      !strncasecmp(command, "RCPT TO:", 8) || !strncasecmp(command, "DATA\r\n", 6)) {
-    return send_string(client_fd, RESPONSE_BAD_SEQUENCE);
+  // Spool files are linked into mailboxes, which only works within a
+  // single file system
+  if (check_mail_spool_directory(spool_directory) < 0) {
+    perror(spool_directory);
+    return 1;
   }
-
-  if (!strncasecmp(command, "EHLO ", 5) || !strncasecmp(command, "RSET\r\n", 6) ||
-      !strncasecmp(command, "VRFY ", 5) || !strncasecmp(command, "EXPN ", 5) ||
-      !strncasecmp(command, "HELP ", 5) || !strncasecmp(command, "HELP\r\n", 6)) {
-    return send_string(client_fd, RESPONSE_NOT_IMPLEMENTED);
+  sp_set_directory(spool_directory);
+  if (sync_window >= 0 && gc_init(spool_directory, sync_window, sync_batch) < 0) {
+    perror(spool_directory);
+    return 1;
   }
-
-  return send_string(client_fd, RESPONSE_SYNTAX_ERROR); 
+  
+  define_metrics();
+  run_server(argv[optind], &config, &smtp_session_ops);
+  
+  return 0;
 }
 
-// Releases resources created in process_client
-void cleanup_resources(net_buffer_t *buffer, user_list_t *users, int temp_fd) {
-  destroy_user_list(*users);
-  nb_destroy(*buffer);
-  if (temp_fd > 0) {
-    close(temp_fd);
-  }
+// Releases resources created in open_session. A message still waiting
+// for its sync was never acknowledged, so it is removed, as if the
+// sync had failed.
+void cleanup_resources(struct smtp_session *session) {
+  destroy_user_list(session->user_list);
+  if (session->commit_ticket)
+    remove_user_mail(session->commit_users);
+  destroy_user_list(session->commit_users);
+  ob_destroy(session->out);
+  if (session->spool_file)
+    sp_destroy(session->spool_file);
+  free(session);
 }
 
 /**
@@ -90,9 +247,9 @@ int is_valid_domain(char *domain) {
   if (domain[0] == '.' || domain[0] == '-') return 0;
 
   for(int i = 1; i < length; i++) {
-    if (domain[i]<'0' || domain[i]>'9' // Not digit
-       && domain[i]<'a' || domain[i]>'z' 
-       && domain[i]<'A' || domain[i]>'Z' // Not letter
+    if ((domain[i]<'0' || domain[i]>'9') // Not digit
+       && (domain[i]<'a' || domain[i]>'z')
+       && (domain[i]<'A' || domain[i]>'Z') // Not letter
        && domain[i] != '.' && domain[i] != '-')
       return 0;
    
@@ -136,225 +293,943 @@ int is_valid_path(char *path) {
   return 1;
 }
 
-void process_client(int client_fd) {
+/**
+ * Creates the state of a new SMTP session and greets the client.
+ *
+ * @param client_fd socket file descriptor
+ *
+ * @return the new session, or NULL if the greeting cannot be sent
+ */
+static void *open_session(int client_fd) {
   
   int status;
-  int session_state = INITIAL_STATE;
-  int temp_file_fd = -1;
-  int end_with_crlf = 1;
-
-  char buffer[MAX_BUFFER_SIZE];
-  char reverse_path[MAX_BUFFER_SIZE];
-  char temp_file_template[] = "template-XXXXXX";
-
-  net_buffer_t net_buffer = nb_create(client_fd, MAX_BUFFER_SIZE);
-  user_list_t user_list = create_user_list();
+  struct smtp_session *session = malloc(sizeof(struct smtp_session));
   
-  struct utsname sys_info;
-  status = uname(&sys_info);
+  session->client_fd = client_fd;
+  session->session_state = INITIAL_STATE;
+  session->spool_file = NULL;
+  session->end_with_crlf = 1;
+  session->end_with_cr = 0;
+  session->recipients = 0;
+  session->chunk_remaining = 0;
+  session->chunk_last = 0;
+  session->resume_state = INITIAL_STATE;
+  session->discard_reply = NULL;
+  session->size_remaining = max_message_size;
+  session->size_exceeded = 0;
+  session->user_list = create_user_list();
+  session->commit_ticket = 0;
+  session->commit_users = NULL;
+  session->out = ob_create(client_fd, MAX_OUTPUT_SIZE);
+  
+  status = uname(&session->sys_info);
   if (status != 0) {
-    status = send_string(client_fd, "220\r\n");
-    if (status < 0) {
-      fprintf(stderr, RESPONSE_SEND_ERROR);
-      cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-      return;
-    }
+    memset(&session->sys_info, 0, sizeof(session->sys_info));
+    ob_printf(session->out, "220\r\n");
   } else {
-    status = send_string(client_fd, "220 %s Simple Mail Transfer Service Ready\r\n", 
-                sys_info.__domainname);
-    if (status < 0) {
-      fprintf(stderr, RESPONSE_SEND_ERROR);
-      cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-      return;
-    }
+    ob_printf(session->out, "220 %s Simple Mail Transfer Service Ready\r\n", 
+                session->sys_info.__domainname);
+  }
+  status = ob_flush(session->out);
+  if (status < 0) {
+    fprintf(stderr, RESPONSE_SEND_ERROR);
+    cleanup_resources(session);
+    return NULL;
   }
 
-  session_state = GREETING_STATE;
-  while ((status = nb_read_line(net_buffer, buffer)) > 0) {
-
-    if (session_state != DATA_STATE) {
-      int length = strlen(buffer);
-      if (length < 2 || buffer[length-1] != '\n' || buffer[length-2] != '\r'){
-        status = send_string(client_fd, RESPONSE_SYNTAX_ERROR);
-        if (status < 0) {
-          fprintf(stderr, RESPONSE_SEND_ERROR);
-          cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-          return;
-        }
-        continue;
-      }
+  session->session_state = GREETING_STATE;
+  return session;
+}
 
-      int tail = length - 2;
-      while (tail > 0) {
-        if (buffer[tail - 1] != ' ') break;
-        tail--;
-      }
-      buffer[tail] = '\r';
-      buffer[tail + 1] = '\n';
-      buffer[tail + 2] = 0;
-      length = tail + 2;
-    }
+/**
+ * Ends an SMTP session, releasing all of its resources.
+ *
+ * @param session session to be closed
+ * @param reason SESSION_DONE if the session ended with QUIT or an error
+ *               reply, SESSION_TIMEOUT if the client was idle for too
+ *               long, otherwise the connection was terminated
+ */
+static void close_session(void *session, int reason) {
+  struct smtp_session *smtp = session;
+  if (reason == SESSION_TIMEOUT) {
+    fprintf(stderr, "Connection timed out\n");
+    ob_printf(smtp->out, RESPONSE_TIMEOUT);
+    ob_flush(smtp->out);
+  } else if (reason != SESSION_DONE) {
+    fprintf(stderr, "Connection terminated unexpectedly\n");
+  }
+  cleanup_resources(smtp);
+}
+
+/**
+ * Sends the replies still pending in a session, without waiting for a
+ * client that is not reading them. A session waiting for the sync of
+ * a delivery stays suspended until the sync completes, and then gets
+ * the reply to the message (see finish_delivery).
+ *
+ * @param session session whose replies are sent
+ * @return 1 if all replies were sent, 0 if some are pending,
+ *         SESSION_SUSPENDED while waiting for a sync, -1 on error
+ */
+static int flush_output(void *session) {
+  struct smtp_session *smtp = session;
+  if (smtp->commit_ticket)
+    finish_delivery(smtp);
+  int status = ob_flush(smtp->out);
+  if (status < 0)
+    return -1;
+  if (status)
+    return 0;
+  return smtp->commit_ticket ? SESSION_SUSPENDED : 1;
+}
 
-    if ((!strncasecmp(buffer, "NOOP ", 5) || !strncasecmp(buffer, "NOOP\r\n", 6))
-       && session_state != DATA_STATE) {
+/**
+ * Finds how long the server waits for more input from the client:
+ * while message data is received each block must arrive within the
+ * data timeout, otherwise the next command within the command timeout.
+ *
+ * @param session current SMTP session
+ *
+ * @return the timeout in seconds, or zero to wait forever
+ */
+static unsigned int session_timeout(void *session) {
+  struct smtp_session *smtp = session;
+  if (smtp->session_state == DATA_STATE || smtp->session_state == CHUNK_STATE ||
+      smtp->session_state == DISCARD_STATE)
+    return data_timeout;
+  return command_timeout;
+}
 
-      status = send_string(client_fd, "250 OK\r\n");
-      if (status < 0) {
-        fprintf(stderr, "Cannot send string to client.\n");
-        cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-        return;
-      }
-      continue;
+/**
+ * Parses the parameters following the reverse path in a MAIL command.
+ * The only parameter supported is SIZE (RFC 1870).
+ *
+ * @param parameters text following the reverse path, including the
+ *                   line terminator
+ * @param size where the declared message size is returned, if any
+ *
+ * @return 1 if the parameters are valid, 0 if a parameter is not
+ *         supported, -1 on syntax errors
+ */
+static int parse_mail_parameters(char *parameters, unsigned long long *size) {
+  
+  while (*parameters == ' ') {
+    parameters++;
+    if (!strncasecmp(parameters, "SIZE=", 5)) {
+      char *end;
+      if (!isdigit(parameters[5]))
+        return -1;
+      errno = 0;
+      *size = strtoull(parameters + 5, &end, 10);
+      if (errno || (*end != ' ' && *end != '\r'))
+        return -1;
+      parameters = end;
+    } else {
+      return 0;
     }
+  }
+  return strcmp(parameters, "\r\n") ? -1 : 1;
+}
 
-    if (!strncasecmp(buffer, "QUIT\r\n", 6) && session_state != DATA_STATE) {
-      status = send_string(client_fd, "221 OK\r\n");
-      if (status < 0) {
-        fprintf(stderr, RESPONSE_SEND_ERROR); 
+/**
+ * Creates the temporary file that will hold the body of a new message.
+ *
+ * @param session current SMTP session
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+static int start_message(struct smtp_session *session) {
+  
+  session->spool_file = sp_create();
+  if (!session->spool_file) {
+    perror("spool");
+    return -1;
+  }
+  session->end_with_crlf = 1;
+  session->end_with_cr = 0;
+  session->size_remaining = max_message_size;
+  session->size_exceeded = 0;
+  return 0;
+}
+
+/**
+ * Records the latency of a delivery phase.
+ *
+ * @param metric histogram of the phase
+ * @param start time the phase started, as returned by mt_now
+ *
+ * @return the time the phase ended, where the next phase starts
+ */
+static uint64_t record_phase(int metric, uint64_t start) {
+  uint64_t end = mt_now();
+  mt_observe(metric, end - start);
+  return end;
+}
+
+/**
+ * Delivers the message in the temporary file to all recipients, ends
+ * the mail transaction and adds the reply to the output. If the
+ * message exceeded the maximum message size it is discarded instead.
+ * In durable mode, the message is only acknowledged once it is on
+ * stable storage: engines that suspend sessions keep serving other
+ * clients meanwhile, and the session is suspended until the sync
+ * completes (see finish_delivery); in other engines, this waits for
+ * the sync (see gc_commit). If the message cannot be saved, or made
+ * durable, it is left in no mailbox, so that the client can retry
+ * without creating duplicates.
+ *
+ * @param session current SMTP session
+ *
+ * @return -1 if the reply could not be added, a non-negative value otherwise
+ */
+static int deliver_message(struct smtp_session *session) {
+  
+  const char *reply = RESPONSE_OK;
+  uint64_t start = mt_now();
+  int wakeup_fd;
+  
+  if (session->size_exceeded) {
+    reply = RESPONSE_SIZE_EXCEEDED;
+  } else if (sp_flush(session->spool_file) < 0) {
+    perror("write");
+    reply = RESPONSE_LOCAL_ERROR;
+  } else {
+    start = record_phase(spool_write_metric, start);
+    if (save_user_mail_fd(sp_fd(session->spool_file), session->user_list) < 0) {
+      perror("deliver");
+      reply = RESPONSE_LOCAL_ERROR;
+    } else {
+      start = record_phase(link_metric, start);
+      if (gc_enabled() && (wakeup_fd = server_wakeup_fd()) >= 0 &&
+          (session->commit_ticket = gc_commit_async(wakeup_fd)) != 0) {
+        session->commit_start = start;
+        session->commit_users = session->user_list;
+        session->user_list = NULL;
+        reply = NULL;
+      } else {
+        if (gc_commit() < 0) {
+          perror("sync");
+          remove_user_mail(session->user_list);
+          reply = RESPONSE_LOCAL_ERROR;
+        }
+        if (gc_enabled())
+          record_phase(sync_metric, start);
       }
-      cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-      return;
     }
+  }
+  destroy_user_list(session->user_list);
+  session->user_list = create_user_list();
+  session->recipients = 0;
+  sp_destroy(session->spool_file);
+  session->spool_file = NULL;
+  session->session_state = MAIL_STATE;
+  return reply ? ob_printf(session->out, "%s", reply) : 0;
+}
 
-    switch (session_state) {
-
-      case GREETING_STATE:
-        if (!strncasecmp(buffer, "HELO ", 5)) {
-          char domain[MAX_BUFFER_SIZE];
-          memset(domain, 0, sizeof(domain));
-          sscanf(buffer + 5, "%s\r\n", domain);
-
-          if (is_valid_domain(domain)) {
-            status = send_string(client_fd, "250 OK %s greets %s\r\n", 
-                              sys_info.__domainname, 
-                              domain);
-            session_state = MAIL_STATE;
-          } else {
-            status = send_string(client_fd, RESPONSE_SYNTAX_ERROR_PARAM);
-          }
-        } else {
-          status = validateCommandAndRespond(client_fd, buffer);
-        }
+/**
+ * Acknowledges a message delivered while the session was suspended,
+ * once its sync completes. If the sync failed, the message is removed
+ * from all mailboxes, as in deliver_message.
+ *
+ * @param session current SMTP session, waiting for a sync
+ *
+ * @return -1 if the reply could not be added, a non-negative value otherwise
+ */
+static int finish_delivery(struct smtp_session *session) {
+  
+  int result = gc_commit_result(session->commit_ticket);
+  if (!result)
+    return 0;
+  
+  record_phase(sync_metric, session->commit_start);
+  if (result < 0) {
+    perror("sync");
+    remove_user_mail(session->commit_users);
+  }
+  destroy_user_list(session->commit_users);
+  session->commit_users = NULL;
+  session->commit_ticket = 0;
+  return ob_printf(session->out, "%s", result < 0 ? RESPONSE_LOCAL_ERROR : RESPONSE_OK);
+}
 
-        if (status < 0) {
-          fprintf(stderr, RESPONSE_SEND_ERROR);
-          cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-          return;
-        }
-        break;
+/**
+ * Rejects a BDAT chunk. Its contents still follow the command, so they
+ * are skipped in DISCARD_STATE before the reply is sent (RFC 3030),
+ * instead of being taken as commands.
+ *
+ * @param session current SMTP session
+ * @param size size of the rejected chunk
+ * @param reply reply sent once the chunk is skipped
+ */
+static void discard_chunk(struct smtp_session *session, size_t size, const char *reply) {
+  session->chunk_remaining = size;
+  session->discard_reply = reply;
+  session->resume_state = session->session_state;
+  session->session_state = DISCARD_STATE;
+}
 
-      case MAIL_STATE:
-        if (!strncasecmp(buffer, "MAIL FROM:", 10)) {
-          memset(reverse_path, 0, sizeof(reverse_path));
-          sscanf(buffer + 10, "%[<@:-,.A-Za-z0-9>]%*s", reverse_path);
-          if (!is_valid_path(reverse_path) && strcmp(reverse_path, "<>")) {
-            status = send_string(client_fd, RESPONSE_SYNTAX_ERROR_PARAM);
-          } else {
-            char *token = strchr(buffer, '>');
-            if (token[1] != '\r' || token[2] != '\n') {
-              status = send_string(client_fd, RESPONSE_UNSUPPORTED_PARAM);
-            } else {
-              status = send_string(client_fd, RESPONSE_OK);
-              session_state = RECIPIENT_STATE;
-            } 
-          }
-        } else {
-          status = validateCommandAndRespond(client_fd, buffer);
-        }
+/**
+ * Parses the arguments of a BDAT command and prepares to receive its
+ * chunk of data. Once the size is known, the chunk is skipped if the
+ * command is rejected.
+ *
+ * @param session current SMTP session
+ * @param arguments command arguments ("<size> [LAST]\r\n")
+ *
+ * @return non-negative value if successful, -1 on send errors
+ */
+static int start_chunk(struct smtp_session *session, char *arguments) {
+  
+  char *end;
+  unsigned long long size;
+  
+  if (!isdigit(arguments[0]))
+    return ob_printf(session->out, RESPONSE_SYNTAX_ERROR_PARAM);
+  errno = 0;
+  size = strtoull(arguments, &end, 10);
+  if (errno || size > SIZE_MAX)
+    return ob_printf(session->out, RESPONSE_SYNTAX_ERROR_PARAM);
+  
+  if (strcmp(end, "\r\n") && strcasecmp(end, " LAST\r\n"))
+    discard_chunk(session, size, RESPONSE_SYNTAX_ERROR_PARAM);
+  else if (session->session_state != RECIPIENT_STATE && session->session_state != BDAT_STATE)
+    discard_chunk(session, size, RESPONSE_BAD_SEQUENCE);
+  else if (session->session_state == RECIPIENT_STATE && !session->recipients)
+    discard_chunk(session, size, RESPONSE_BAD_SEQUENCE);
+  else if (session->session_state != BDAT_STATE && start_message(session) < 0)
+    discard_chunk(session, size, RESPONSE_LOCAL_ERROR);
+  else {
+    session->chunk_remaining = size;
+    session->chunk_last = *end == ' ';
+    session->session_state = CHUNK_STATE;
+  }
+  return 0;
+}
 
-        if (status < 0) {
-          fprintf(stderr, RESPONSE_SEND_ERROR);
-          cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-          return;
-        }
-        break;
+/**
+ * Checks the result of adding a reply to the output buffer.
+ *
+ * @param status value returned by ob_printf
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int reply_status(int status) {
+  if (status < 0) {
+    fprintf(stderr, RESPONSE_SEND_ERROR);
+    return 0;
+  }
+  return 1;
+}
 
-      case RECIPIENT_STATE:
-      case DATA_STATE:
-        if (!strncasecmp(buffer, "RCPT TO:", 8)) {
-          char recipient_path[MAX_BUFFER_SIZE];
-          memset(recipient_path, 0, sizeof(recipient_path));
-          sscanf(buffer + 8, "%[<@:-,.A-Za-z0-9>]%*s", recipient_path);
-          if (is_valid_path(recipient_path)) {
-            char *token = strchr(buffer, '>');
-            if (token[1] != '\r' || token[2] != '\n') {
-              status = send_string(client_fd, RESPONSE_UNSUPPORTED_PARAM);
-            } else {
-              char *mailbox = extract_mailbox(recipient_path);
-              if (is_valid_user(mailbox, NULL)) {
-                add_user_to_list(&user_list, mailbox);
-                status = send_string(client_fd, RESPONSE_OK);
-                session_state = DATA_STATE;
-              } else {
-                status = send_string(client_fd, RESPONSE_MAILBOX_NOT_FOUND);
-              }
-            }
-          } else {
-            status = send_string(client_fd, RESPONSE_SYNTAX_ERROR_PARAM);
-          }
-        } else if (!strncasecmp(buffer, "DATA\r\n", 6) && session_state == DATA_STATE) {
-          strcpy(temp_file_template, "template-XXXXXX");
-          temp_file_fd = mkstemp(temp_file_template);
-          if (temp_file_fd < 0) {
-            perror("mkstemp");
-            send_string(client_fd, RESPONSE_LOCAL_ERROR); 
-            return;
-          }
-
-          status = send_string(client_fd, RESPONSE_START_MAIL);
-          session_state = DATA_STATE;
-          end_with_crlf = 1;
-        } else {
-          status = validateCommandAndRespond(client_fd, buffer);
-        }
-        
-        if (status < 0) {
-          fprintf(stderr, RESPONSE_SEND_ERROR);
-          cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-          return;
-        }
-        break;
+/**
+ * Handles NOOP, which is accepted with or without arguments.
+ *
+ * @param session current SMTP session
+ * @param line null-terminated command line, including the line terminator
+ * @param args rest of the line after the verb
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int smtp_noop(struct smtp_session *session, char *line, char *args) {
+  return reply_status(ob_printf(session->out, RESPONSE_OK));
+}
 
-      case DATA_STATE:
-        status = 0;
-        if (end_with_crlf && !strncasecmp(buffer, ".\r\n", 3)) {
-          save_user_mail(temp_file_template, user_list);
-          destroy_user_list(user_list);
-          user_list = create_user_list();
-          unlink(temp_file_template);
-          close(temp_file_fd);
-
-          session_state = MAIL_STATE;
-          status = send_string(client_fd, RESPONSE_OK); 
-        } else {
-          char *data_to_write = buffer[0] == '.' ? buffer + 1 : buffer;
-          if (write(temp_file_fd, data_to_write, strlen(data_to_write)) < 0) {
-            perror("write");
-            send_string(client_fd, RESPONSE_LOCAL_ERROR); 
-            cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-            return;
-          } else {
-            int length = strlen(buffer);
-            end_with_crlf = buffer[length - 2] == '\r' && buffer[length - 1] == '\n' ? 1 : 0;
-          }
-        }
-        
-        if (status < 0) {
-          fprintf(stderr, RESPONSE_SEND_ERROR);
-          cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-          return;
-        }
+/**
+ * Handles QUIT, which closes the session.
+ *
+ * @param session current SMTP session
+ * @param line null-terminated command line, including the line terminator
+ * @param args rest of the line after the verb
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int smtp_quit(struct smtp_session *session, char *line, char *args) {
+  if (strcmp(args, "\r\n"))
+    return reply_status(ob_printf(session->out, RESPONSE_SYNTAX_ERROR_PARAM));
+  reply_status(ob_printf(session->out, "221 OK\r\n"));
+  return 0;
+}
+
+/**
+ * Handles HELO and EHLO, which start the session. EHLO also lists the
+ * extensions supported by this server (RFC 1869).
+ *
+ * @param session current SMTP session
+ * @param line null-terminated command line, including the line terminator
+ * @param args rest of the line after the verb
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int smtp_hello(struct smtp_session *session, char *line, char *args) {
+  
+  int status;
+  int extended = toupper(line[0]) == 'E';
+  char *domain = proto_token(&args);
+  
+  if (!domain || !is_valid_domain(domain))
+    return reply_status(ob_printf(session->out, RESPONSE_SYNTAX_ERROR_PARAM));
+  
+  status = ob_printf(session->out, "250%sOK %s greets %s\r\n",
+                     extended ? "-" : " ",
+                     session->sys_info.__domainname,
+                     domain);
+  if (extended && status >= 0)
+    status = ob_printf(session->out, "250-PIPELINING\r\n"
+                       "250-SIZE %zu\r\n"
+                       "250 CHUNKING\r\n", max_message_size);
+  session->session_state = MAIL_STATE;
+  return reply_status(status);
+}
+
+/**
+ * Handles MAIL FROM, which starts a mail transaction.
+ *
+ * @param session current SMTP session
+ * @param line null-terminated command line, including the line terminator
+ * @param args rest of the line after the verb
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int smtp_mail(struct smtp_session *session, char *line, char *args) {
+  
+  if (strncasecmp(args, " FROM:", 6))
+    return reply_status(ob_printf(session->out, RESPONSE_SYNTAX_ERROR));
+  
+  memset(session->reverse_path, 0, sizeof(session->reverse_path));
+  sscanf(args + 6, "%[<@:-,.A-Za-z0-9>]%*s", session->reverse_path);
+  if (!is_valid_path(session->reverse_path) && strcmp(session->reverse_path, "<>"))
+    return reply_status(ob_printf(session->out, RESPONSE_SYNTAX_ERROR_PARAM));
+  
+  char *token = strchr(args, '>');
+  unsigned long long size = 0;
+  int rv = parse_mail_parameters(token + 1, &size);
+  if (rv < 0)
+    return reply_status(ob_printf(session->out, RESPONSE_SYNTAX_ERROR_PARAM));
+  if (rv == 0)
+    return reply_status(ob_printf(session->out, RESPONSE_UNSUPPORTED_PARAM));
+  // Rejected before any of the message is received
+  if (size > max_message_size)
+    return reply_status(ob_printf(session->out, RESPONSE_SIZE_EXCEEDED));
+  
+  session->session_state = RECIPIENT_STATE;
+  return reply_status(ob_printf(session->out, RESPONSE_OK));
+}
+
+/**
+ * Handles RCPT TO, which adds a recipient to the mail transaction.
+ *
+ * @param session current SMTP session
+ * @param line null-terminated command line, including the line terminator
+ * @param args rest of the line after the verb
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int smtp_rcpt(struct smtp_session *session, char *line, char *args) {
+  
+  char recipient_path[MAX_BUFFER_SIZE];
+  
+  if (strncasecmp(args, " TO:", 4))
+    return reply_status(ob_printf(session->out, RESPONSE_SYNTAX_ERROR));
+  
+  memset(recipient_path, 0, sizeof(recipient_path));
+  sscanf(args + 4, "%[<@:-,.A-Za-z0-9>]%*s", recipient_path);
+  if (!is_valid_path(recipient_path))
+    return reply_status(ob_printf(session->out, RESPONSE_SYNTAX_ERROR_PARAM));
+  
+  char *token = strchr(args, '>');
+  if (token[1] != '\r' || token[2] != '\n')
+    return reply_status(ob_printf(session->out, RESPONSE_UNSUPPORTED_PARAM));
+  
+  char *mailbox = extract_mailbox(recipient_path);
+  if (!is_valid_user(mailbox, NULL))
+    return reply_status(ob_printf(session->out, RESPONSE_MAILBOX_NOT_FOUND));
+  
+  add_user_to_list(&session->user_list, mailbox);
+  session->recipients++;
+  return reply_status(ob_printf(session->out, RESPONSE_OK));
+}
+
+/**
+ * Handles DATA, which starts receiving the message, terminated by a
+ * line with a single dot.
+ *
+ * @param session current SMTP session
+ * @param line null-terminated command line, including the line terminator
+ * @param args rest of the line after the verb
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int smtp_data(struct smtp_session *session, char *line, char *args) {
+  
+  if (strcmp(args, "\r\n"))
+    return reply_status(ob_printf(session->out, RESPONSE_SYNTAX_ERROR_PARAM));
+  if (!session->recipients)
+    return reply_status(ob_printf(session->out, RESPONSE_BAD_SEQUENCE));
+  
+  if (start_message(session) < 0) {
+    ob_printf(session->out, RESPONSE_LOCAL_ERROR);
+    return 0;
+  }
+  session->session_state = DATA_STATE;
+  return reply_status(ob_printf(session->out, RESPONSE_START_MAIL));
+}
+
+/**
+ * Handles BDAT, which receives a chunk of the message (RFC 3030). It
+ * is accepted in every command state, since a chunk rejected for being
+ * out of sequence must still be skipped (see start_chunk).
+ *
+ * @param session current SMTP session
+ * @param line null-terminated command line, including the line terminator
+ * @param args rest of the line after the verb
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int smtp_bdat(struct smtp_session *session, char *line, char *args) {
+  
+  if (*args != ' ')
+    return reply_status(ob_printf(session->out, RESPONSE_SYNTAX_ERROR_PARAM));
+  return reply_status(start_chunk(session, args + 1));
+}
+
+/**
+ * Handles commands that are recognized but not implemented.
+ *
+ * @param session current SMTP session
+ * @param line null-terminated command line, including the line terminator
+ * @param args rest of the line after the verb
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int smtp_not_implemented(struct smtp_session *session, char *line, char *args) {
+  return reply_status(ob_printf(session->out, RESPONSE_NOT_IMPLEMENTED));
+}
+
+// Commands accepted in each state (see process_line)
+static const struct smtp_command {
+  uint32_t verb;
+  int (*handler)(struct smtp_session *session, char *line, char *args);
+  unsigned int states;  // states in which the command is accepted
+} smtp_commands[] = {
+  { PROTO_VERB('n', 'o', 'o', 'p'), smtp_noop,  COMMAND_STATES },
+  { PROTO_VERB('q', 'u', 'i', 't'), smtp_quit,  COMMAND_STATES },
+  { PROTO_VERB('h', 'e', 'l', 'o'), smtp_hello, STATE_BIT(GREETING_STATE) },
+  { PROTO_VERB('e', 'h', 'l', 'o'), smtp_hello, STATE_BIT(GREETING_STATE) },
+  { PROTO_VERB('m', 'a', 'i', 'l'), smtp_mail,  STATE_BIT(MAIL_STATE) },
+  { PROTO_VERB('r', 'c', 'p', 't'), smtp_rcpt,  STATE_BIT(RECIPIENT_STATE) },
+  { PROTO_VERB('d', 'a', 't', 'a'), smtp_data,  STATE_BIT(RECIPIENT_STATE) },
+  { PROTO_VERB('b', 'd', 'a', 't'), smtp_bdat,  COMMAND_STATES },
+  { PROTO_VERB('r', 's', 'e', 't'), smtp_not_implemented, COMMAND_STATES },
+  { PROTO_VERB('v', 'r', 'f', 'y'), smtp_not_implemented, COMMAND_STATES },
+  { PROTO_VERB('e', 'x', 'p', 'n'), smtp_not_implemented, COMMAND_STATES },
+  { PROTO_VERB('h', 'e', 'l', 'p'), smtp_not_implemented, COMMAND_STATES },
+};
+
+#define COMMAND_COUNT (sizeof(smtp_commands) / sizeof(smtp_commands[0]))
+
+// Latency histogram of each command in smtp_commands
+static int command_metrics[COMMAND_COUNT];
+
+/**
+ * Defines the metrics recorded by the SMTP server, in addition to
+ * those of the server itself: the latency of each command and of each
+ * delivery phase (see metrics.h).
+ */
+static void define_metrics(void) {
+  
+  static char labels[COMMAND_COUNT][16];
+  char verb[5];
+  
+  for (int i = 0; i < COMMAND_COUNT; i++) {
+    proto_verb_name(smtp_commands[i].verb, verb);
+    snprintf(labels[i], sizeof(labels[i]), "verb=\"%s\"", verb);
+    command_metrics[i] = mt_define(MT_HISTOGRAM, "smtp_command_duration_seconds", labels[i],
+                                   "Time spent running SMTP commands.");
+  }
+  
+  spool_write_metric = mt_define(MT_HISTOGRAM, "smtp_delivery_phase_duration_seconds",
+                                 "phase=\"spool_write\"",
+                                 "Time spent in each phase of a delivery.");
+  link_metric = mt_define(MT_HISTOGRAM, "smtp_delivery_phase_duration_seconds",
+                          "phase=\"link\"", NULL);
+  sync_metric = mt_define(MT_HISTOGRAM, "smtp_delivery_phase_duration_seconds",
+                          "phase=\"fsync\"", NULL);
+}
+
+/**
+ * Processes a single command line received from the client. The
+ * command is found in smtp_commands from its verb, and dispatched to
+ * its handler if it is accepted in the current state; otherwise the
+ * command is out of sequence. Clients exceeding their command rate
+ * (see server_admit_command) are disconnected.
+ *
+ * @param session current SMTP session
+ * @param buffer null-terminated line, including the line terminator
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int process_line(struct smtp_session *session, char *buffer) {
+  
+  int length = strlen(buffer);
+  char *args;
+
+  if (!server_admit_command(session->client_fd)) {
+    reply_status(ob_printf(session->out, RESPONSE_TOO_MANY_COMMANDS));
+    return 0;
+  }
+
+  if (length < 2 || buffer[length-1] != '\n' || buffer[length-2] != '\r')
+    return reply_status(ob_printf(session->out, RESPONSE_SYNTAX_ERROR));
+
+  int tail = length - 2;
+  while (tail > 0) {
+    if (buffer[tail - 1] != ' ') break;
+    tail--;
+  }
+  buffer[tail] = '\r';
+  buffer[tail + 1] = '\n';
+  buffer[tail + 2] = 0;
+  length = tail + 2;
+
+  const struct smtp_command *command =
+    proto_find(proto_verb(buffer, length, &args), smtp_commands,
+               sizeof(smtp_commands) / sizeof(smtp_commands[0]), sizeof(smtp_commands[0]));
+  if (!command)
+    return reply_status(ob_printf(session->out, RESPONSE_SYNTAX_ERROR));
+  if (!(command->states & STATE_BIT(session->session_state)))
+    return reply_status(ob_printf(session->out, RESPONSE_BAD_SEQUENCE));
+  
+  uint64_t start = mt_now();
+  int rv = command->handler(session, buffer, args);
+  mt_observe(command_metrics[command - smtp_commands], mt_now() - start);
+  return rv;
+}
+
+/**
+ * Prepares a spool batch for data of the current message of a session.
+ *
+ * @param batch batch to be prepared
+ * @param session current SMTP session
+ */
+static void spool_init(struct spool_batch *batch, struct smtp_session *session) {
+  batch->file = session->spool_file;
+  batch->error = 0;
+  batch->remaining = session->size_remaining;
+  batch->discard = session->size_exceeded;
+}
+
+/**
+ * Writes data to the message file (through the spool file buffer, see
+ * sp_write). Once the message exceeds the maximum message size, data
+ * is silently dropped.
+ *
+ * @param batch batch where data is written
+ * @param data data to be written
+ * @param size number of bytes in data
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+static int spool_add(struct spool_batch *batch, const char *data, size_t size) {
+  
+  // Past the maximum message size nothing else is written
+  if (batch->discard)
+    return 0;
+  if (size > batch->remaining) {
+    batch->discard = 1;
+    return 0;
+  }
+  batch->remaining -= size;
+  
+  if (sp_write(batch->file, data, size) < 0) {
+    batch->error = 1;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Records in the session how much of the maximum message size was
+ * used by the data in a spool batch.
+ *
+ * @param batch batch of data written
+ * @param session current SMTP session
+ *
+ * @return 0 if all data was written successfully, -1 otherwise
+ */
+static int spool_finish(struct spool_batch *batch, struct smtp_session *session) {
+  session->size_remaining = batch->remaining;
+  session->size_exceeded = batch->discard;
+  return batch->error ? -1 : 0;
+}
+
+/**
+ * Processes a line of the message body received in DATA_STATE that
+ * starts with a '.', and may therefore be the end of the data. The
+ * line is handled in place in the receive buffer.
+ *
+ * @param session current SMTP session
+ * @param batch batch where message data is written
+ * @param line line data (not null-terminated), including the line terminator
+ * @param length number of bytes in the line
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int process_data_line(struct smtp_session *session, struct spool_batch *batch,
+                             char *line, int length) {
+
+  int status = 0;
+
+  if (session->end_with_crlf && length == 3 && !memcmp(line, ".\r\n", 3)) {
+    if (spool_finish(batch, session) < 0) {
+      perror("write");
+      ob_printf(session->out, RESPONSE_LOCAL_ERROR); 
+      return 0;
+    }
+    status = deliver_message(session);
+  } else {
+    // Messages are stored in their on-the-wire POP3 form, so they
+    // can be retrieved without any conversion: lines are kept
+    // dot-stuffed as received, and bare LF endings become CRLF.
+    int prev_cr = length > 1 ? line[length - 2] == '\r' : session->end_with_cr;
+    int bare_lf = line[length - 1] == '\n' && !prev_cr;
+    if (spool_add(batch, line, bare_lf ? length - 1 : length) < 0 ||
+        (bare_lf && spool_add(batch, "\r\n", 2) < 0))
+      return 1; // reported when the batch is finished
+    session->end_with_crlf = line[length - 1] == '\n';
+    session->end_with_cr = line[length - 1] == '\r';
+  }
+
+  if (status < 0) {
+    fprintf(stderr, RESPONSE_SEND_ERROR);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Processes the message body data available in the buffer in
+ * DATA_STATE. Data is scanned in blocks (see ds_scan), and everything
+ * up to the next bare LF or line starting with '.' is copied to the
+ * message file as a single block.
+ *
+ * @param session current SMTP session
+ * @param net_buffer buffer holding data received from the client
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int process_data(struct smtp_session *session, net_buffer_t net_buffer) {
+  
+  struct spool_batch batch;
+  char *data;
+  int size;
+  
+  spool_init(&batch, session);
+  
+  while (session->session_state == DATA_STATE &&
+         (size = nb_peek(net_buffer, &data)) > 0) {
+    
+    if (session->end_with_crlf && data[0] == '.') {
+      char *line;
+      int length = nb_next_line(net_buffer, &line);
+      if (!length)
+        break; // wait for the rest of the line
+      if (!process_data_line(session, &batch, line, length))
+        return 0;
+      continue;
+    }
+    
+    size_t pos = ds_scan(data, size, session->end_with_cr);
+    if (pos == size) {
+      if (spool_add(&batch, data, size) < 0)
+        break;
+      session->end_with_crlf = data[size - 1] == '\n';
+      session->end_with_cr = data[size - 1] == '\r';
+      nb_consume(net_buffer, size);
+    } else {
+      // Bare LF endings become CRLF, as in process_data_line
+      int bare_lf = pos > 0 ? data[pos - 1] != '\r' : !session->end_with_cr;
+      if (spool_add(&batch, data, bare_lf ? pos : pos + 1) < 0 ||
+          (bare_lf && spool_add(&batch, "\r\n", 2) < 0))
         break;
+      session->end_with_crlf = 1;
+      session->end_with_cr = 0;
+      nb_consume(net_buffer, pos + 1);
+    }
+  }
+  
+  if (session->session_state == DATA_STATE && spool_finish(&batch, session) < 0) {
+    perror("write");
+    ob_printf(session->out, RESPONSE_LOCAL_ERROR); 
+    return 0;
+  }
+  return 1;
+}
 
-      default:
-        fprintf(stderr, "Unexpected state\n");
-        cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-        return;
+/**
+ * Processes the contents of a BDAT chunk available in the buffer in
+ * CHUNK_STATE. The chunk is taken as is, without looking for a
+ * terminator, but since messages are stored in their on-the-wire POP3
+ * form, lines starting with '.' are dot-stuffed and bare LF endings
+ * become CRLF, using the same block scan as process_data. Once the
+ * whole chunk is received it is acknowledged, and the message is
+ * delivered if this was the last chunk.
+ *
+ * @param session current SMTP session
+ * @param net_buffer buffer holding data received from the client
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int process_chunk(struct smtp_session *session, net_buffer_t net_buffer) {
+  
+  struct spool_batch batch;
+  char *data;
+  int size;
+  
+  spool_init(&batch, session);
+  
+  while (session->chunk_remaining > 0 &&
+         (size = nb_peek(net_buffer, &data)) > 0) {
+    
+    if (size > session->chunk_remaining)
+      size = session->chunk_remaining;
+    
+    if (session->end_with_crlf && data[0] == '.') {
+      if (spool_add(&batch, ".", 1) < 0)
+        break;
+      session->end_with_crlf = 0;
+    }
+    
+    size_t pos = ds_scan(data, size, session->end_with_cr);
+    size_t used = pos == size ? size : pos + 1;
+    if (pos == size) {
+      if (spool_add(&batch, data, size) < 0)
+        break;
+      session->end_with_crlf = data[size - 1] == '\n';
+      session->end_with_cr = data[size - 1] == '\r';
+    } else {
+      int bare_lf = pos > 0 ? data[pos - 1] != '\r' : !session->end_with_cr;
+      if (spool_add(&batch, data, bare_lf ? pos : pos + 1) < 0 ||
+          (bare_lf && spool_add(&batch, "\r\n", 2) < 0))
+        break;
+      session->end_with_crlf = 1;
+      session->end_with_cr = 0;
+    }
+    nb_consume(net_buffer, used);
+    session->chunk_remaining -= used;
+  }
+  
+  // The stored message must end with a line terminator
+  if (session->chunk_remaining == 0 && session->chunk_last && !session->end_with_crlf &&
+      spool_add(&batch, session->end_with_cr ? "\n" : "\r\n", session->end_with_cr ? 1 : 2) == 0) {
+    session->end_with_crlf = 1;
+    session->end_with_cr = 0;
+  }
+  
+  if (spool_finish(&batch, session) < 0) {
+    perror("write");
+    ob_printf(session->out, RESPONSE_LOCAL_ERROR); 
+    return 0;
+  }
+  
+  // Once the message is too big, every chunk is rejected, but the
+  // transaction only ends with the last one
+  if (session->chunk_remaining == 0) {
+    int status;
+    if (session->chunk_last) {
+      status = deliver_message(session);
+    } else {
+      status = ob_printf(session->out, session->size_exceeded ?
+                         RESPONSE_SIZE_EXCEEDED : RESPONSE_OK);
+      session->session_state = BDAT_STATE;
+    }
+    if (status < 0) {
+      fprintf(stderr, RESPONSE_SEND_ERROR);
+      return 0;
     }
   }
+  return 1;
+}
 
-  fprintf(stderr, "Connection terminated unexpectedly\n");
-  cleanup_resources(&net_buffer, &user_list, temp_file_fd);
-  return;
+/**
+ * Skips the contents of a rejected BDAT chunk available in the buffer
+ * in DISCARD_STATE. Once the whole chunk is skipped, the command is
+ * answered and the session returns to the state it was in.
+ *
+ * @param session current SMTP session
+ * @param net_buffer buffer holding data received from the client
+ *
+ * @return 1 if the session continues, 0 if it must be closed
+ */
+static int process_discard(struct smtp_session *session, net_buffer_t net_buffer) {
+  
+  char *data;
+  int size;
+  
+  while (session->chunk_remaining > 0 &&
+         (size = nb_peek(net_buffer, &data)) > 0) {
+    if (size > session->chunk_remaining)
+      size = session->chunk_remaining;
+    nb_consume(net_buffer, size);
+    session->chunk_remaining -= size;
+  }
+  
+  if (session->chunk_remaining > 0)
+    return 1;
+  session->session_state = session->resume_state;
+  return reply_status(ob_printf(session->out, "%s", session->discard_reply));
 }
 
+/**
+ * Processes all complete lines available in the buffer, without
+ * blocking for more data. Since clients may pipeline commands (RFC
+ * 2920), the replies to all commands in the buffer are coalesced and
+ * only flushed once the buffer has been processed, before waiting for
+ * more input. Processing stops after a message whose reply waits for
+ * a sync, since the replies must be sent in order.
+ *
+ * @param session current SMTP session
+ * @param net_buffer buffer holding data received from the client
+ *
+ * @return 1 if the session continues, 0 if it must be closed, -1 if
+ *         it is waiting for a sync (see flush_output)
+ */
+static int process_input(void *session, net_buffer_t net_buffer) {
+  
+  struct smtp_session *smtp_session = session;
+  char buffer[MAX_BUFFER_SIZE + 1];
+  char *line;
+  int length;
+  int rv = 1;
+  
+  while (rv && !smtp_session->commit_ticket) {
+    if (smtp_session->session_state == DATA_STATE) {
+      rv = process_data(smtp_session, net_buffer);
+      // Waiting for more of the message body
+      if (rv && smtp_session->session_state == DATA_STATE)
+        break;
+    } else if (smtp_session->session_state == CHUNK_STATE) {
+      rv = process_chunk(smtp_session, net_buffer);
+      // Waiting for more of the chunk
+      if (rv && smtp_session->session_state == CHUNK_STATE)
+        break;
+    } else if (smtp_session->session_state == DISCARD_STATE) {
+      rv = process_discard(smtp_session, net_buffer);
+      // Waiting for more of the rejected chunk
+      if (rv && smtp_session->session_state == DISCARD_STATE)
+        break;
+    } else {
+      if ((length = nb_next_line(net_buffer, &line)) == 0)
+        break;
+      // Commands are parsed as null-terminated strings
+      memcpy(buffer, line, length);
+      buffer[length] = 0;
+      rv = process_line(smtp_session, buffer);
+    }
+  }
+  
+  if (ob_flush(smtp_session->out) < 0) {
+    fprintf(stderr, RESPONSE_SEND_ERROR);
+    return 0;
+  }
+  return rv && smtp_session->commit_ticket ? -1 : rv;
+}
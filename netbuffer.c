@@ -8,13 +8,23 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
+/* Data is stored in a circular buffer of max_bytes bytes, starting at
+ * position start. The buffer is followed by another max_bytes bytes,
+ * used to make a line that wraps around the end of the circular
+ * buffer contiguous, so that lines can always be returned as a single
+ * pointer into the buffer.
+ */
 struct net_buffer {
   int    fd;
   size_t max_bytes;
+  size_t start;
   size_t avail_data;
+  size_t scanned; // bytes after start known not to contain a line-feed
   // Buffer set as size zero, but since it's the last member of the
   // struct, any additional memory allocated after this struct can be
   // used as part of the buffer.
@@ -38,10 +48,12 @@ struct net_buffer {
  */
 net_buffer_t nb_create(int fd, size_t max_buffer_size) {
 
-  net_buffer_t nb = malloc(sizeof(struct net_buffer) + max_buffer_size);
+  net_buffer_t nb = malloc(sizeof(struct net_buffer) + 2 * max_buffer_size);
   nb->fd          = fd;
   nb->max_bytes   = max_buffer_size;
+  nb->start       = 0;
   nb->avail_data  = 0;
+  nb->scanned     = 0;
   return nb;
 }
 
@@ -53,6 +65,186 @@ void nb_destroy(net_buffer_t nb) {
   free(nb);
 }
 
+/** Receives more data from the socket into the free space of the
+ *  buffer, using a single call to recvmsg (the free space may be split
+ *  in two parts around the end of the circular buffer). Event-driven
+ *  servers call this function with MSG_DONTWAIT once the socket is
+ *  reported as readable, and then extract the complete lines with
+ *  nb_next_line or nb_get_line.
+ *
+ *  Parameters: nb: buffer object where socket and cache data are stored.
+ *              flags: flags passed to recvmsg (e.g., MSG_DONTWAIT).
+ *
+ *  Returns: The number of bytes received, 0 if the connection was
+ *           terminated properly, or -1 on error (including EAGAIN for
+ *           non-blocking reads). If the buffer is already full,
+ *           returns -1 with errno set to ENOBUFS.
+ */
+int nb_fill(net_buffer_t nb, int flags) {
+
+  struct iovec iov[2];
+  struct msghdr msg;
+  size_t end = (nb->start + nb->avail_data) % nb->max_bytes;
+  
+  if (nb->avail_data >= nb->max_bytes) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  iov[0].iov_base = nb->buf + end;
+  if (end < nb->start) {
+    iov[0].iov_len = nb->start - end;
+    msg.msg_iovlen = 1;
+  } else {
+    iov[0].iov_len = nb->max_bytes - end;
+    iov[1].iov_base = nb->buf;
+    iov[1].iov_len = nb->start;
+    msg.msg_iovlen = nb->start ? 2 : 1;
+  }
+  
+  int rv = recvmsg(nb->fd, &msg, flags);
+  if (rv > 0)
+    nb->avail_data += rv;
+  return rv;
+}
+
+/** Internal function that returns the length of the first line in the
+ *  buffer (including the line-feed), or 0 if there is no line-feed in
+ *  the buffer. Bytes already scanned in previous calls are skipped.
+ */
+static size_t nb_line_length(net_buffer_t nb) {
+  
+  size_t first = nb->max_bytes - nb->start; // bytes before the end of the buffer
+  size_t pos = nb->scanned;
+  char *eol;
+  
+  if (first > nb->avail_data)
+    first = nb->avail_data;
+  
+  if (pos < first) {
+    if ((eol = memchr(nb->buf + nb->start + pos, '\n', first - pos)) != NULL)
+      return eol - (nb->buf + nb->start) + 1;
+    pos = first;
+  }
+  if (pos < nb->avail_data) {
+    if ((eol = memchr(nb->buf + pos - first, '\n', nb->avail_data - pos)) != NULL)
+      return first + (eol - nb->buf) + 1;
+  }
+  
+  nb->scanned = nb->avail_data;
+  return 0;
+}
+
+/** Internal function that removes the first size bytes from the
+ *  buffer, returning a pointer to a contiguous copy of them. Data
+ *  wrapping around the end of the circular buffer is copied after its
+ *  end, so that only wrapped lines are ever copied.
+ */
+static char *nb_take(net_buffer_t nb, size_t size) {
+  
+  char *data = nb->buf + nb->start;
+  size_t first = nb->max_bytes - nb->start;
+  
+  if (size > first)
+    memcpy(nb->buf + nb->max_bytes, nb->buf, size - first);
+  
+  nb->start = (nb->start + size) % nb->max_bytes;
+  nb->avail_data -= size;
+  nb->scanned = 0;
+  // Restarting from the beginning when empty makes wrapped lines rarer
+  if (!nb->avail_data)
+    nb->start = 0;
+  return data;
+}
+
+/** Extracts a single line from the data already cached in the buffer,
+ *  without reading from the socket and without copying it. The line
+ *  is returned as a pointer into the buffer, and is NOT
+ *  null-terminated. Several lines received in a single call to
+ *  nb_fill can be extracted with successive calls to this function.
+ *
+ *  If the buffer is full and contains no line-feed, the entire buffer
+ *  is returned as a (truncated) line. It is the responsibility of the
+ *  caller to check if the last character in the line is a line-feed.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *             line: set to the start of the line, if one is available.
+ *                   The line data may be modified by the caller, and
+ *                   remains valid until the next call to nb_fill (or
+ *                   nb_read_line) on this buffer.
+ *
+ *  Returns: The number of bytes in the extracted line, or 0 if the
+ *           buffer does not yet hold a complete line.
+ */
+int nb_next_line(net_buffer_t nb, char **line) {
+
+  size_t rv = nb_line_length(nb);
+  if (!rv) {
+    if (nb->avail_data < nb->max_bytes)
+      return 0;
+    rv = nb->max_bytes;
+  }
+  
+  *line = nb_take(nb, rv);
+  return rv;
+}
+
+/** Returns the data cached in the buffer, without copying it, so that
+ *  it can be processed in blocks instead of lines. Only the part of
+ *  the data up to the end of the circular buffer is returned; once it
+ *  is consumed, the next call returns the remaining data.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *             data: set to the start of the cached data. The data
+ *                   remains valid until the next call to nb_fill (or
+ *                   nb_read_line) on this buffer.
+ *
+ *  Returns: The number of contiguous bytes available at data (zero if
+ *           the buffer is empty).
+ */
+int nb_peek(net_buffer_t nb, char **data) {
+  
+  size_t first = nb->max_bytes - nb->start;
+  *data = nb->buf + nb->start;
+  return first < nb->avail_data ? first : nb->avail_data;
+}
+
+/** Removes data from the buffer after it has been processed by the
+ *  caller (e.g., following a call to nb_peek).
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *             size: number of bytes to be removed, no more than the
+ *                   number of bytes available in the buffer.
+ */
+void nb_consume(net_buffer_t nb, size_t size) {
+  nb_take(nb, size);
+}
+
+/** Extracts a single line from the data already cached in the buffer,
+ *  without reading from the socket. The line is copied to out with a
+ *  terminating null byte, as in nb_read_line. If the buffer is full
+ *  and contains no line-feed, the entire buffer is returned as a
+ *  (truncated) line.
+ *
+ *  Parameter: nb: buffer object where socket and cache data are stored.
+ *             out: array of bytes where the line will be stored, with
+ *                  space for at least max_buffer_size bytes plus one.
+ *
+ *  Returns: The number of bytes in the extracted line, or 0 if the
+ *           buffer does not yet hold a complete line.
+ */
+int nb_get_line(net_buffer_t nb, char out[]) {
+
+  char *line;
+  int rv = nb_next_line(nb, &line);
+  if (rv)
+    memcpy(out, line, rv);
+  out[rv] = 0;
+  return rv;
+}
+
 /** Reads a single line from the socket/buffer. If the socket returns
  *  more than one line in a single call to recv, returns a single line
  *  and caches the remaining data for the next call. The returned
@@ -80,30 +272,18 @@ void nb_destroy(net_buffer_t nb) {
  */
 int nb_read_line(net_buffer_t nb, char out[]) {
 
-  char *eos;
-  int rv; 
-  while ((eos = memchr(nb->buf, '\n', nb->avail_data)) == NULL) {
-    
-    if (nb->avail_data < nb->max_bytes) {
-      rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
-      if (rv < 0)
-	return rv;
-      if (rv == 0) {
-	eos = nb->buf + nb->avail_data - 1;
-	break;
-      }
-      nb->avail_data += rv;
-    } else {
-      eos = nb->buf + nb->max_bytes - 1;
-      break;
+  int rv;
+  while ((rv = nb_get_line(nb, out)) == 0) {
+    rv = nb_fill(nb, 0);
+    if (rv < 0)
+      return rv;
+    if (rv == 0) {
+      // Connection closed: return whatever is left as a last line
+      rv = nb->avail_data;
+      memcpy(out, nb_take(nb, rv), rv);
+      out[rv] = 0;
+      return rv;
     }
   }
-  
-  rv = eos - nb->buf + 1;
-  memcpy(out, nb->buf, rv);
-  out[rv] = 0;
-  nb->avail_data -= rv;
-  if (nb->avail_data)
-    memmove(nb->buf, eos + 1, nb->avail_data);
   return rv;
 }
@@ -14,5 +14,10 @@ typedef struct net_buffer *net_buffer_t;
 net_buffer_t nb_create(int fd, size_t max_buffer_size);
 void nb_destroy(net_buffer_t nb);
 int nb_read_line(net_buffer_t nb, char out[]);
+int nb_fill(net_buffer_t nb, int flags);
+int nb_get_line(net_buffer_t nb, char out[]);
+int nb_next_line(net_buffer_t nb, char **line);
+int nb_peek(net_buffer_t nb, char **data);
+void nb_consume(net_buffer_t nb, size_t size);
 
 #endif
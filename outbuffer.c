@@ -0,0 +1,415 @@
+/* outbuffer.c
+ * Buffers replies to be sent to a socket, coalescing them into as few
+ * system calls as possible.
+ */
+
+#define _GNU_SOURCE
+
+#include "outbuffer.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+/* Fixes a problem in OSX that it does not define MSG_NOSIGNAL */
+#ifndef MSG_NOSIGNAL 
+#define MSG_NOSIGNAL 0x2000 /* don't raise SIGPIPE */
+#endif
+
+#define CHUNK_SIZE 4096
+
+// A chunk holds either data, from start to used, or a range of a file,
+// of used bytes starting at offset
+struct out_chunk {
+  size_t start;
+  size_t used;
+  int    file;   // descriptor of a file chunk, -1 for data chunks
+  off_t  offset;
+  char   data[CHUNK_SIZE];
+};
+
+struct out_buffer {
+  int    fd;
+  int    error;
+  int    blocked;
+  int    max_chunks;
+  int    slots;
+  int    current;
+  // Chunks are allocated on demand, and kept until the buffer is
+  // destroyed. Only chunks up to current have pending data, in the
+  // order they are sent. If the socket would block, chunks are added
+  // past max_chunks, until the pending data is sent.
+  struct out_chunk **chunks;
+};
+
+/** Internal function that empties a chunk, closing its file if any. */
+static void ob_reset(struct out_chunk *chunk) {
+  if (chunk->file >= 0)
+    close(chunk->file);
+  chunk->file  = -1;
+  chunk->start = 0;
+  chunk->used  = 0;
+}
+
+/** Internal function that returns the number of bytes that may still
+ *  be appended to a chunk.
+ */
+static size_t ob_space(const struct out_chunk *chunk) {
+  return chunk->file >= 0 ? 0 : CHUNK_SIZE - chunk->used;
+}
+
+/** Creates a new buffer for data to be sent to a socket. Data is
+ *  split in fixed-size chunks, which are sent together with a single
+ *  vectored send (the equivalent of writev) when the buffer is
+ *  flushed, or when all chunks are full.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              max_buffer_size: Maximum number of bytes held before
+ *                               data is sent to the socket.
+ *
+ *  Returns: An out_buffer_t object that can be used in other
+ *           functions to send buffered data.
+ */
+out_buffer_t ob_create(int fd, size_t max_buffer_size) {
+  
+  int max_chunks = max_buffer_size / CHUNK_SIZE;
+  if (max_chunks < 1)
+    max_chunks = 1;
+  
+  out_buffer_t ob = calloc(1, sizeof(struct out_buffer));
+  ob->fd         = fd;
+  ob->max_chunks = max_chunks;
+  ob->slots      = max_chunks;
+  ob->chunks     = calloc(max_chunks, sizeof(struct out_chunk *));
+  ob->chunks[0]  = malloc(sizeof(struct out_chunk));
+  ob->chunks[0]->file = -1;
+  ob_reset(ob->chunks[0]);
+  return ob;
+}
+
+/** Frees all memory used by an out_buffer_t object. Data not yet
+ *  flushed is discarded.
+ *  
+ *  Parameters: ob: buffer object to be freed.
+ */
+void ob_destroy(out_buffer_t ob) {
+  for (int i = 0; i <= ob->current; i++)
+    ob_reset(ob->chunks[i]);
+  for (int i = 0; i < ob->slots; i++)
+    free(ob->chunks[i]);
+  free(ob->chunks);
+  free(ob);
+}
+
+/** Internal function that removes the first chunk, once all of its
+ *  data was sent. The chunk is kept, empty, for later use.
+ */
+static void ob_shift(out_buffer_t ob) {
+  
+  struct out_chunk *chunk = ob->chunks[0];
+  ob_reset(chunk);
+  if (!ob->current)
+    return;
+  memmove(ob->chunks, ob->chunks + 1, ob->current * sizeof(struct out_chunk *));
+  ob->chunks[ob->current--] = chunk;
+}
+
+/** Internal function that sends the file range in the first chunk.
+ *
+ *  Returns: 0 if it was sent, 1 if the socket would block, or -1 on
+ *           error.
+ */
+static int ob_send_file(out_buffer_t ob) {
+  
+  struct out_chunk *chunk = ob->chunks[0];
+  while (chunk->used > 0) {
+    ssize_t rv = sendfile(ob->fd, chunk->file, &chunk->offset, chunk->used);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 1;
+    // Interrupted connection, or file shorter than expected
+    if (rv <= 0)
+      return -1;
+    mt_add(MT_BYTES_OUT, rv);
+    chunk->used -= rv;
+  }
+  ob_shift(ob);
+  return 0;
+}
+
+/** Internal function that sends the data chunks at the start of the
+ *  buffer, up to the first file chunk or IOV_MAX chunks, whichever
+ *  comes first, with a single call to sendmsg (more if the send is
+ *  partial).
+ *
+ *  Returns: 0 if they were sent, 1 if the socket would block, or -1
+ *           on error.
+ */
+static int ob_send_data(out_buffer_t ob) {
+  
+  struct iovec iov[IOV_MAX];
+  struct msghdr msg;
+  int iovcnt = 0;
+  
+  while (iovcnt <= ob->current && iovcnt < IOV_MAX && ob->chunks[iovcnt]->file < 0) {
+    iov[iovcnt].iov_base = ob->chunks[iovcnt]->data + ob->chunks[iovcnt]->start;
+    iov[iovcnt].iov_len  = ob->chunks[iovcnt]->used - ob->chunks[iovcnt]->start;
+    iovcnt++;
+  }
+  
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  
+  while (msg.msg_iovlen > 0) {
+    // Empty chunks, and those already sent, are dropped right away
+    if (!msg.msg_iov->iov_len) {
+      ob_shift(ob);
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+      continue;
+    }
+    ssize_t rv = sendmsg(ob->fd, &msg, MSG_NOSIGNAL);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 1;
+    if (rv <= 0)
+      return -1;
+    mt_add(MT_BYTES_OUT, rv);
+    // Skip whatever was sent, in case of a partial send
+    while (msg.msg_iovlen > 0 && rv >= msg.msg_iov->iov_len) {
+      rv -= msg.msg_iov->iov_len;
+      ob_shift(ob);
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + rv;
+      msg.msg_iov->iov_len -= rv;
+      ob->chunks[0]->start += rv;
+    }
+  }
+  return 0;
+}
+
+/** Sends all data held in the buffer to the socket, using as few
+ *  calls to sendmsg as possible, and sendfile for file ranges. Data
+ *  is sent using the MSG_NOSIGNAL flag, so that an interrupted
+ *  connection results in an error instead of a PIPE signal. If the
+ *  socket is non-blocking and would block, the data not yet sent is
+ *  kept in the buffer, to be sent by a later call once the socket is
+ *  writable.
+ *
+ *  Parameters: ob: buffer object to be flushed.
+ *
+ *  Returns: 0 if all data was sent, 1 if some data is still pending
+ *           because the socket would block, or -1 if the data could
+ *           not be sent. Once an error is found, all further calls
+ *           fail.
+ */
+int ob_flush(out_buffer_t ob) {
+  
+  int rv = 0;
+  
+  if (ob->error)
+    return -1;
+  
+  while (!rv && (ob->current > 0 || ob->chunks[0]->used > 0))
+    rv = ob->chunks[0]->file >= 0 ? ob_send_file(ob) : ob_send_data(ob);
+  
+  if (rv < 0)
+    ob->error = 1;
+  ob->blocked = rv > 0;
+  return rv;
+}
+
+/** Tells whether the last attempt to send data found the socket
+ *  unable to take more data, i.e., the client is not reading replies
+ *  as fast as they are produced. Sessions use it to stop processing
+ *  commands until the pending data is sent.
+ *
+ *  Parameters: ob: buffer object.
+ *
+ *  Returns: non-zero if data is pending on a blocked socket, zero
+ *           otherwise.
+ */
+int ob_pending(out_buffer_t ob) {
+  return ob->blocked;
+}
+
+/** Internal function that adds an empty chunk after the current one,
+ *  growing the list of chunks if needed.
+ */
+static struct out_chunk *ob_append(out_buffer_t ob) {
+  
+  if (ob->current == ob->slots - 1) {
+    ob->chunks = realloc(ob->chunks, 2 * ob->slots * sizeof(struct out_chunk *));
+    memset(ob->chunks + ob->slots, 0, ob->slots * sizeof(struct out_chunk *));
+    ob->slots *= 2;
+  }
+  
+  ob->current++;
+  if (!ob->chunks[ob->current]) {
+    ob->chunks[ob->current] = malloc(sizeof(struct out_chunk));
+    ob->chunks[ob->current]->file = -1;
+  }
+  ob_reset(ob->chunks[ob->current]);
+  return ob->chunks[ob->current];
+}
+
+/** Internal function that returns the chunk where new data should be
+ *  appended, as long as it has at least `needed` bytes available. If
+ *  the current chunk does not have enough space, moves to the next
+ *  chunk, flushing the buffer if all chunks are in use. If the socket
+ *  would block, the buffer grows past its size instead.
+ *
+ *  Returns: The chunk to be used, or NULL if the buffer could not be
+ *           flushed.
+ */
+static struct out_chunk *ob_chunk(out_buffer_t ob, size_t needed) {
+  
+  struct out_chunk *chunk = ob->chunks[ob->current];
+  if (ob_space(chunk) >= needed)
+    return chunk;
+  
+  if (ob->current >= ob->max_chunks - 1) {
+    if (ob_flush(ob) < 0)
+      return NULL;
+    chunk = ob->chunks[ob->current];
+    if (ob_space(chunk) >= needed)
+      return chunk;
+  }
+  
+  return ob_append(ob);
+}
+
+/** Appends a range of a file to the output buffer, to be sent with
+ *  sendfile after the data already in the buffer. The file descriptor
+ *  is duplicated, so the caller may close it right away.
+ *
+ *  Parameters: ob: buffer object where the file is to be added.
+ *              file_fd: File descriptor of the file to be sent.
+ *              offset: Position of the first byte to be sent.
+ *              size: Number of bytes to be sent.
+ *
+ *  Returns: 0 if the file was added to the buffer, or -1 if an error
+ *           was found while flushing previous data.
+ */
+int ob_sendfile(out_buffer_t ob, int file_fd, off_t offset, size_t size) {
+  
+  if (ob->error)
+    return -1;
+  if (!size)
+    return 0;
+  
+  // The file takes a chunk of its own, which counts towards the limit
+  struct out_chunk *chunk = ob_chunk(ob, CHUNK_SIZE);
+  if (!chunk)
+    return -1;
+  if ((chunk->file = dup(file_fd)) == -1)
+    return -1;
+  chunk->offset = offset;
+  chunk->used   = size;
+  return 0;
+}
+
+/** Appends a buffer of data to the output buffer. Data is only sent
+ *  to the socket if the buffer becomes full.
+ *  
+ *  Parameters: ob: buffer object where data is to be added.
+ *              data: Buffer where data to be sent is stored.
+ *              size: Number of bytes to be used in the buffer.
+ *
+ *  Returns: size if the data was added to the buffer, or -1 if an
+ *           error was found while flushing previous data.
+ */
+int ob_write(out_buffer_t ob, const char *data, size_t size) {
+  
+  size_t rem = size;
+  
+  if (ob->error)
+    return -1;
+  
+  while (rem > 0) {
+    struct out_chunk *chunk = ob_chunk(ob, 1);
+    if (!chunk)
+      return -1;
+    size_t n = CHUNK_SIZE - chunk->used;
+    if (n > rem)
+      n = rem;
+    memcpy(chunk->data + chunk->used, data, n);
+    chunk->used += n;
+    data += n;
+    rem -= n;
+  }
+  return size;
+}
+
+/** Appends a potentially-formatted string to the output buffer,
+ *  using a printf-like behaviour, in the same way as send_string. The
+ *  string is formatted directly into the buffer. It is only sent to
+ *  the socket when ob_flush is called, or if the buffer becomes full.
+ *
+ *  ob_printf(ob, "+OK %d messages found\r\n", msg_count);
+ *  
+ *  Parameters: ob: buffer object where the string is to be added.
+ *              str: String to be sent, including potential
+ *                   printf-like format directives.
+ *              additional parameters based on string format.
+ *
+ *  Returns: The number of bytes added to the buffer, or -1 if an error
+ *           was found while flushing previous data.
+ */
+int ob_printf(out_buffer_t ob, const char *str, ...) {
+  
+  struct out_chunk *chunk;
+  va_list args;
+  int strsize;
+  
+  if (ob->error)
+    return -1;
+  
+  // Try to format the string in the space left in the current chunk
+  chunk = ob->chunks[ob->current];
+  size_t space = ob_space(chunk);
+  va_start(args, str);
+  strsize = vsnprintf(space ? chunk->data + chunk->used : NULL, space, str, args);
+  va_end(args);
+  
+  if (strsize < 0)
+    return -1;
+  if (strsize < space) {
+    chunk->used += strsize;
+    return strsize;
+  }
+  
+  // Strings that fit in a chunk are formatted again in a new chunk
+  if (strsize < CHUNK_SIZE) {
+    if (!(chunk = ob_chunk(ob, strsize + 1)))
+      return -1;
+    va_start(args, str);
+    vsnprintf(chunk->data + chunk->used, CHUNK_SIZE - chunk->used, str, args);
+    va_end(args);
+    chunk->used += strsize;
+    return strsize;
+  }
+  
+  // Longer strings are formatted separately and split into chunks
+  char *buf = malloc(strsize + 1);
+  va_start(args, str);
+  vsnprintf(buf, strsize + 1, str, args);
+  va_end(args);
+  strsize = ob_write(ob, buf, strsize);
+  free(buf);
+  return strsize;
+}
@@ -0,0 +1,26 @@
+/* outbuffer.h
+ * Buffers replies to be sent to a socket, coalescing them into as few
+ * system calls as possible.
+ */
+
+#ifndef _OUT_BUFFER_H_
+#define _OUT_BUFFER_H_
+
+#include <string.h>
+#include <sys/types.h>
+
+typedef struct out_buffer *out_buffer_t;
+
+out_buffer_t ob_create(int fd, size_t max_buffer_size);
+void ob_destroy(out_buffer_t ob);
+int ob_write(out_buffer_t ob, const char *data, size_t size);
+int ob_flush(out_buffer_t ob);
+int ob_pending(out_buffer_t ob);
+int ob_sendfile(out_buffer_t ob, int file_fd, off_t offset, size_t size);
+
+// The attribute in this function allows gcc to provided useful
+// warnings when compiling the code.
+int ob_printf(out_buffer_t ob, const char *str, ...)
+  __attribute__ ((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,111 @@
+/* protocol.c
+ * Recognizes command verbs and splits the arguments of SMTP and POP3
+ * command lines, without copying them.
+ */
+
+#include "protocol.h"
+
+/* Both protocols use verbs of three or four letters, so a verb fits in
+ * a 32-bit word. The first four bytes of a line are read as a single
+ * word and folded to lowercase by setting bit 5 of every byte, and the
+ * result is compared with the codes of the known verbs (PROTO_VERB).
+ * Folding is only exact for letters, but since every byte of a known
+ * code is a lowercase letter or a space, only the matching letters can
+ * fold into the letters. A space, however, is also what a NUL byte
+ * folds into, so the fourth byte (the only one that is a space in a
+ * known code) is compared explicitly: three-letter verbs are only
+ * recognized with an actual space as fourth byte, and four-letter
+ * verbs only if their fourth byte is not a NUL.
+ *
+ * Command tables are arrays of structures whose first member is the
+ * verb code, searched with proto_find.
+ */
+
+/** Finds the verb at the start of a command line.
+ *
+ *  Parameters: line: Command line, including the line terminator.
+ *              length: Length of the line.
+ *              args: Pointer where a pointer to the rest of the line,
+ *                    after the verb, is returned.
+ *
+ *  Returns: the code of the verb, to be compared with PROTO_VERB
+ *           codes, or 0 if the line does not start with a verb
+ *           followed by a space or the end of the line.
+ */
+uint32_t proto_verb(char *line, size_t length, char **args) {
+  
+  uint32_t verb;
+  
+  if (length < 5)
+    return 0;
+  memcpy(&verb, line, sizeof(verb));
+  verb |= 0x20202020U;
+  
+  if (line[3] == ' ') {
+    *args = line + 3;
+    return verb;
+  }
+  if (line[3] != '\0' && (line[4] == ' ' || line[4] == '\r')) {
+    *args = line + 4;
+    return verb;
+  }
+  return 0;
+}
+
+/** Finds the entry of a command table for a verb.
+ *
+ *  Parameters: verb: Verb code, as returned by proto_verb.
+ *              table: Array of entries starting with a uint32_t verb
+ *                     code.
+ *              count: Number of entries in the table.
+ *              size: Size of each entry.
+ *
+ *  Returns: the entry for the verb, or NULL if the verb is unknown.
+ */
+const void *proto_find(uint32_t verb, const void *table, size_t count, size_t size) {
+  
+  const char *entry = table;
+  
+  for (; verb && count; count--, entry += size)
+    if (*(const uint32_t *) entry == verb)
+      return entry;
+  return NULL;
+}
+
+/** Writes the name of a verb, in lowercase, for instance to label
+ *  per-command metrics.
+ *
+ *  Parameters: verb: Verb code, as in PROTO_VERB.
+ *              name: Array where the null-terminated name is written.
+ */
+void proto_verb_name(uint32_t verb, char name[5]) {
+  
+  memcpy(name, &verb, sizeof(verb));
+  name[name[3] == ' ' ? 3 : 4] = 0;
+}
+
+/** Extracts the next space-separated token from the arguments of a
+ *  command line. The token is terminated in place, so the line is
+ *  modified.
+ *
+ *  Parameters: cursor: Pointer to the position where the search
+ *                      starts, updated to the end of the token.
+ *
+ *  Returns: the token, or NULL if there are no more tokens before the
+ *           end of the line.
+ */
+char *proto_token(char **cursor) {
+  
+  char *start = *cursor, *end;
+  
+  while (*start == ' ')
+    start++;
+  if (!*start || *start == '\r' || *start == '\n')
+    return NULL;
+  
+  for (end = start; *end && *end != ' ' && *end != '\r' && *end != '\n'; end++)
+    ;
+  *cursor = *end ? end + 1 : end;
+  *end = '\0';
+  return start;
+}
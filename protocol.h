@@ -0,0 +1,27 @@
+/* protocol.h
+ * Recognizes command verbs and splits the arguments of SMTP and POP3
+ * command lines, without copying them.
+ */
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// Code of a command verb, as returned by proto_verb, built from its
+// lowercase letters (and a trailing space for three-letter verbs)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define PROTO_VERB(a, b, c, d) \
+  ((uint32_t) (a) << 24 | (uint32_t) (b) << 16 | (uint32_t) (c) << 8 | (uint32_t) (d))
+#else
+#define PROTO_VERB(a, b, c, d) \
+  ((uint32_t) (a) | (uint32_t) (b) << 8 | (uint32_t) (c) << 16 | (uint32_t) (d) << 24)
+#endif
+
+uint32_t proto_verb(char *line, size_t length, char **args);
+const void *proto_find(uint32_t verb, const void *table, size_t count, size_t size);
+char *proto_token(char **cursor);
+void proto_verb_name(uint32_t verb, char name[5]);
+
+#endif
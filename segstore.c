@@ -0,0 +1,254 @@
+/* segstore.c
+ * Stores message contents appended to large shared segment files,
+ * instead of one file per message.
+ */
+
+#define _GNU_SOURCE
+
+#include "segstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define SEGMENT_MAGIC 0x4d474553U       // "SEGM"
+#define SEGMENT_ENTRY_MAGIC 0x59544e45U // "ENTY"
+#define SEGMENT_MAX_SIZE (64 * 1024 * 1024)
+#define SEGMENT_LOCK_NAME "current"
+#define SEGMENT_SUFFIX ".seg"
+#define COPY_BUFFER_SIZE 65536
+
+/* A segment store is a directory holding numbered segment files, and a
+ * lock file (SEGMENT_LOCK_NAME) recording the number of the segment
+ * currently being appended to. New contents are always appended to
+ * the current segment; once it reaches SEGMENT_MAX_SIZE, it is closed
+ * and a new one is started. Segments are numbered from 1, so callers
+ * may use 0 to indicate contents stored elsewhere.
+ *
+ * Each entry starts with a header recording how many references
+ * (e.g., mailboxes) point to it. When the last reference is released,
+ * the entry becomes a tombstone: its header is kept, so the segment
+ * can still be scanned, but the space used by its contents is
+ * returned to the file system by punching a hole in the file. A
+ * closed segment with no live entries left is removed. Changes to a
+ * segment are serialized with flock on the segment file.
+ */
+struct segment_header {
+  uint32_t magic;
+  uint32_t closed;      // no more entries will be appended
+  uint64_t live;        // number of entries with references left
+};
+
+struct segment_entry {
+  uint32_t magic;
+  uint32_t refs;        // references left to this entry
+  uint64_t length;      // length of the contents
+};
+
+/** Returns the path of a segment file.
+ *
+ *  Parameters: directory: Segment store directory.
+ *              segment: Segment number.
+ *              path: Buffer where the path is returned.
+ *              size: Size of the buffer.
+ */
+void seg_path(const char *directory, uint32_t segment, char *path, size_t size) {
+  snprintf(path, size, "%s/%08x" SEGMENT_SUFFIX, directory, segment);
+}
+
+/** Internal function that opens (creating if needed) and locks a
+ *  segment file, reading its header.
+ *
+ *  Returns: file descriptor of the locked segment, or -1 on errors.
+ */
+static int seg_open(const char *directory, uint32_t segment, int flags,
+		    struct segment_header *header) {
+  
+  char path[PATH_MAX];
+  seg_path(directory, segment, path, sizeof(path));
+  
+  int fd = open(path, O_RDWR | flags, 0666);
+  if (fd < 0)
+    return -1;
+  flock(fd, LOCK_EX);
+  
+  if (pread(fd, header, sizeof(*header), 0) != sizeof(*header)) {
+    if (!(flags & O_CREAT))
+      goto error;
+    header->magic = SEGMENT_MAGIC;
+    header->closed = 0;
+    header->live = 0;
+    if (pwrite(fd, header, sizeof(*header), 0) != sizeof(*header))
+      goto error;
+  }
+  if (header->magic != SEGMENT_MAGIC)
+    goto error;
+  return fd;
+  
+ error:
+  close(fd);
+  return -1;
+}
+
+/** Internal function that removes a segment if it is closed and has no
+ *  live entries. The segment must be locked.
+ */
+static void seg_remove_if_dead(const char *directory, uint32_t segment,
+			       const struct segment_header *header) {
+  
+  char path[PATH_MAX];
+  if (header->closed && !header->live) {
+    seg_path(directory, segment, path, sizeof(path));
+    unlink(path);
+  }
+}
+
+/** Internal function that copies the whole contents of a file to a
+ *  position in another file, within the kernel if possible.
+ *
+ *  Returns: 0 if successful, -1 otherwise.
+ */
+static int seg_copy(int src_fd, int dst_fd, off_t dst_offset, size_t length) {
+  
+  off_t src_offset = 0;
+  char buffer[COPY_BUFFER_SIZE];
+  
+  while (length > 0) {
+    ssize_t rv = copy_file_range(src_fd, &src_offset, dst_fd, &dst_offset, length, 0);
+    if (rv < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+      // Not supported between these files, copy through user space
+      rv = pread(src_fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), src_offset);
+      if (rv > 0 && pwrite(dst_fd, buffer, rv, dst_offset) != rv)
+	return -1;
+      if (rv > 0) {
+	src_offset += rv;
+	dst_offset += rv;
+      }
+    }
+    if (rv <= 0)
+      return -1;
+    length -= rv;
+  }
+  return 0;
+}
+
+/** Appends the contents of a file as a new entry in a segment store.
+ *
+ *  Parameters: directory: Segment store directory (created if needed).
+ *              src_fd: File descriptor of the file to be stored.
+ *              refs: Number of references to the new entry.
+ *              segment: Where the segment number of the entry is
+ *                       returned.
+ *              offset: Where the position of the contents of the entry
+ *                      in the segment file is returned.
+ *
+ *  Returns: 0 if successful, -1 otherwise.
+ */
+int seg_append(const char *directory, int src_fd, unsigned int refs,
+	       uint32_t *segment, uint64_t *offset) {
+  
+  char path[PATH_MAX];
+  struct segment_header header;
+  struct segment_entry entry = { .magic = SEGMENT_ENTRY_MAGIC, .refs = refs };
+  struct stat file_stat;
+  uint32_t current = 1;
+  int rv = -1;
+  
+  if (fstat(src_fd, &file_stat) < 0)
+    return -1;
+  entry.length = file_stat.st_size;
+  
+  // The lock file serializes appends, and records the current segment
+  mkdir(directory, 0777);
+  snprintf(path, sizeof(path), "%s/" SEGMENT_LOCK_NAME, directory);
+  int lock_fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (lock_fd < 0)
+    return -1;
+  flock(lock_fd, LOCK_EX);
+  if (pread(lock_fd, &current, sizeof(current), 0) != sizeof(current))
+    current = 1;
+  
+  int fd = seg_open(directory, current, O_CREAT, &header);
+  if (fd >= 0 && fstat(fd, &file_stat) == 0 &&
+      file_stat.st_size > sizeof(header) &&
+      file_stat.st_size + sizeof(entry) + entry.length > SEGMENT_MAX_SIZE) {
+    
+    // Close the current segment and start a new one
+    header.closed = 1;
+    pwrite(fd, &header, sizeof(header), 0);
+    seg_remove_if_dead(directory, current, &header);
+    close(fd);
+    
+    current++;
+    pwrite(lock_fd, &current, sizeof(current), 0);
+    fd = seg_open(directory, current, O_CREAT, &header);
+    if (fd >= 0 && fstat(fd, &file_stat) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  close(lock_fd);
+  if (fd < 0)
+    return -1;
+  
+  // Entries are aligned to 8 bytes
+  off_t entry_offset = (file_stat.st_size + 7) & ~7;
+  if (pwrite(fd, &entry, sizeof(entry), entry_offset) == sizeof(entry) &&
+      seg_copy(src_fd, fd, entry_offset + sizeof(entry), entry.length) == 0) {
+    header.live++;
+    if (pwrite(fd, &header, sizeof(header), 0) == sizeof(header)) {
+      *segment = current;
+      *offset = entry_offset + sizeof(entry);
+      rv = 0;
+    }
+  }
+  
+  close(fd);
+  return rv;
+}
+
+/** Releases a reference to an entry in a segment store. Once all
+ *  references are released, the space used by the entry is freed.
+ *
+ *  Parameters: directory: Segment store directory.
+ *              segment: Segment number of the entry.
+ *              offset: Position of the contents of the entry, as
+ *                      returned by seg_append.
+ *
+ *  Returns: 0 if successful, -1 otherwise.
+ */
+int seg_release(const char *directory, uint32_t segment, uint64_t offset) {
+  
+  struct segment_header header;
+  struct segment_entry entry;
+  off_t entry_offset = offset - sizeof(entry);
+  int rv = -1;
+  
+  int fd = seg_open(directory, segment, 0, &header);
+  if (fd < 0)
+    return -1;
+  
+  if (pread(fd, &entry, sizeof(entry), entry_offset) == sizeof(entry) &&
+      entry.magic == SEGMENT_ENTRY_MAGIC && entry.refs > 0) {
+    
+    entry.refs--;
+    if (pwrite(fd, &entry, sizeof(entry), entry_offset) == sizeof(entry)) {
+      rv = 0;
+      if (!entry.refs) {
+	fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, entry.length);
+	header.live--;
+	pwrite(fd, &header, sizeof(header), 0);
+	seg_remove_if_dead(directory, segment, &header);
+      }
+    }
+  }
+  
+  close(fd);
+  return rv;
+}
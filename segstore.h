@@ -0,0 +1,17 @@
+/* segstore.h
+ * Stores message contents appended to large shared segment files,
+ * instead of one file per message.
+ */
+
+#ifndef _SEG_STORE_H_
+#define _SEG_STORE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+int seg_append(const char *directory, int src_fd, unsigned int refs,
+	       uint32_t *segment, uint64_t *offset);
+int seg_release(const char *directory, uint32_t segment, uint64_t offset);
+void seg_path(const char *directory, uint32_t segment, char *path, size_t size);
+
+#endif
@@ -9,7 +9,11 @@
  * send_all.
  */
 
+#define _GNU_SOURCE // sched_setaffinity and CPU_SET
+
 #include "server.h"
+#include "timerwheel.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,6 +29,15 @@
 #include <sys/wait.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/sendfile.h>
 
 /* Fixes a problem in OSX that it does not define MSG_NOSIGNAL */
 #ifndef MSG_NOSIGNAL 
@@ -32,6 +45,31 @@
 #endif
 
 #define BACKLOG 10     // how many pending connections queue will hold
+#define MAX_EVENTS 64  // events handled per call to epoll_wait
+
+/* Per-worker statistics, padded to a cache line so that workers do not
+ * contend for the same line when updating their own counters.
+ */
+struct worker_stats {
+  unsigned long connections;
+  char padding[64 - sizeof(unsigned long)];
+};
+
+typedef void (*worker_func)(int sockfd, int index, const struct session_ops *ops);
+
+static struct worker_stats *worker_stats = NULL;
+static volatile sig_atomic_t report_requested = 0;
+
+// Admission slot of each open connection of this process, by descriptor
+static int *client_slots = NULL;
+static int client_slots_size = 0;
+
+// Idle timers of the connections of an epoll worker, one tick per second
+static struct timer_wheel idle_timers;
+
+// Suspended sessions of an epoll worker, resumed through wakeup_fd
+static struct connection *suspended_connections = NULL;
+static int wakeup_fd = -1;
 
 /** Signal handler used to destroy zombie children (forked) processes
  *  once they finish executing.
@@ -54,28 +92,112 @@ static void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-/** Creates a server socket at the specified port number, listens for
- *  new connections and accepts them. A new forked process is created
- *  for each new client, calling the provided handler function for
- *  this client.
+/** Returns the current time of a monotonic clock, in milliseconds. */
+static uint64_t monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Returns how long a session may stay idle in its current state, in
+ *  seconds, or zero if it may wait forever.
+ */
+static unsigned int session_timeout(const struct session_ops *ops, void *session) {
+  return ops->timeout ? ops->timeout(session) : 0;
+}
+
+/** Increments the number of connections served by a worker. Has no
+ *  effect if the engine does not keep per-worker statistics.
+ */
+static void count_connection(int index) {
+  if (worker_stats)
+    __atomic_fetch_add(&worker_stats[index].connections, 1, __ATOMIC_RELAXED);
+}
+
+/** Initializes a server configuration with the default values: the
+ *  fork engine, and one worker per online CPU if the epoll or prefork
+ *  engine is selected.
+ *
+ *  Parameters: config: configuration object to be initialized.
+ */
+void server_config_init(struct server_config *config) {
+  
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  config->engine  = SERVER_ENGINE_FORK;
+  config->workers = cpus > 0 ? cpus : 1;
+  config->backlog = BACKLOG;
+  config->pin_cpus = 0;
+  memset(&config->admission, 0, sizeof(config->admission));
+  config->metrics_port = NULL;
+}
+
+/** Applies a command-line option (as returned by getopt with
+ *  SERVER_OPTIONS) to a server configuration.
+ *
+ *  Parameters: config: configuration object to be modified.
+ *              opt: option character returned by getopt.
+ *              arg: option argument (optarg), if any.
+ *
+ *  Returns: 1 if the option was applied, 0 if the option is not a
+ *           server option, or -1 if the argument is invalid.
+ */
+int server_config_option(struct server_config *config, int opt, const char *arg) {
+  
+  switch (opt) {
+  case 'e':
+    if (!strcmp(arg, "fork"))
+      config->engine = SERVER_ENGINE_FORK;
+    else if (!strcmp(arg, "epoll"))
+      config->engine = SERVER_ENGINE_EPOLL;
+    else if (!strcmp(arg, "prefork"))
+      config->engine = SERVER_ENGINE_PREFORK;
+    else
+      return -1;
+    return 1;
+  case 'w':
+    config->workers = atoi(arg);
+    return config->workers > 0 ? 1 : -1;
+  case 'b':
+    config->backlog = atoi(arg);
+    return config->backlog > 0 ? 1 : -1;
+  case 'c':
+    config->pin_cpus = 1;
+    return 1;
+  case 'L':
+    config->admission.max_active = atoi(arg);
+    return config->admission.max_active > 0 ? 1 : -1;
+  case 'R':
+    return adm_parse_rate(arg, &config->admission.connections) < 0 ? -1 : 1;
+  case 'Q':
+    return adm_parse_rate(arg, &config->admission.commands) < 0 ? -1 : 1;
+  case 'M':
+    config->metrics_port = arg;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/** Creates a server socket at the specified port number and sets it
+ *  up to listen for new connections. Exits the program if the socket
+ *  cannot be created.
  *
  *  Parameters: port: String corresponding to the port number (or
  *                    name) where the server will listen for new
  *                    connections.
- *              handler: Function to be called when a new connection
- *                       is accepted. Will receive, as the only
- *                       parameter, the file descriptor corresponding
- *                       to the newly accepted connection.
+ *              backlog: Size of the queue of pending connections.
+ *              reuseport: If non-zero, sets SO_REUSEPORT so that
+ *                         several sockets may be bound to the same
+ *                         port, with the kernel balancing incoming
+ *                         connections between them.
+ *
+ *  Returns: The file descriptor of the listening socket.
  */
-void run_server(const char *port, void (*handler)(int)) {
+static int create_listener(const char *port, int backlog, int reuseport) {
   
-  int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
+  int sockfd;
   struct addrinfo hints, *servinfo, *p;
-  struct sockaddr_storage their_addr; // connector's address information
-  socklen_t sin_size;
-  struct sigaction sa;
   int yes = 1;
-  char s[INET6_ADDRSTRLEN];
   int rv;
   
   memset(&hints, 0, sizeof hints);
@@ -104,6 +226,11 @@ void run_server(const char *port, void (*handler)(int)) {
       exit(1);
     }
     
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+      perror("setsockopt");
+      exit(1);
+    }
+    
     // bind to the specified port number
     if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
       close(sockfd);
@@ -125,11 +252,184 @@ void run_server(const char *port, void (*handler)(int)) {
   }
   
   // sets up a queue of incoming connections to be received by the server
-  if (listen(sockfd, BACKLOG) == -1) {
+  if (listen(sockfd, backlog) == -1) {
     perror("listen");
     exit(1);
   }
   
+  return sockfd;
+}
+
+/** Records the admission slot of a new connection of this process.
+ */
+static void set_client_slot(int fd, int slot) {
+  
+  if (fd >= client_slots_size) {
+    int size = client_slots_size ? client_slots_size : 64;
+    while (size <= fd)
+      size *= 2;
+    client_slots = realloc(client_slots, size * sizeof(int));
+    for (int i = client_slots_size; i < size; i++)
+      client_slots[i] = ADM_UNTRACKED;
+    client_slots_size = size;
+  }
+  client_slots[fd] = slot;
+}
+
+/** Returns the admission slot of a connection of this process. */
+static int client_slot(int fd) {
+  return fd >= 0 && fd < client_slots_size ? client_slots[fd] : ADM_UNTRACKED;
+}
+
+/** Accepts a new connection from a listening socket and logs the
+ *  address of the client. Connections refused by admission control
+ *  (see admission.h) get the refusal reply of the protocol and are
+ *  closed right away, without a session, and the next pending
+ *  connection is accepted instead.
+ *
+ *  Parameters: sockfd: listening socket.
+ *              ops: Protocol session callbacks.
+ *
+ *  Returns: The file descriptor of the new connection, or -1 on error.
+ */
+static int accept_client(int sockfd, const struct session_ops *ops) {
+  
+  struct sockaddr_storage their_addr; // connector's address information
+  socklen_t sin_size;
+  char s[INET6_ADDRSTRLEN];
+  int new_fd, slot;
+  
+  while (1) {
+    sin_size = sizeof(their_addr);
+    new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+    if (new_fd == -1)
+      return -1;
+    
+    if (adm_admit((struct sockaddr *)&their_addr, &slot))
+      break;
+    mt_add(MT_REFUSED, 1);
+    
+    // Best effort: the reply fits in an empty socket buffer, and the
+    // client is not waited for
+    if (ops->refusal)
+      send(new_fd, ops->refusal, strlen(ops->refusal), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(new_fd);
+  }
+  
+  set_client_slot(new_fd, slot);
+  mt_add(MT_CONNECTIONS, 1);
+  inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
+	    s, sizeof(s));
+  printf("server: got connection from %s\n", s);
+  return new_fd;
+}
+
+/** Closes a connection accepted with accept_client, releasing it in
+ *  the admission control.
+ */
+static void close_client(int fd) {
+  adm_release(client_slot(fd));
+  set_client_slot(fd, ADM_UNTRACKED);
+  close(fd);
+}
+
+/** Decides if the client of a connection may run another command,
+ *  based on the command rate limit of its address (see admission.h).
+ *  Sessions call this function for each command received.
+ *
+ *  Parameters: fd: Socket file descriptor of the connection.
+ *
+ *  Returns: 1 if the command may run, 0 if the session should be
+ *           closed for exceeding the limit.
+ */
+int server_admit_command(int fd) {
+  return adm_command(client_slot(fd));
+}
+
+/** Gives the descriptor that resumes the suspended sessions of this
+ *  process (see struct session_ops). It is an eventfd, so it is
+ *  written to by adding a count to it, possibly from another thread.
+ *
+ *  Returns: The wakeup descriptor of an epoll worker, or -1 if the
+ *           engine does not suspend sessions, which may then simply
+ *           block.
+ */
+int server_wakeup_fd(void) {
+  return wakeup_fd;
+}
+
+/** Waits until a blocking connection has data to be read, or until a
+ *  timeout expires.
+ *
+ *  Parameters: fd: Socket file descriptor of the connection.
+ *              timeout: Maximum time to wait, in seconds, or zero to
+ *                       wait forever.
+ *
+ *  Returns: 0 if the timeout expired, non-zero otherwise (including
+ *           errors, which are then reported by the next read).
+ */
+static int wait_readable(int fd, unsigned int timeout) {
+  
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  uint64_t deadline = monotonic_ms() + timeout * 1000ULL;
+  
+  if (!timeout)
+    return 1;
+  
+  while (1) {
+    uint64_t now = monotonic_ms();
+    if (now >= deadline)
+      return 0;
+    int rv = poll(&pfd, 1, deadline - now);
+    if (rv >= 0 || errno != EINTR)
+      return rv != 0;
+  }
+}
+
+/** Runs a session to completion over a blocking connection, reading
+ *  more data from the socket whenever the session has consumed all
+ *  complete lines available in the buffer. The session is closed if
+ *  no data arrives within its timeout.
+ *
+ *  Parameters: fd: Socket file descriptor of the connection.
+ *              ops: Protocol session callbacks.
+ */
+static void serve_blocking(int fd, const struct session_ops *ops) {
+  
+  void *session = ops->open(fd);
+  if (!session)
+    return;
+  mt_add(MT_ACTIVE_SESSIONS, 1);
+  
+  net_buffer_t nb = nb_create(fd, ops->max_line);
+  int reason = SESSION_DONE;
+  
+  while (ops->input(session, nb)) {
+    if (!wait_readable(fd, session_timeout(ops, session))) {
+      reason = SESSION_TIMEOUT;
+      mt_add(MT_TIMEOUTS, 1);
+      break;
+    }
+    int rv = nb_fill(nb, 0);
+    if (rv <= 0) {
+      reason = rv < 0 ? SESSION_ERROR : SESSION_EOF;
+      break;
+    }
+    mt_add(MT_BYTES_IN, rv);
+  }
+  
+  ops->close(session, reason);
+  mt_add(MT_ACTIVE_SESSIONS, -1);
+  nb_destroy(nb);
+}
+
+/** Fork engine: accepts connections in a single loop, and a new
+ *  forked process is created for each new client.
+ */
+static void run_fork_engine(int sockfd, const struct session_ops *ops) {
+  
+  struct sigaction sa;
+  
   // set up a signal handler to kill zombie forked processes when they exit
   sa.sa_handler = sigchld_handler;
   sigemptyset(&sa.sa_mask);
@@ -143,31 +443,521 @@ void run_server(const char *port, void (*handler)(int)) {
   
   while(1) {
     // wait for new client to connect
-    sin_size = sizeof(their_addr);
-    new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+    int new_fd = accept_client(sockfd, ops);
     if (new_fd == -1) {
       perror("accept");
       continue;
     }
     
-    inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
-	      s, sizeof(s));
-    printf("server: got connection from %s\n", s);
-    
     // Create a new process to handle the new client; parent process
     // will wait for another client.
     if (!fork()) {
       // this is the child process
       close(sockfd); // child doesn't need the listener
-      handler(new_fd);
-      close(new_fd);
+      mt_detach();
+      serve_blocking(new_fd, ops);
+      close_client(new_fd);
       exit(0);
     }
     
     // Parent proceeds from here. In parent, client socket is not needed.
     close(new_fd);
   }
+}
+
+/** State kept by the epoll engine for each open connection. */
+struct connection {
+  int fd;
+  int blocked; // replies pending, waiting for the socket to be writable
+  int unread;  // input not yet consumed by the session
+  int closing; // session finished, closed once its replies are sent
+  int suspended; // session waiting for wakeup_fd, not watched by epoll
+  net_buffer_t nb;
+  void *session;
+  struct tw_timer timer; // idle timer, in idle_timers
+  struct connection *next_suspended; // in suspended_connections
+};
+
+/** Arguments of expire_connection. */
+struct epoll_context {
+  int epfd;
+  const struct session_ops *ops;
+};
+
+/** Schedules the idle timer of a connection, based on the timeout of
+ *  the current state of its session.
+ */
+static void arm_idle_timer(struct connection *conn, const struct session_ops *ops) {
+  
+  unsigned int timeout = session_timeout(ops, conn->session);
+  
+  // One extra tick, so the session is idle for at least the timeout
+  if (timeout)
+    tw_add(&idle_timers, &conn->timer, monotonic_ms() / 1000 + timeout + 1);
+  else
+    tw_remove(&idle_timers, &conn->timer);
+}
+
+/** Ends a connection handled by the epoll engine, releasing the
+ *  session and all resources associated to it.
+ */
+static void close_connection(int epfd, struct connection *conn,
+			     const struct session_ops *ops, int reason) {
+  
+  tw_remove(&idle_timers, &conn->timer);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  ops->close(conn->session, reason);
+  mt_add(MT_ACTIVE_SESSIONS, -1);
+  nb_destroy(conn->nb);
+  close_client(conn->fd);
+  free(conn);
+}
+
+/** Registers a connection in the epoll instance (or updates it),
+ *  waiting for the socket to be writable while replies are pending,
+ *  or readable otherwise.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int watch_connection(int epfd, struct connection *conn, int op) {
+  
+  struct epoll_event ev;
+  ev.events = conn->blocked ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+  ev.data.ptr = conn;
+  return epoll_ctl(epfd, op, conn->fd, &ev);
+}
+
+/** Sends the pending replies of a session without blocking, and lets
+ *  the session consume its input once they are sent. The session runs
+ *  until it has no input left to consume, or until its replies fill
+ *  the socket, in which case the connection waits for the socket to be
+ *  writable, and no more input is read until the replies are sent.
+ *  A session that is suspended is removed from the epoll instance and
+ *  from the idle timers until it is resumed (see resume_connections).
+ *  The idle timer restarts every time the session runs, so a client
+ *  that keeps reading a long reply is not idle.
+ */
+static void run_connection(int epfd, struct connection *conn,
+			   const struct session_ops *ops) {
+  
+  int blocked = conn->blocked, suspended = conn->suspended, sent;
+  
+  while (1) {
+    sent = ops->flush ? ops->flush(conn->session) : 1;
+    if (sent < 0) {
+      close_connection(epfd, conn, ops, SESSION_ERROR);
+      return;
+    }
+    if (sent != 1)
+      break;
+    if (conn->closing) {
+      close_connection(epfd, conn, ops, SESSION_DONE);
+      return;
+    }
+    if (!conn->unread)
+      break;
+    int rv = ops->input(conn->session, conn->nb);
+    conn->closing = !rv;
+    conn->unread = rv < 0;
+  }
+  
+  conn->blocked = !sent;
+  conn->suspended = sent == SESSION_SUSPENDED;
+  if (conn->suspended) {
+    if (!suspended) {
+      epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+      tw_remove(&idle_timers, &conn->timer);
+    }
+    conn->next_suspended = suspended_connections;
+    suspended_connections = conn;
+    return;
+  }
+  
+  if ((suspended || conn->blocked != blocked) &&
+      watch_connection(epfd, conn, suspended ? EPOLL_CTL_ADD : EPOLL_CTL_MOD) == -1) {
+    perror("epoll_ctl");
+    close_connection(epfd, conn, ops, SESSION_ERROR);
+    return;
+  }
+  arm_idle_timer(conn, ops);
+}
+
+/** Accepts all pending connections in the (non-blocking) listening
+ *  socket and registers them in the epoll instance. Client sockets
+ *  are non-blocking too, so a client that does not read its replies
+ *  never stops the worker: replies that do not fit in the socket are
+ *  kept by the session until the socket is writable.
+ */
+static void accept_connections(int epfd, int sockfd, int index,
+			       const struct session_ops *ops) {
+  
+  int new_fd;
+  
+  while ((new_fd = accept_client(sockfd, ops)) >= 0) {
+    
+    count_connection(index);
+    int flags = fcntl(new_fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(new_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+      perror("fcntl");
+      close_client(new_fd);
+      continue;
+    }
+    
+    struct connection *conn = malloc(sizeof(struct connection));
+    conn->fd = new_fd;
+    conn->blocked = 0;
+    conn->unread = 0;
+    conn->closing = 0;
+    conn->suspended = 0;
+    conn->timer.pprev = NULL;
+    conn->session = ops->open(new_fd);
+    if (!conn->session) {
+      close_client(new_fd);
+      free(conn);
+      continue;
+    }
+    mt_add(MT_ACTIVE_SESSIONS, 1);
+    conn->nb = nb_create(new_fd, ops->max_line);
+    
+    if (watch_connection(epfd, conn, EPOLL_CTL_ADD) == -1) {
+      perror("epoll_ctl");
+      close_connection(epfd, conn, ops, SESSION_ERROR);
+      continue;
+    }
+    // Sends the greeting, if it did not fit in the socket
+    run_connection(epfd, conn, ops);
+  }
+  
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    perror("accept");
+}
+
+/** Handles a connection reported as readable: receives the available
+ *  data and lets the session consume all complete lines.
+ */
+static void connection_readable(int epfd, struct connection *conn,
+				const struct session_ops *ops) {
+  
+  int rv = nb_fill(conn->nb, MSG_DONTWAIT);
+  if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  if (rv <= 0) {
+    close_connection(epfd, conn, ops, rv < 0 ? SESSION_ERROR : SESSION_EOF);
+    return;
+  }
+  mt_add(MT_BYTES_IN, rv);
+  
+  conn->unread = 1;
+  run_connection(epfd, conn, ops);
+}
+
+/** Handles the wakeup descriptor reported as readable: runs all
+ *  suspended sessions again, and those that are still waiting are
+ *  suspended again.
+ */
+static void resume_connections(int epfd, const struct session_ops *ops) {
+  
+  struct connection *conn = suspended_connections;
+  uint64_t count;
+  
+  if (read(wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("wakeup");
+  
+  suspended_connections = NULL;
+  while (conn) {
+    struct connection *next = conn->next_suspended;
+    run_connection(epfd, conn, ops);
+    conn = next;
+  }
+}
+
+/** Timer wheel callback that closes a connection whose idle timer
+ *  expired.
+ */
+static void expire_connection(struct tw_timer *timer, void *arg) {
+  
+  struct epoll_context *context = arg;
+  struct connection *conn = (struct connection *)
+    ((char *) timer - offsetof(struct connection, timer));
+  
+  mt_add(MT_TIMEOUTS, 1);
+  close_connection(context->epfd, conn, context->ops, SESSION_TIMEOUT);
+}
+
+/** Event loop run by each worker of the epoll engine. All workers
+ *  share the same listening socket, registered with EPOLLEXCLUSIVE so
+ *  that a new connection wakes up a single worker. Idle connections
+ *  are expired from a timer wheel, so the cost of timeouts does not
+ *  depend on the number of connections; while any timer is pending,
+ *  the loop wakes up once per second to advance the wheel. Suspended
+ *  sessions run again whenever the wakeup descriptor of the worker is
+ *  written to.
+ */
+static void epoll_worker(int sockfd, int index, const struct session_ops *ops) {
+  
+  struct epoll_event ev, events[MAX_EVENTS];
+  int epfd = epoll_create1(0);
+  if (epfd == -1) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  
+  struct epoll_context context = { .epfd = epfd, .ops = ops };
+  tw_init(&idle_timers, monotonic_ms() / 1000);
+  
+  // A NULL data pointer identifies the listening socket
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+    perror("epoll_ctl");
+    exit(1);
+  }
+  
+  // ... and a pointer to wakeup_fd identifies the wakeup descriptor
+  wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ev.events = EPOLLIN;
+  ev.data.ptr = &wakeup_fd;
+  if (wakeup_fd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, wakeup_fd, &ev) == -1) {
+    perror("eventfd");
+    exit(1);
+  }
+  
+  while (1) {
+    // Wait at most until the next tick of the wheel
+    int wait = -1;
+    if (idle_timers.count) {
+      uint64_t now = monotonic_ms(), next = idle_timers.current * 1000;
+      wait = next > now ? next - now : 0;
+    }
+    int n = epoll_wait(epfd, events, MAX_EVENTS, wait);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+    
+    for (int i = 0; i < n; i++) {
+      struct connection *conn = events[i].data.ptr;
+      if (!conn)
+	accept_connections(epfd, sockfd, index, ops);
+      else if (events[i].data.ptr == &wakeup_fd)
+	resume_connections(epfd, ops);
+      else if (conn->blocked)
+	run_connection(epfd, conn, ops);
+      else
+	connection_readable(epfd, conn, ops);
+    }
+    
+    tw_advance(&idle_timers, monotonic_ms() / 1000, expire_connection, &context);
+  }
+}
+
+/** Pre-forked worker: accepts connections from its own listening
+ *  socket and serves them one at a time, with blocking reads.
+ */
+static void prefork_worker(int sockfd, int index, const struct session_ops *ops) {
+  
+  while (1) {
+    int new_fd = accept_client(sockfd, ops);
+    if (new_fd == -1) {
+      if (errno != EINTR)
+	perror("accept");
+      continue;
+    }
+    count_connection(index);
+    serve_blocking(new_fd, ops);
+    close_client(new_fd);
+  }
+}
+
+/** Pins the calling process to a single CPU, chosen based on the
+ *  worker index. Errors are reported but otherwise ignored.
+ */
+static void pin_worker(int index) {
+  
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t set;
+  
+  CPU_ZERO(&set);
+  CPU_SET(index % (cpus > 0 ? cpus : 1), &set);
+  if (sched_setaffinity(0, sizeof(set), &set) == -1)
+    perror("sched_setaffinity");
+}
+
+/** Creates a worker process running the given worker function.
+ *
+ *  Returns: the process ID of the new worker.
+ */
+static pid_t spawn_worker(int sockfd, int index, const struct server_config *config,
+			  worker_func worker, const struct session_ops *ops) {
+  
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (!pid) {
+    // Workers should not outlive the main process
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    mt_detach();
+    signal(SIGUSR1, SIG_DFL);
+    if (config->pin_cpus)
+      pin_worker(index);
+    worker(sockfd, index, ops);
+    exit(0);
+  }
+  return pid;
+}
+
+/** Signal handler used by the main process to report the number of
+ *  connections served by each worker.
+ */
+static void report_handler(int s) {
+  report_requested = 1;
+}
+
+/** Prints the number of connections served by each worker so far. */
+static void report_worker_stats(int workers) {
+  
+  for (int i = 0; i < workers; i++)
+    printf("server: worker %d served %lu connections\n", i,
+	   __atomic_load_n(&worker_stats[i].connections, __ATOMIC_RELAXED));
+  fflush(stdout);
+}
+
+/** Runs a pool of long-lived worker processes, worker i using the
+ *  listening socket listeners[i]. The main process restarts workers
+ *  that terminate unexpectedly, and prints the per-worker connection
+ *  counters when it receives SIGUSR1.
+ */
+static void run_workers(const int *listeners, const struct server_config *config,
+			worker_func worker, const struct session_ops *ops) {
+  
+  struct sigaction sa;
+  int workers = config->workers;
+  
+  // Counters are kept in memory shared by all workers and the main process
+  worker_stats = mmap(NULL, workers * sizeof(struct worker_stats), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (worker_stats == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  
+  // No SA_RESTART, so that wait is interrupted to print the report
+  sa.sa_handler = report_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+    perror("sigaction");
+    exit(1);
+  }
+  
+  pid_t *pids = calloc(workers, sizeof(pid_t));
+  for (int i = 0; i < workers; i++)
+    pids[i] = spawn_worker(listeners[i], i, config, worker, ops);
+  
+  while (1) {
+    pid_t pid = wait(NULL);
+    if (pid == -1) {
+      if (errno != EINTR) {
+	perror("wait");
+	exit(1);
+      }
+      if (report_requested) {
+	report_requested = 0;
+	report_worker_stats(workers);
+      }
+      continue;
+    }
+    for (int i = 0; i < workers; i++)
+      if (pids[i] == pid)
+	pids[i] = spawn_worker(listeners[i], i, config, worker, ops);
+  }
+}
+
+/** Epoll engine: a fixed number of long-lived worker processes, each
+ *  running an event loop that multiplexes many connections. All
+ *  workers share the same (non-blocking) listening socket.
+ */
+static void run_epoll_engine(int sockfd, const struct server_config *config,
+			     const struct session_ops *ops) {
+  
+  int flags = fcntl(sockfd, F_GETFL, 0);
+  if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl");
+    exit(1);
+  }
+  
+  int *listeners = malloc(config->workers * sizeof(int));
+  for (int i = 0; i < config->workers; i++)
+    listeners[i] = sockfd;
+  
+  printf("server: waiting for connections (%d epoll workers)...\n", config->workers);
+  run_workers(listeners, config, epoll_worker, ops);
+}
+
+/** Prefork engine: a fixed number of long-lived worker processes,
+ *  each with its own SO_REUSEPORT listening socket, so the kernel
+ *  spreads incoming connections across workers. Listeners are created
+ *  by the main process, so a restarted worker keeps the same queue.
+ */
+static void run_prefork_engine(const char *port, const struct server_config *config,
+			       const struct session_ops *ops) {
+  
+  int *listeners = malloc(config->workers * sizeof(int));
+  for (int i = 0; i < config->workers; i++)
+    listeners[i] = create_listener(port, config->backlog, 1);
+  
+  printf("server: waiting for connections (%d prefork workers)...\n", config->workers);
+  run_workers(listeners, config, prefork_worker, ops);
+}
 
+/** Creates a server socket at the specified port number, listens for
+ *  new connections and accepts them. Each connection is served by
+ *  the engine selected in the configuration, which drives the
+ *  protocol session callbacks for this client.
+ *
+ *  Parameters: port: String corresponding to the port number (or
+ *                    name) where the server will listen for new
+ *                    connections.
+ *              config: Server configuration (engine, workers,
+ *                      backlog, CPU pinning, admission limits and
+ *                      metrics port).
+ *              ops: Protocol session callbacks, called for each
+ *                   newly accepted connection.
+ */
+void run_server(const char *port, const struct server_config *config,
+		const struct session_ops *ops) {
+  
+  // sendfile has no MSG_NOSIGNAL equivalent, so an interrupted
+  // connection must not raise a PIPE signal that crashes the program
+  signal(SIGPIPE, SIG_IGN);
+  
+  // Shared by all processes, so it must be created before they fork
+  if (adm_init(&config->admission) < 0) {
+    perror("admission");
+    exit(1);
+  }
+  
+  // Metrics are only recorded if they are served by the main process
+  if (config->metrics_port && (mt_init() < 0 || mt_serve(config->metrics_port) < 0)) {
+    perror("metrics");
+    exit(1);
+  }
+  
+  if (config->engine == SERVER_ENGINE_PREFORK) {
+    run_prefork_engine(port, config, ops);
+    return;
+  }
+  
+  int sockfd = create_listener(port, config->backlog, 0);
+  
+  if (config->engine == SERVER_ENGINE_EPOLL)
+    run_epoll_engine(sockfd, config, ops);
+  else
+    run_fork_engine(sockfd, ops);
 }
 
 /** Sends a buffer of data, until all data is sent or an error is
@@ -198,6 +988,36 @@ int send_all(int fd, char buf[], size_t size) {
       return rv;
     buf += rv;
     rem -= rv;
+    mt_add(MT_BYTES_OUT, rv);
+  }
+  return size;
+}
+
+/** Sends part of a file to a socket, with the data copied directly by
+ *  the kernel (using sendfile) instead of being read into a user-space
+ *  buffer. As in send_all, this function will call sendfile again
+ *  until all data is sent.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              file_fd: File descriptor of the file to be sent.
+ *              offset: Position in the file of the first byte to send.
+ *              size: Number of bytes to be sent.
+ *
+ *  Returns: If the data was successfully sent, returns size.
+ *           Otherwise, returns -1.
+ */
+int send_file(int fd, int file_fd, off_t offset, size_t size) {
+  
+  size_t rem = size;
+  while (rem > 0) {
+    ssize_t rv = sendfile(fd, file_fd, &offset, rem);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    // Interrupted connection, or file shorter than expected
+    if (rv <= 0)
+      return -1;
+    rem -= rv;
+    mt_add(MT_BYTES_OUT, rv);
   }
   return size;
 }
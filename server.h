@@ -8,10 +8,83 @@
 #define _SERVER_H_
 
 #include <stdio.h>
+#include <sys/types.h>
 
-void run_server(const char *port, void (*handler)(int));
+#include "netbuffer.h"
+#include "admission.h"
+
+// Connection engines that can be selected at startup
+#define SERVER_ENGINE_FORK  0 // one forked process per connection
+#define SERVER_ENGINE_EPOLL 1 // event loop multiplexing connections per worker
+#define SERVER_ENGINE_PREFORK 2 // pre-forked workers, one SO_REUSEPORT listener each
+
+// Reasons passed to the close callback of a session
+#define SESSION_DONE   1  // session finished by the protocol (e.g., QUIT)
+#define SESSION_EOF    0  // client closed the connection
+#define SESSION_ERROR -1  // connection terminated abruptly
+#define SESSION_TIMEOUT -2 // client idle for longer than the session timeout
+
+// Returned by the flush callback of a suspended session
+#define SESSION_SUSPENDED 2
+
+// Command-line options understood by server_config_option
+#define SERVER_OPTIONS "e:w:b:cL:R:Q:M:"
+#define SERVER_USAGE "[-e fork|epoll|prefork] [-w workers] [-b backlog] [-c]" \
+  " [-L max_per_client] [-R conn_rate[:burst]] [-Q cmd_rate[:burst]]" \
+  " [-M metrics_port]"
+
+struct server_config {
+  int engine;
+  int workers;   // worker processes for the epoll and prefork engines
+  int backlog;   // pending connection queue size of each listener
+  int pin_cpus;  // pin worker i to CPU i (modulo the number of CPUs)
+  struct adm_limits admission; // per-client limits, see admission.h
+  const char *metrics_port;    // local admin port serving metrics, or NULL
+};
+
+/* A protocol is implemented as a resumable session: the engine calls
+ * open once the connection is accepted, input every time new data is
+ * available in the buffer, and close when the connection ends. The
+ * input callback must consume complete lines with nb_get_line and
+ * never block waiting for more data; it returns zero once the session
+ * is finished, a negative value if it stopped consuming lines because
+ * the client is not reading its replies or it is suspended, and a
+ * positive value otherwise. The flush callback sends pending replies
+ * without blocking, and returns 1 once all of them are sent, 0 if some
+ * are still pending, or -1 on error; the engine stops reading input
+ * while replies are pending, and calls input again once they are sent
+ * if it stopped early. A session that waits for something other than
+ * the client (e.g., a group commit) can be suspended in engines where
+ * server_wakeup_fd is valid: its flush callback returns
+ * SESSION_SUSPENDED, and the engine neither reads input nor times the
+ * session out until it is resumed, calling flush again every time the
+ * wakeup descriptor is written to. The timeout callback returns how
+ * many seconds the engine waits for more data in the current state of
+ * the session (zero to wait forever); sessions idle for longer are
+ * closed with SESSION_TIMEOUT. Connections refused by admission
+ * control get the refusal reply and are closed without a session.
+ */
+struct session_ops {
+  size_t max_line;
+  void *(*open)(int fd);
+  int (*input)(void *session, net_buffer_t nb);
+  void (*close)(void *session, int reason);
+  int (*flush)(void *session);
+  unsigned int (*timeout)(void *session);
+  const char *refusal;
+};
+
+void server_config_init(struct server_config *config);
+int server_config_option(struct server_config *config, int opt, const char *arg);
+
+void run_server(const char *port, const struct server_config *config,
+		const struct session_ops *ops);
+
+int server_admit_command(int fd);
+int server_wakeup_fd(void);
 
 int send_all(int fd, char buf[], size_t size);
+int send_file(int fd, int file_fd, off_t offset, size_t size);
 
 // The attribute in this function allows gcc to provided useful
 // warnings when compiling the code.
@@ -0,0 +1,220 @@
+/* spool.c
+ * Temporary files holding messages while they are received, before
+ * they are delivered to the mail store.
+ */
+
+#define _GNU_SOURCE
+
+#include "spool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#define SPOOL_BUFFER_SIZE (128 * 1024)
+#define SPOOL_ALIGNMENT 4096
+
+/* Spool files are created as anonymous files (O_TMPFILE) in the spool
+ * directory, so they never appear in the file system until they are
+ * linked into a mailbox, and nothing is left behind if the server
+ * dies while receiving a message. The spool directory must be in the
+ * same file system as the mail store. If the file system does not
+ * support O_TMPFILE, a named file is created instead, and removed when
+ * the spool file is destroyed.
+ *
+ * Data is collected in a large buffer, aligned so that it can be used
+ * for direct I/O, and written only when the buffer is full (or the
+ * file is flushed), so that a message takes a few large writes no
+ * matter how it arrives from the network.
+ */
+struct spool_file {
+  int    fd;
+  int    error;      // set once a write fails
+  int    direct;     // file open with O_DIRECT
+  off_t  offset;     // bytes written to the file so far
+  size_t used;       // bytes in the buffer
+  char  *buffer;
+  char   name[PATH_MAX]; // empty for anonymous files
+};
+
+static const char *spool_directory = ".";
+static int cache_mode = SP_CACHE_NORMAL;
+
+/** Sets the directory where spool files are created. The directory
+ *  must be in the same file system as the mail store.
+ *
+ *  Parameters: directory: Path of the spool directory.
+ */
+void sp_set_directory(const char *directory) {
+  spool_directory = directory;
+}
+
+/** Sets how spool files interact with the page cache. With
+ *  SP_CACHE_NORMAL, the contents are cached as usual. With
+ *  SP_CACHE_DONTNEED, each block is written back as soon as it is
+ *  full, and cached contents are dropped when the file is destroyed,
+ *  once delivery has read them back. With SP_CACHE_DIRECT, files are
+ *  written with direct I/O (O_DIRECT), if the file system supports
+ *  it, bypassing the cache.
+ *
+ *  Parameters: mode: One of the SP_CACHE_* constants.
+ */
+void sp_set_cache_mode(int mode) {
+  cache_mode = mode;
+}
+
+/** Creates a new, empty, spool file.
+ *
+ *  Returns: A spool_file_t object, or NULL if the file could not be
+ *           created (errno is set accordingly).
+ */
+spool_file_t sp_create(void) {
+  
+  spool_file_t sf = malloc(sizeof(struct spool_file));
+  sf->name[0] = 0;
+  sf->error = 0;
+  sf->offset = 0;
+  sf->used = 0;
+  sf->direct = cache_mode == SP_CACHE_DIRECT;
+  sf->fd = open(spool_directory, O_TMPFILE | O_RDWR | (sf->direct ? O_DIRECT : 0), 0600);
+  
+  // Not all file systems support direct I/O
+  if (sf->fd < 0 && sf->direct && errno == EINVAL) {
+    sf->direct = 0;
+    sf->fd = open(spool_directory, O_TMPFILE | O_RDWR, 0600);
+  }
+  
+  if (sf->fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+    snprintf(sf->name, sizeof(sf->name), "%s/template-XXXXXX", spool_directory);
+    sf->fd = mkstemp(sf->name);
+    sf->direct = 0;
+  }
+  
+  if (sf->fd < 0 || posix_memalign((void **) &sf->buffer, SPOOL_ALIGNMENT, SPOOL_BUFFER_SIZE)) {
+    int error = sf->fd < 0 ? errno : ENOMEM;
+    if (sf->fd >= 0)
+      close(sf->fd);
+    free(sf);
+    errno = error;
+    return NULL;
+  }
+  return sf;
+}
+
+/** Returns the file descriptor of a spool file, open for reading and
+ *  writing. Once flushed, the contents can be delivered with
+ *  save_user_mail_fd.
+ *
+ *  Parameters: sf: Spool file to be assessed.
+ *
+ *  Returns: File descriptor of the spool file.
+ */
+int sp_fd(spool_file_t sf) {
+  return sf->fd;
+}
+
+/** Internal function that writes the contents of the buffer to the
+ *  file, applying the cache mode.
+ *
+ *  Returns: 0 if successful, -1 otherwise.
+ */
+static int sp_write_buffer(spool_file_t sf) {
+  
+  size_t done = 0;
+  
+  // Direct I/O requires whole blocks; the last partial block is
+  // written through the page cache
+  if (sf->direct && sf->used % SPOOL_ALIGNMENT) {
+    fcntl(sf->fd, F_SETFL, fcntl(sf->fd, F_GETFL) & ~O_DIRECT);
+    sf->direct = 0;
+  }
+  
+  while (done < sf->used) {
+    ssize_t rv = write(sf->fd, sf->buffer + done, sf->used - done);
+    if (rv < 0) {
+      if (errno == EINTR)
+	continue;
+      sf->error = 1;
+      return -1;
+    }
+    done += rv;
+  }
+  
+  // Start writing this block back, so that little is left dirty
+  // when the file is dropped from the cache (see sp_destroy)
+  if (cache_mode == SP_CACHE_DONTNEED)
+    sync_file_range(sf->fd, sf->offset, sf->used, SYNC_FILE_RANGE_WRITE);
+  
+  sf->offset += sf->used;
+  sf->used = 0;
+  return 0;
+}
+
+/** Appends data to a spool file. Data is buffered, and only written
+ *  to the file in large blocks. Errors are sticky: once a write
+ *  fails, all later calls fail as well.
+ *
+ *  Parameters: sf: Spool file where data is written.
+ *              data: Data to be written.
+ *              size: Number of bytes in data.
+ *
+ *  Returns: 0 if successful, -1 otherwise.
+ */
+int sp_write(spool_file_t sf, const char *data, size_t size) {
+  
+  if (sf->error)
+    return -1;
+  
+  while (size > 0) {
+    size_t count = SPOOL_BUFFER_SIZE - sf->used;
+    if (count > size)
+      count = size;
+    memcpy(sf->buffer + sf->used, data, count);
+    sf->used += count;
+    data += count;
+    size -= count;
+    if (sf->used == SPOOL_BUFFER_SIZE && sp_write_buffer(sf) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/** Writes any buffered data to the spool file. Must be called before
+ *  the contents of the file are used (e.g., delivered). Direct I/O is
+ *  turned off, as delivery reads the file back at arbitrary offsets.
+ *
+ *  Parameters: sf: Spool file to be flushed.
+ *
+ *  Returns: 0 if successful, -1 if this or any previous write failed.
+ */
+int sp_flush(spool_file_t sf) {
+  
+  if (sf->error)
+    return -1;
+  if (sf->used > 0 && sp_write_buffer(sf) < 0)
+    return -1;
+  if (sf->direct) {
+    fcntl(sf->fd, F_SETFL, fcntl(sf->fd, F_GETFL) & ~O_DIRECT);
+    sf->direct = 0;
+  }
+  return 0;
+}
+
+/** Closes a spool file and frees all memory used by it. Copies of the
+ *  file already linked into mailboxes are not affected.
+ *
+ *  Parameters: sf: Spool file to be destroyed.
+ */
+void sp_destroy(spool_file_t sf) {
+  if (sf->name[0])
+    unlink(sf->name);
+  if (cache_mode == SP_CACHE_DONTNEED)
+    posix_fadvise(sf->fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(sf->fd);
+  free(sf->buffer);
+  free(sf);
+}
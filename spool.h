@@ -0,0 +1,25 @@
+/* spool.h
+ * Temporary files holding messages while they are received, before
+ * they are delivered to the mail store.
+ */
+
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <string.h>
+
+#define SP_CACHE_NORMAL   0
+#define SP_CACHE_DONTNEED 1
+#define SP_CACHE_DIRECT   2
+
+typedef struct spool_file *spool_file_t;
+
+void sp_set_directory(const char *directory);
+void sp_set_cache_mode(int mode);
+spool_file_t sp_create(void);
+int sp_write(spool_file_t sf, const char *data, size_t size);
+int sp_flush(spool_file_t sf);
+int sp_fd(spool_file_t sf);
+void sp_destroy(spool_file_t sf);
+
+#endif
@@ -0,0 +1,162 @@
+/* tests/mdx2_index.c
+ * Checks that a mailbox whose index was written in the MDX2 layout is
+ * converted without losing the messages stored in segments, which are
+ * only recorded in the index.
+ */
+
+#define _GNU_SOURCE
+
+#include "mailuser.h"
+#include "segstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAILBOX "mail.store/alice@x.com"
+#define SEGMENTS "mail.store/.segments"
+#define SEGMENT_UID "1.000000.1.0"
+#define FILE_NAME "1.000000.1.1.mail"
+
+static const char segment_message[] = "Subject: one\r\n\r\nfirst\r\nsecond\r\n";
+static const char file_message[] = "Subject: two\r\n\r\nbody\r\n";
+
+// MDX2 layouts, as written before TOP boundaries were recorded
+struct mdx2_header {
+  uint32_t magic;
+  uint32_t count;
+  uint64_t length;
+  int64_t dir_mtime_sec;
+  int64_t dir_mtime_nsec;
+};
+
+struct mdx2_record {
+  uint64_t size;
+  uint64_t offset;
+  uint32_t segment;
+  uint32_t name_length;
+  char name[24];
+};
+
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+    if (!(cond)) {							\
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++;							\
+    }									\
+  } while (0)
+
+/** Writes a file with the given contents. */
+static void write_file(const char *name, const char *data) {
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  write(fd, data, strlen(data));
+  close(fd);
+}
+
+/** Checks that a message in a list has the expected contents. */
+static void check_contents(mail_item_t item, const char *expected) {
+  
+  char buffer[256];
+  off_t offset;
+  
+  int fd = open_mail_item(item, &offset);
+  CHECK(fd >= 0);
+  if (fd < 0)
+    return;
+  ssize_t rv = pread(fd, buffer, strlen(expected), offset);
+  CHECK(rv == (ssize_t) strlen(expected) && !memcmp(buffer, expected, rv));
+  close(fd);
+}
+
+/** Checks a loaded mailbox holding both test messages. */
+static void check_mailbox(mail_list_t list) {
+  
+  CHECK(get_mail_count(list) == 2);
+  if (get_mail_count(list) != 2)
+    return;
+  
+  mail_item_t segment_item = get_mail_item(list, 0);
+  mail_item_t file_item = get_mail_item(list, 1);
+  CHECK(!strcmp(get_mail_item_uid(segment_item), SEGMENT_UID));
+  CHECK(!strcmp(get_mail_item_uid(file_item), FILE_NAME));
+  CHECK(get_mail_item_size(segment_item) == strlen(segment_message));
+  CHECK(get_mail_item_top_size(segment_item, 0) == strlen("Subject: one\r\n\r\n"));
+  CHECK(get_mail_item_top_size(segment_item, 1) == strlen("Subject: one\r\n\r\nfirst\r\n"));
+  CHECK(get_mail_item_top_size(file_item, 5) == strlen(file_message));
+  check_contents(segment_item, segment_message);
+  check_contents(file_item, file_message);
+}
+
+int main(void) {
+  
+  char directory[] = "/tmp/mdx2_indexXXXXXX";
+  uint32_t segment;
+  uint64_t offset;
+  struct stat dir_stat;
+  
+  if (!mkdtemp(directory) || chdir(directory) < 0) {
+    perror(directory);
+    return 1;
+  }
+  mkdir("mail.store", 0777);
+  mkdir(MAILBOX, 0777);
+  
+  // One message in a segment, with a single reference, and one file
+  write_file("message", segment_message);
+  int fd = open("message", O_RDONLY);
+  CHECK(seg_append(SEGMENTS, fd, 1, &segment, &offset) == 0);
+  close(fd);
+  write_file(MAILBOX "/" FILE_NAME, file_message);
+  
+  struct mdx2_record records[2] = {
+    { .size = strlen(segment_message), .offset = offset, .segment = segment,
+      .name_length = sizeof(records[0].name), .name = SEGMENT_UID },
+    { .size = strlen(file_message), .name_length = sizeof(records[1].name), .name = FILE_NAME },
+  };
+  stat(MAILBOX, &dir_stat);
+  struct mdx2_header header = {
+    .magic = 0x3258444dU, .count = 2, .length = sizeof(records),
+    .dir_mtime_sec = dir_stat.st_mtim.tv_sec, .dir_mtime_nsec = dir_stat.st_mtim.tv_nsec
+  };
+  fd = open(MAILBOX "/.index", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  write(fd, &header, sizeof(header));
+  write(fd, records, sizeof(records));
+  close(fd);
+  
+  // The first load converts the index, the second one reads the result
+  mail_list_t list = load_user_mail("alice@x.com");
+  check_mailbox(list);
+  destroy_mail_list(list);
+  list = load_user_mail("alice@x.com");
+  check_mailbox(list);
+  
+  // Deleting the message releases its only reference in the segment
+  mark_mail_item_deleted(get_mail_item(list, 0));
+  destroy_mail_list(list);
+  
+  char path[256];
+  struct { uint32_t magic, closed; uint64_t live; } segment_header;
+  seg_path(SEGMENTS, segment, path, sizeof(path));
+  fd = open(path, O_RDONLY);
+  CHECK(fd >= 0 && pread(fd, &segment_header, sizeof(segment_header), 0) ==
+	sizeof(segment_header) && segment_header.live == 0);
+  close(fd);
+  
+  list = load_user_mail("alice@x.com");
+  CHECK(get_mail_count(list) == 1);
+  destroy_mail_list(list);
+  
+  char command[sizeof(directory) + 16];
+  snprintf(command, sizeof(command), "rm -rf %s", directory);
+  system(command);
+  
+  if (failures)
+    return 1;
+  printf("mdx2_index: ok\n");
+  return 0;
+}
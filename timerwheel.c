@@ -0,0 +1,168 @@
+/* timerwheel.c
+ * Hierarchical timer wheel, used to expire idle connections with
+ * constant-time insertion and removal of timers.
+ */
+
+#include "timerwheel.h"
+
+#include <string.h>
+
+/* Timers expiring in the next TW_ROOT_SIZE ticks are kept in the root
+ * level, one slot per tick. Timers further away go to an upper level,
+ * where each slot covers a range of ticks that grows TW_LEVEL_SIZE
+ * times per level. Each time the root level wraps around, the next
+ * slot of the first upper level is cascaded, i.e., its timers are
+ * redistributed to lower levels; the same happens to the level above
+ * when an upper level wraps around. Adding and removing a timer never
+ * depends on the number of timers, and each timer is moved at most
+ * TW_LEVELS times before it expires.
+ */
+
+// Slot of upper level n that holds a given tick
+#define TW_LEVEL_INDEX(tick, n) \
+  (((tick) >> (TW_ROOT_BITS + (n) * TW_LEVEL_BITS)) & (TW_LEVEL_SIZE - 1))
+
+/** Internal function that inserts a timer at the head of a slot. */
+static void tw_link(struct tw_timer **slot, struct tw_timer *timer) {
+  timer->next = *slot;
+  if (timer->next)
+    timer->next->pprev = &timer->next;
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+/** Internal function that removes a timer from its slot. */
+static void tw_unlink(struct tw_timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next)
+    timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+/** Internal function that finds the slot for a (not pending) timer,
+ *  based on how far in the future it expires.
+ */
+static struct tw_timer **tw_slot(struct timer_wheel *tw, uint64_t expires) {
+
+  // Timers already expired are run in the next processed tick
+  if (expires < tw->current)
+    return &tw->root[tw->current & (TW_ROOT_SIZE - 1)];
+
+  uint64_t delay = expires - tw->current;
+  if (delay < TW_ROOT_SIZE)
+    return &tw->root[expires & (TW_ROOT_SIZE - 1)];
+
+  for (int n = 0; n < TW_LEVELS; n++)
+    if (delay >> (TW_ROOT_BITS + (n + 1) * TW_LEVEL_BITS) == 0)
+      return &tw->levels[n][TW_LEVEL_INDEX(expires, n)];
+
+  // Unreachable, since tw_add clamps the delay
+  return &tw->levels[TW_LEVELS - 1][TW_LEVEL_INDEX(expires, TW_LEVELS - 1)];
+}
+
+/** Internal function that moves all timers in a slot of an upper
+ *  level to the lower levels.
+ *
+ *  Returns: the index of the cascaded slot, so that the caller can
+ *           tell whether this level wrapped around.
+ */
+static int tw_cascade(struct timer_wheel *tw, int level) {
+
+  int index = TW_LEVEL_INDEX(tw->current, level);
+  struct tw_timer *timer = tw->levels[level][index];
+
+  tw->levels[level][index] = NULL;
+  while (timer) {
+    struct tw_timer *next = timer->next;
+    tw_link(tw_slot(tw, timer->expires), timer);
+    timer = next;
+  }
+  return index;
+}
+
+/** Initializes an empty timer wheel.
+ *
+ *  Parameters: tw: Timer wheel to be initialized.
+ *              now: Current tick; ticks may use any time unit, as
+ *                   long as they are used consistently.
+ */
+void tw_init(struct timer_wheel *tw, uint64_t now) {
+  memset(tw, 0, sizeof(*tw));
+  tw->current = now;
+}
+
+/** Schedules a timer. If the timer is already pending, it is
+ *  rescheduled.
+ *
+ *  Parameters: tw: Timer wheel.
+ *              timer: Timer to be scheduled.
+ *              expires: Tick at which the timer expires. Timers
+ *                       further than TW_MAX_DELAY ticks in the future
+ *                       expire after TW_MAX_DELAY ticks.
+ */
+void tw_add(struct timer_wheel *tw, struct tw_timer *timer, uint64_t expires) {
+
+  if (tw_pending(timer))
+    tw_remove(tw, timer);
+
+  if (expires > tw->current && expires - tw->current > TW_MAX_DELAY)
+    expires = tw->current + TW_MAX_DELAY;
+
+  timer->expires = expires;
+  tw_link(tw_slot(tw, expires), timer);
+  tw->count++;
+}
+
+/** Cancels a timer. Has no effect if the timer is not pending.
+ *
+ *  Parameters: tw: Timer wheel where the timer was scheduled.
+ *              timer: Timer to be cancelled.
+ */
+void tw_remove(struct timer_wheel *tw, struct tw_timer *timer) {
+  if (!tw_pending(timer))
+    return;
+  tw_unlink(timer);
+  tw->count--;
+}
+
+/** Processes all ticks up to (and including) the current one, calling
+ *  a function for each timer that expired. Expired timers are no
+ *  longer pending when the function is called, so the function may
+ *  reschedule them, or free the object that contains them.
+ *
+ *  Parameters: tw: Timer wheel.
+ *              now: Current tick.
+ *              expired: Function called for each expired timer.
+ *              arg: Argument passed to the function.
+ */
+void tw_advance(struct timer_wheel *tw, uint64_t now, tw_callback expired, void *arg) {
+
+  // Nothing to cascade or expire in an empty wheel
+  if (!tw->count && tw->current <= now)
+    tw->current = now + 1;
+
+  while (tw->current <= now) {
+
+    int index = tw->current & (TW_ROOT_SIZE - 1);
+    if (!index)
+      for (int n = 0; n < TW_LEVELS && !tw_cascade(tw, n); n++);
+
+    // Detach the slot, so timers rescheduled by the callback are not
+    // processed in this same tick
+    struct tw_timer *list = NULL;
+    if (tw->root[index]) {
+      list = tw->root[index];
+      list->pprev = &list;
+      tw->root[index] = NULL;
+    }
+    tw->current++;
+
+    while (list) {
+      struct tw_timer *timer = list;
+      tw_unlink(timer);
+      tw->count--;
+      expired(timer, arg);
+    }
+  }
+}
@@ -0,0 +1,50 @@
+/* timerwheel.h
+ * Hierarchical timer wheel, used to expire idle connections with
+ * constant-time insertion and removal of timers.
+ */
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TW_ROOT_BITS  8 // slots of the first level, one per tick
+#define TW_LEVEL_BITS 6 // slots of each of the upper levels
+#define TW_LEVELS     3 // number of upper levels
+
+#define TW_ROOT_SIZE  (1 << TW_ROOT_BITS)
+#define TW_LEVEL_SIZE (1 << TW_LEVEL_BITS)
+
+// Timers further in the future are clamped to this many ticks
+#define TW_MAX_DELAY ((1ULL << (TW_ROOT_BITS + TW_LEVELS * TW_LEVEL_BITS)) - 1)
+
+/* A timer is embedded in the object it refers to, so the wheel never
+ * allocates memory. A timer that is not pending has a NULL pprev.
+ */
+struct tw_timer {
+  struct tw_timer *next;
+  struct tw_timer **pprev;
+  uint64_t expires;  // tick at which the timer expires
+};
+
+struct timer_wheel {
+  uint64_t current;  // next tick to be processed
+  size_t count;      // pending timers
+  struct tw_timer *root[TW_ROOT_SIZE];
+  struct tw_timer *levels[TW_LEVELS][TW_LEVEL_SIZE];
+};
+
+typedef void (*tw_callback)(struct tw_timer *timer, void *arg);
+
+void tw_init(struct timer_wheel *tw, uint64_t now);
+void tw_add(struct timer_wheel *tw, struct tw_timer *timer, uint64_t expires);
+void tw_remove(struct timer_wheel *tw, struct tw_timer *timer);
+void tw_advance(struct timer_wheel *tw, uint64_t now, tw_callback expired, void *arg);
+
+/** Checks if a timer is waiting in a wheel. */
+static inline int tw_pending(const struct tw_timer *timer) {
+  return timer->pprev != NULL;
+}
+
+#endif